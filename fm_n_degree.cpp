@@ -10,6 +10,18 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <limits.h>
+#include <alloca.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <errno.h>
 
 #ifndef MAX
 #define MAX(a,b) ( ((a) > (b)) ? (a) : (b) )
@@ -19,897 +31,6019 @@
 #define MIN(a,b) ( ((a) < (b)) ? (a) : (b) )
 #endif
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// Memory policies of mbind, numaif.h is not always installed
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+
 namespace fm_n_degree {
 
-const int FM::S_MAX_STOP_ITER_NUM = 200;
-const int FM::S_MINI_BATCH_SIZE = 800;
+// Bit casts between float and its IEEE 754 representation
+static inline unsigned int float_to_bits(float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
 
-FM::FM() : m_featNum(0), m_dataNum(0), m_data(NULL), m_degree(0), m_factSize(0), m_w0(0.0f), m_w(NULL), 
-		   m_v(NULL), m_regFactor(0.0f), m_learnRate(0.0f), m_gradW0(0.0f), m_gradW(NULL), m_gradV(NULL), 
-		   m_sumGrad2(0.0f), m_momentumW0(0.0f), m_momentumW(NULL), m_momentumV(NULL), m_partialFmFlag(0), 
-		   m_fmFeatFlag(NULL), m_maxLabel(0), m_minLabel(0), m_initStdDev(0.0f), m_norm(2), m_sumW0(0.0f), 
-		   m_sumW(NULL), m_sumV(NULL)
+static inline float bits_to_float(unsigned int bits)
 {
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
 }
 
-FM::~FM()
+// Integer hash, source of the stochastic rounding noise
+static inline unsigned int hash_uint(unsigned int x)
 {
-	// Free data
-	if (m_data != NULL) {
-		for (int i = 0; i < m_dataNum; ++i) {
-			if (m_data[i].x != NULL) {
-				delete m_data[i].x;
-				m_data[i].x = NULL;
-			}
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+// Hash of the label and the non-zero features of a row
+static inline unsigned int hash_row(const Data* ptrData, int featNum)
+{
+	unsigned int hash = hash_uint(static_cast<unsigned int>(ptrData->y));
+	for (int i = 0; i < featNum; ++i) {
+		if (ptrData->x[i] != 0.0f) {
+			hash = hash_uint(hash ^ (static_cast<unsigned int>(i) * 0x9e3779b1U) ^ float_to_bits(ptrData->x[i]));
 		}
-		delete m_data;
-		m_data = NULL;
 	}
+	return hash;
+}
 
-	// Free model
-	if (m_w != NULL) {
-		delete m_w;
-		m_w = NULL;
-	}
+static inline bool same_row(const Data* a, const Data* b, int featNum)
+{
+	return a->y == b->y && a->nnz == b->nnz && memcmp(a->x, b->x, sizeof(float) * featNum) == 0;
+}
 
-	if (m_v != NULL) {
-		for (int i = 0; i < m_degree; ++i) {
-			if (m_v[i] != NULL) {
-				delete m_v[i];
-				m_v[i] = NULL;
-			}
-		}
-		delete m_v;
-		m_v = NULL;
+// xoshiro128**, the state is filled through hash_uint so nearby seeds give unrelated streams
+static inline void seed_rand(RandState* state, unsigned int seed)
+{
+	for (int i = 0; i < 4; ++i) {
+		seed = hash_uint(seed + 0x9e3779b9U);
+		state->s[i] = seed;
 	}
-	
-	if (m_sumW != NULL) {
-		delete m_sumW;
-		m_sumW = NULL;
+	if ((state->s[0] | state->s[1] | state->s[2] | state->s[3]) == 0) {
+		state->s[0] = 1;
 	}
+}
 
-	if (m_sumV != NULL) {
-		for (int i = 0; i < m_degree; ++i) {
-			if (m_sumV[i] != NULL) {
-				delete m_sumV[i];
-				m_sumV[i] = NULL;
-			}
-		}
-		delete m_sumV;
-		m_sumV = NULL;
-	}
+static inline unsigned int rotl_uint(unsigned int x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
 
-	// Free gradients
-	if (m_gradW != NULL) {
-		delete m_gradW;
-		m_gradW = NULL;
-	}
+static inline unsigned int next_rand(RandState* state)
+{
+	unsigned int* s = state->s;
+	unsigned int result = rotl_uint(s[1] * 5, 7) * 9;
+	unsigned int t = s[1] << 9;
 
-	if (m_gradV != NULL) {
-		for (int i = 0; i < m_degree; ++i) {
-			if (m_gradV[i] != NULL) {
-				delete m_gradV[i];
-				m_gradV[i] = NULL;
-			}
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl_uint(s[3], 11);
+
+	return result;
+}
+
+// Unbiased integer in [0, bound), multiply and shift with rejection (Lemire)
+static inline int rand_below(RandState* state, int bound)
+{
+	unsigned long long product = static_cast<unsigned long long>(next_rand(state)) * bound;
+	unsigned int low = static_cast<unsigned int>(product);
+	if (low < static_cast<unsigned int>(bound)) {
+		unsigned int threshold = -static_cast<unsigned int>(bound) % static_cast<unsigned int>(bound);
+		while (low < threshold) {
+			product = static_cast<unsigned long long>(next_rand(state)) * bound;
+			low = static_cast<unsigned int>(product);
 		}
-		delete m_gradV;
-		m_gradV = NULL;
 	}
+	return static_cast<int>(product >> 32);
+}
 
-	// Free momentum
-	if (m_momentumW != NULL) {
-		delete m_momentumW;
-		m_momentumW= NULL;
-	}
+// Philox4x32-10 (Salmon et al., SC'11), a counter-based generator: the output is a bijection
+// of the counter under the key, so any value can be drawn in any order and on any thread
+static inline void philox4x32(const unsigned int* counter, const unsigned int* key, unsigned int* out)
+{
+	unsigned int c0 = counter[0];
+	unsigned int c1 = counter[1];
+	unsigned int c2 = counter[2];
+	unsigned int c3 = counter[3];
+	unsigned int k0 = key[0];
+	unsigned int k1 = key[1];
 
-	if (m_momentumV != NULL) {
-		for (int i = 0; i < m_degree; ++i) {
-			if (m_momentumV[i] != NULL) {
-				delete m_momentumV[i];
-				m_momentumV[i] = NULL;
-			}
-		}
-		delete m_momentumV;
-		m_momentumV = NULL;
+	for (int r = 0; r < 10; ++r) {
+		unsigned long long p0 = 0xd2511f53ULL * c0;
+		unsigned long long p1 = 0xcd9e8d57ULL * c2;
+		c0 = static_cast<unsigned int>(p1 >> 32) ^ c1 ^ k0;
+		c1 = static_cast<unsigned int>(p1);
+		c2 = static_cast<unsigned int>(p0 >> 32) ^ c3 ^ k1;
+		c3 = static_cast<unsigned int>(p0);
+		k0 += 0x9e3779b9U;
+		k1 += 0xbb67ae85U;
 	}
 
-	// Free sparseFlag
-	if (m_fmFeatFlag != NULL) {
-		delete m_fmFeatFlag;
-		m_fmFeatFlag = NULL;
-	}		
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
 }
 
-void FM::set_regular_factor(float regFactor)
+// Four standard normals of one Philox block, Box-Muller on two pairs of uniforms
+static inline void philox_normal(const unsigned int* counter, const unsigned int* key, float* normal)
 {
-	m_regFactor = regFactor;
+	const double TWO_PI = 6.283185307179586;
+	unsigned int bits[4];
+	philox4x32(counter, key, bits);
+
+	for (int n = 0; n < 4; n += 2) {
+		double u1 = (bits[n] + 1.0) / 4294967296.0;		// (0, 1], log is finite
+		double u2 = bits[n + 1] / 4294967296.0;
+		double radius = sqrt(-2.0 * log(u1));
+		normal[n] = static_cast<float>(radius * cos(TWO_PI * u2));
+		normal[n + 1] = static_cast<float>(radius * sin(TWO_PI * u2));
+	}
 }
 
-void FM::set_learn_rate(float learnRate)
+static inline float bf16_to_float(unsigned short half)
 {
-	m_learnRate = learnRate;
+	return bits_to_float(static_cast<unsigned int>(half) << 16);
 }
 
-void FM::set_fm_degree(int degree)
+// Round to bfloat16, adding noise below the kept bits rounds stochastically
+static inline unsigned short float_to_bf16(float value, unsigned int noise)
 {
-	m_degree = degree;
+	unsigned int bits = float_to_bits(value);
+	if ((bits & 0x7f800000U) == 0x7f800000U) {
+		// Inf, or a NaN kept quiet so that truncating its payload cannot turn it into Inf
+		unsigned int quiet = ((bits & 0x7fffffU) != 0) ? 0x40 : 0;
+		return static_cast<unsigned short>((bits >> 16) | quiet);
+	}
+	
+	unsigned int rounded = bits + (noise & 0xffffU);
+	if ((rounded & 0x7f800000U) == 0x7f800000U) {
+		rounded = bits;			// Never round a finite value up to Inf
+	}
+
+	return static_cast<unsigned short>(rounded >> 16);
 }
 
-void FM::set_mini_batch(int mini_batch)
+static inline float fp16_to_float(unsigned short half)
 {
-    m_mini_batch = mini_batch;
+	unsigned int sign = static_cast<unsigned int>(half & 0x8000) << 16;
+	unsigned int exp = (half >> 10) & 0x1f;
+	unsigned int mant = half & 0x3ff;
+
+	if (exp == 0x1f) {
+		return bits_to_float(sign | 0x7f800000U | (mant << 13));
+	}
+	if (exp == 0) {				// Zero and subnormals
+		float value = mant / 16777216.0f;
+		return sign != 0 ? -value : value;
+	}
+
+	return bits_to_float(sign | ((exp + 112) << 23) | (mant << 13));
 }
 
-void FM::set_iterations_num(int iter_num)
+// Round to IEEE half, adding noise below the kept bits rounds stochastically
+static inline unsigned short float_to_fp16(float value, unsigned int noise)
 {
-    m_iter_num = iter_num;
+	unsigned int bits = float_to_bits(value);
+	unsigned int sign = (bits >> 16) & 0x8000;
+	int exp = static_cast<int>((bits >> 23) & 0xff) - 112;
+	unsigned int mant = bits & 0x7fffff;
+
+	if (((bits >> 23) & 0xff) == 0xff) {
+		return static_cast<unsigned short>(sign | 0x7c00 | (mant != 0 ? 0x200 : 0));
+	}
+	if (exp >= 0x1f) {
+		return static_cast<unsigned short>(sign | 0x7bff);		// Saturate
+	}
+
+	int shift = 13;
+	if (exp <= 0) {				// Subnormal result
+		if (exp < -10) {
+			return static_cast<unsigned short>(sign);
+		}
+		mant |= 0x800000;
+		shift = 14 - exp;
+		exp = 0;
+	}
+
+	// A carry out of the mantissa correctly bumps the exponent
+	mant += noise & ((1U << shift) - 1);
+	unsigned int half = (static_cast<unsigned int>(exp) << 10) + (mant >> shift);
+	if (half >= 0x7c00) {
+		half = 0x7bff;
+	}
+
+	return static_cast<unsigned short>(sign | half);
 }
 
-void FM::set_factor_size(int factSize)
+// Readers of one factor row in its storage precision. The row kernels below are instantiated per
+// reader, so a loop over a row dispatches on the precision once and not for every factor
+struct Fp32Row {
+	explicit Fp32Row(const float* values) : row(values) {}
+	float operator[](int c) const { return row[c]; }
+	const float* row;
+};
+
+struct Bf16Row {
+	explicit Bf16Row(const unsigned short* values) : row(values) {}
+	float operator[](int c) const { return bf16_to_float(row[c]); }
+	const unsigned short* row;
+};
+
+struct Fp16Row {
+	explicit Fp16Row(const unsigned short* values) : row(values) {}
+	float operator[](int c) const { return fp16_to_float(row[c]); }
+	const unsigned short* row;
+};
+
+// Sum, square sum and cube sum of v[c] * x over the columns [colBegin, colEnd) of one factor row
+template <class Row>
+static inline float sum_row(Row v, const float* x, const int* featList, int colBegin, int colEnd, 
+		float* squareSum, float* cubeSum)
 {
-	m_factSize = factSize;
+	float sum = 0.0f;
+	float square = 0.0f;
+	float cube = 0.0f;
+	for (int c = colBegin; c < colEnd; ++c) {
+		float xc = x[featList[c]];
+		if (xc < 1e-6 && xc > -1e-6) {
+			continue;
+		}
+
+		float tempScore = v[c] * xc;
+		sum += tempScore;
+		square += tempScore * tempScore;
+		cube += tempScore * tempScore * tempScore;
+	}
+
+	*squareSum = square;
+	*cubeSum = cube;
+	return sum;
 }
 
-void FM::set_partial_fm_flag(int flag)
+// Adds 2 * error * d(score) / d(v[c]) of one factor row to grad[c], degree = degree + 1
+template <class Row>
+static inline void add_row_grads(Row v, const float* x, const int* featList, int colBegin, int colEnd, 
+		int degree, float sum, float squareSum, float error, float* grad)
 {
-	m_partialFmFlag = flag;
+	float sumSquare = sum * sum;
+	for (int c = colBegin; c < colEnd; ++c) {
+		float xc = x[featList[c]];
+		if (xc < 1e-6 && xc > -1e-6) {
+			continue;
+		}
+
+		float gradItem = 0.0f;
+		float item = v[c] * xc;
+		if (degree == 1) {
+			gradItem = xc * (sum - item);
+		} else if (degree == 2) {
+			gradItem = xc * (0.5 * sumSquare - sum * item - 0.5 * squareSum + item * item);
+		}
+
+		grad[c] += 2 * error * gradItem;
+	}
 }
 
-void FM::set_init_std_dev(float stdDev)
+template <class Row>
+static inline void add_row(Row v, int num, float* sums)
 {
-	m_initStdDev = stdDev;
+	for (int n = 0; n < num; ++n) {
+		sums[n] += v[n];
+	}
 }
 
-void FM::set_regular_term(int regularTerm)
+const size_t Arena::S_ALIGNMENT = 64;
+
+Arena::Arena() : m_base(NULL), m_size(0), m_mapSize(0), m_used(0)
 {
-	m_norm = regularTerm;
 }
 
-int FM::read_data(const char* fileName)
+Arena::~Arena()
 {
-	// Format: y(-1/0, 1) \t x1 \t x2 \t, ...
-	FILE* fp = fopen(fileName, "r");
-	if (fp == NULL) {
-		printf("[ERROR] Cannot open %s! Reading data failed!\n", fileName);
-		return -1;
-	}
+	release();
+}
 
-	const int MAX_LINE_DATA_LEN = 100000;
-	char buf[MAX_LINE_DATA_LEN];
+size_t Arena::align_size(size_t size)
+{
+	return (size + S_ALIGNMENT - 1) / S_ALIGNMENT * S_ALIGNMENT;
+}
 
-	// Count data number, and allocate data memory
-	m_dataNum = 0;
-	m_featNum = 0;
-	
-	while (fgets(buf, MAX_LINE_DATA_LEN, fp) != NULL) {
-		++m_dataNum;
+int Arena::create(size_t size, int hugePageMode)
+{
+	release();
 
-		// Count feature number
-		char* ptr = buf + strlen(buf);
-		while (*ptr != ' ' && *ptr != '\t' && ptr != buf) {
-			if (*ptr == ':') {
-				*ptr = '\0';
-			}
-			--ptr;
+	if (size == 0) {
+		size = S_ALIGNMENT;
+	}
+
+	// Try explicit huge pages first, falling back to regular pages
+	void* base = MAP_FAILED;
+	if (hugePageMode == HUGE_PAGE_2MB || hugePageMode == HUGE_PAGE_1GB) {
+		int shift = (hugePageMode == HUGE_PAGE_2MB) ? 21 : 30;
+		size_t pageSize = static_cast<size_t>(1) << shift;
+		m_mapSize = (size + pageSize - 1) / pageSize * pageSize;
+		base = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE, 
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+		if (base == MAP_FAILED) {
+			printf("[WARNING] Cannot map %luMB of %s huge pages, using transparent huge pages!\n", 
+					m_mapSize >> 20, hugePageMode == HUGE_PAGE_2MB ? "2MB" : "1GB");
+			hugePageMode = HUGE_PAGE_THP;
 		}
+	}
 
-		int maxFeatNum = static_cast<int>(strtol(ptr + 1, NULL, 10));
-		if (maxFeatNum < 1) {
-			printf("[ERROR] Invalid data format, wrong feature index!\n");
-			fclose(fp);
+	if (base == MAP_FAILED) {
+		size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		m_mapSize = (size + pageSize - 1) / pageSize * pageSize;
+		base = mmap(NULL, m_mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			printf("[ERROR] Cannot map %lu bytes for the arena!\n", m_mapSize);
+			m_mapSize = 0;
 			return -1;
 		}
-		
-		m_featNum = MAX(m_featNum, maxFeatNum);
-	}
 
-	if (m_dataNum < 1) {
-		printf("[ERROR] No data in the file!\n");
-		fclose(fp);
-		return -1;
+#ifdef MADV_HUGEPAGE
+		if (hugePageMode == HUGE_PAGE_THP) {
+			madvise(base, m_mapSize, MADV_HUGEPAGE);
+		}
+#endif
 	}
 
-	// Allocate memory and initialize data
-	m_data = new Data[m_dataNum];
-	for (int i = 0; i < m_dataNum; ++i) {
-		m_data[i].y = 0;
-		m_data[i].x = NULL;
-		m_data[i].score = 0.0f;
-		m_data[i].sumVX = 0.0f;
-	}
-	
-	rewind(fp);				// Back to the head of the file
-	
-	// Parse data
-	int lineNum = 0;
-	m_dataNum = 0;			// Reset data number, drop invalid data
-	while (fgets(buf, MAX_LINE_DATA_LEN, fp) != NULL) {
-		++lineNum;
-		if (parse_line(buf, m_data + m_dataNum) != 0) {
-			printf("[WARNING] Parsing line %d failed!\n", lineNum);
-			continue;
-		}
+	// Anonymous mappings are zero filled
+	m_base = static_cast<char*>(base);
+	m_size = size;
+	m_used = 0;
 
-		++m_dataNum;
-	}
-	
-	fclose(fp);
 	return 0;
 }
 
-int FM::parse_line(char* buf, Data* ptrData)
+int Arena::bind_numa(int interleaveFlag, const int* nodeIds, int nodeNum)
 {
-	// Parse label
-	char* ptr = strtok(buf, "\t ");
-	if(ptr == NULL) {
-		printf("[WARNING] Parsing label failed!\n");
+	// Must be called before the first touch of the mapping
+	const int MAX_NODE_NUM = 1024;
+	unsigned long nodeMask[MAX_NODE_NUM / (8 * sizeof(unsigned long))];
+	memset(nodeMask, 0, sizeof(nodeMask));
+	for (int n = 0; n < nodeNum; ++n) {
+		if (nodeIds[n] >= 0 && nodeIds[n] < MAX_NODE_NUM) {
+			nodeMask[nodeIds[n] / (8 * sizeof(unsigned long))] |= 1UL << (nodeIds[n] % (8 * sizeof(unsigned long)));
+		}
+	}
+
+	int policy = (interleaveFlag != 0) ? MPOL_INTERLEAVE : MPOL_BIND;
+	if (m_base == NULL || syscall(SYS_mbind, m_base, m_mapSize, policy, nodeMask, MAX_NODE_NUM, 0) != 0) {
+		printf("[WARNING] Cannot %s the arena, default NUMA placement is used!\n", 
+				(interleaveFlag != 0) ? "interleave" : "bind");
 		return -1;
 	}
-	
-	ptrData->y = static_cast<int>(strtol(ptr, NULL, 10));
 
-	// Get maxLabel and minLabel
-	m_maxLabel = MAX(m_maxLabel, ptrData->y);
-	m_minLabel = MIN(m_minLabel, ptrData->y);
+	return 0;
+}
 
-	// Allocate data memory
-	ptrData->x = new float[m_featNum];
-	for (int i = 0; i < m_featNum; i++) {
-		ptrData->x[i] = 0.0f;
+void* Arena::alloc(size_t size)
+{
+	size = align_size(size);
+	if (m_base == NULL || m_used + size > m_size) {
+		printf("[ERROR] Arena overflow, %lu bytes requested, %lu bytes left!\n", size, m_size - m_used);
+		return NULL;
 	}
-	
-	// Parse feature
-	ptr = strtok(NULL, ":");
-	while (ptr != NULL) {
-		int index =  static_cast<int>(strtol(ptr, NULL, 10));
-		if (index > m_featNum or index < 1) {
-			printf("[WARNING] Invalid feature index!\n");
-			delete ptrData->x;
-			ptrData->x = NULL;
-			return -1;
- 		}
 
-		ptr = strtok(NULL, "\t ");		
-		ptrData->x[index - 1] = strtof(ptr, NULL);
-		ptr = strtok(NULL, ":");
+	void* ptr = m_base + m_used;
+	m_used += size;
+
+	return ptr;
+}
+
+void Arena::release()
+{
+	if (m_base != NULL) {
+		munmap(m_base, m_mapSize);
+		m_base = NULL;
 	}
-	
-	return 0;
+
+	m_size = 0;
+	m_mapSize = 0;
+	m_used = 0;
 }
 
-int FM::initialize()
-{	
-	// Initialize w0	
-	m_w0 = 0.0f;
-	m_momentumW0 = 0.0f;
+const int FM::S_MAX_STOP_ITER_NUM = 200;
+const int FM::S_MINI_BATCH_SIZE = 800;
+const float FM::S_MOMENTUM_FACTOR = 0.0f;
+const int FM::S_GRAD_SHARD_SIZE = 32;
+const int FM::S_MAX_ENTRY_COUNT = 4;
+const int FM::S_FACTOR_ALIGN = 32;
+const int FM::S_TASKS_PER_THREAD = 8;
+const int FM::S_MAX_PS_SERVER_NUM = 256;
+const int FM::S_MAX_PS_PULL_NUM = 65536;
 
-	m_sumW0 = 0.0f;
-		
-	// Allocate memory for weights and gradients
-	if (m_featNum < 0) {
-		printf("[ERROR] Invalid feature number!\n");
-		return -1;
-	}   
-	
-	m_w = new float[m_featNum];
-	m_gradW = new float[m_featNum];
-	m_momentumW = new float[m_featNum];
-	m_sumW = new float[m_featNum];
-	
-	// Initialize w
-	for (int i = 0; i < m_featNum; ++i) {
-		m_w[i] = 0.0f;
-		m_gradW[i] = 0.0f;
-		m_momentumW[i] = 0.0f;
-		m_sumW[i] = 0.0f;
-	}
-	
-	// Allocate memory for factors and gradients
-	m_v = new float* [m_degree];
-	m_gradV = new float* [m_degree];
-	m_momentumV = new float* [m_degree];
-	m_sumV = new float* [m_degree];	
-	
-	srand(time(0));
-	for (int i = 0; i < m_degree; ++i) {
-		m_v[i] = new float[m_factSize * m_featNum];
-		m_gradV[i] = new float[m_factSize * m_featNum];
-		m_momentumV[i] = new float[m_factSize * m_featNum];
-		m_sumV[i] = new float[m_factSize * m_featNum];
-
-		// Initialize
-		for (int j = 0; j < m_factSize * m_featNum; ++j) {
-			m_v[i][j] = get_normal_rand(m_initStdDev);
-			m_gradV[i][j] = 0.0f;
-			m_momentumV[i][j] = 0.0f;
-			m_sumV[i][j] = 0.0f;
-		}
-	}
+// Argument of a worker thread started by FM::run_threads
+struct ThreadTask {
+	FM* fm;
+	ThreadFunc func;
+	int threadId;
+	void* arg;
+};
 
-	m_sumGrad2 = 0.0f;
-	m_partialFmFlag = 0;
+// Contribution of one parameter to the regularization norm
+static inline float reg_norm(int norm, float value)
+{
+	return (norm == 1) ? fabs(value) : value * value;
+}
 
-	// Allocate memory for sparse flags
-	m_fmFeatFlag = new int[m_featNum];
-	for (int i = 0; i < m_featNum; ++i) {
-		m_fmFeatFlag[i] = 0;
-	}
+// Even split of [0, num) for one of threadNum threads
+static inline void split_range(int num, int threadId, int threadNum, int* begin, int* end)
+{
+	*begin = static_cast<int>(static_cast<long long>(num) * threadId / threadNum);
+	*end = static_cast<int>(static_cast<long long>(num) * (threadId + 1) / threadNum);
+}
 
-	calculate_fm_feat_flags();
-/*	for (int i = 0; i < m_featNum; ++i) {
-		if (m_fmFeatFlag[i] == 1) {
-			printf("%d:1\t", i);
-		}
-	}
-	getchar();
-*/	
-	return 0;
+// Split num elements on multiples of align, so neighbouring threads never write the same cache line
+static inline void split_aligned_range(int num, int align, int threadId, int threadNum, int* begin, int* end)
+{
+	split_range((num + align - 1) / align, threadId, threadNum, begin, end);
+	*begin = MIN(*begin * align, num);
+	*end = MIN(*end * align, num);
 }
 
-float FM::get_normal_rand(float stdDev)
+// Slots of a sample in feature-parallel mode: linear term, then per degree and factor
+// sum, square sum and cube sum in FM::m_featPartial, sum and square sum in FM::m_featTotal
+static inline int feat_partial_size(int degree, int factSize)
 {
-	const int RAND_NUM = 25;
-	float x = 0.0f;
-	
-	for (int i = 0; i < RAND_NUM; ++i) {
-		x += (float)rand() / RAND_MAX;
-	}
+	return 1 + 3 * (degree - 1) * factSize;
+}
 
-	x -= RAND_NUM / 2.0f;
-	x /= sqrt(RAND_NUM / 12.0f);
-	x *= stdDev;
-	
-	return x;
+static inline int feat_total_size(int degree, int factSize)
+{
+	return 1 + 2 * (degree - 1) * factSize;
 }
 
-int FM::calculate_fm_feat_flags()
+static double get_time_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Read a small sysfs file, the trailing newline is removed
+static int read_sys_file(const char* path, char* buf, int size)
+{
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	int ret = (fgets(buf, size, fp) != NULL) ? 0 : -1;
+	fclose(fp);
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return ret;
+}
+
+// Parse a sysfs id list like "0-3,8-11" into a new array, return the id number
+static int parse_id_list(const char* str, int** ids)
+{
+	int num = 0;
+	int capacity = 16;
+	*ids = new int[capacity];
+
+	const char* ptr = str;
+	while (*ptr != '\0') {
+		char* endPtr = NULL;
+		int first = static_cast<int>(strtol(ptr, &endPtr, 10));
+		if (endPtr == ptr) {
+			break;
+		}
+		int last = first;
+		ptr = endPtr;
+		if (*ptr == '-') {
+			last = static_cast<int>(strtol(ptr + 1, &endPtr, 10));
+			ptr = endPtr;
+		}
+
+		for (int id = first; id <= last; ++id) {
+			if (num == capacity) {
+				int* larger = new int[2 * capacity];
+				memcpy(larger, *ids, sizeof(int) * num);
+				delete[] *ids;
+				*ids = larger;
+				capacity *= 2;
+			}
+			(*ids)[num++] = id;
+		}
+
+		if (*ptr == ',') {
+			++ptr;
+		}
+	}
+
+	return num;
+}
+
+static void build_cpu_set(const int* cpus, int cpuNum, cpu_set_t* cpuSet)
+{
+	CPU_ZERO(cpuSet);
+	for (int n = 0; n < cpuNum; ++n) {
+		if (cpus[n] >= 0 && cpus[n] < CPU_SETSIZE) {
+			CPU_SET(cpus[n], cpuSet);
+		}
+	}
+}
+
+static void* thread_entry(void* arg)
+{
+	ThreadTask* task = static_cast<ThreadTask*>(arg);
+	(task->fm->*(task->func))(task->threadId, task->arg);
+	return NULL;
+}
+
+static void* pipeline_entry(void* arg)
+{
+	static_cast<FM*>(arg)->pipeline_thread(0, NULL);
+	return NULL;
+}
+
+static void* checkpoint_entry(void* arg)
+{
+	static_cast<FM*>(arg)->checkpoint_thread(0, NULL);
+	return NULL;
+}
+
+// Floats per feature in parameter-server messages: w, then v of every degree
+static inline int ps_row_size(int degree, int factSize)
+{
+	return 1 + (degree - 1) * factSize;
+}
+
+// Owner server of a feature
+static inline int ps_owner(int feat, int serverNum)
+{
+	return feat % serverNum;
+}
+
+static int ps_send_all(int fd, const void* buf, size_t len)
+{
+	const char* ptr = static_cast<const char*>(buf);
+	while (len > 0) {
+		ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int ps_recv_all(int fd, void* buf, size_t len)
+{
+	char* ptr = static_cast<char*>(buf);
+	while (len > 0) {
+		ssize_t n = recv(fd, ptr, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int ps_send_message(int fd, int type, const void* payload, size_t len)
+{
+	PsHeader header;
+	header.type = type;
+	header.len = static_cast<int>(len);
+	if (ps_send_all(fd, &header, sizeof(header)) != 0) {
+		return -1;
+	}
+	return (len > 0) ? ps_send_all(fd, payload, len) : 0;
+}
+
+// Grow a message buffer to at least size bytes
+static char* ps_reserve(char** buf, size_t* bufSize, size_t size)
+{
+	if (*bufSize < size) {
+		delete[] *buf;
+		*bufSize = MAX(size, 2 * (*bufSize));
+		*buf = new char[*bufSize];
+	}
+	return *buf;
+}
+
+static int ps_recv_message(int fd, PsHeader* header, char** buf, size_t* bufSize)
+{
+	if (ps_recv_all(fd, header, sizeof(PsHeader)) != 0 || header->len < 0) {
+		return -1;
+	}
+	ps_reserve(buf, bufSize, header->len + sizeof(float));
+	return (header->len > 0) ? ps_recv_all(fd, *buf, header->len) : 0;
+}
+
+// Receive PS_MSG_ACK and return its status
+static int ps_recv_ack(int fd, char** buf, size_t* bufSize)
+{
+	PsHeader header;
+	if (ps_recv_message(fd, &header, buf, bufSize) != 0 || header.type != PS_MSG_ACK 
+			|| header.len != sizeof(int)) {
+		return -1;
+	}
+	return *reinterpret_cast<int*>(*buf);
+}
+
+static int ps_send_ack(int fd, int status)
+{
+	return ps_send_message(fd, PS_MSG_ACK, &status, sizeof(status));
+}
+
+static int ps_connect(const char* host, int port)
+{
+	char service[16];
+	snprintf(service, sizeof(service), "%d", port);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* result = NULL;
+	if (getaddrinfo(host, service, &hints, &result) != 0) {
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo* ai = result; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+
+	if (fd >= 0) {
+		int flag = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	}
+	return fd;
+}
+
+// Arguments of a parameter server connection thread
+struct PsConnection {
+	ParamServer* server;
+	int fd;
+};
+
+static void* ps_connection_entry(void* arg)
+{
+	PsConnection* conn = static_cast<PsConnection*>(arg);
+	conn->server->serve_connection(conn->fd);
+	delete conn;
+	return NULL;
+}
+
+const char FM::S_CHECKPOINT_MAGIC[4] = {'F', 'M', 'C', 'K'};
+
+FM::FM() : m_maxLabel(0), m_minLabel(0), m_featNum(0), m_dataNum(0), m_rowNum(0), m_data(NULL), m_order(NULL), 
+		   m_orderNum(0), m_orderSize(0), m_orderBounds(NULL), m_posNum(0), m_featStat(NULL), m_minFeatCount(0), 
+		   m_dedupFlag(0), m_dataOwnerFlag(1), m_randSeed(0), m_randState(0), m_logFlag(1), m_initModelFile(NULL), 
+		   m_initModel(NULL), m_degree(0), m_factSize(0), m_threadNum(1), m_parallelMode(PARALLEL_HOGWILD), 
+		   m_gradBuf(NULL), m_gradBufNum(0), m_featPartial(NULL), m_featTotal(NULL), m_negSampleRate(1.0f), 
+		   m_negResampleFlag(0), m_backpropMode(BACKPROP_ALL), m_backpropThreshold(0.0f), m_solver(SOLVER_SGD), 
+		   m_alsColStart(NULL), m_alsRows(NULL), m_alsValues(NULL), m_alsError(NULL), m_alsSum(NULL), 
+		   m_taskDeques(NULL), m_taskStats(NULL), m_taskBounds(NULL), m_taskBoundSize(0), m_numaMode(NUMA_NONE), 
+		   m_numaNodeNum(0), m_numaNodeIds(NULL), m_numaCpus(NULL), m_numaCpuNum(NULL), m_numaBindNode(-1), 
+		   m_numaReplicas(NULL), m_numaSampleNum(NULL), m_numaBusyTime(NULL), m_sweepSpec(NULL), 
+		   m_sweepRandomNum(0), m_sweepConfigs(NULL), m_sweepNum(0), m_sweepNext(0), m_sweepModelFile(NULL), 
+		   m_cvFoldNum(0), m_cvRowFold(NULL), m_cvResults(NULL), m_cvNext(0), m_validFile(NULL), m_validData(NULL), 
+		   m_validNum(0), m_validMetric(0), m_patience(0), m_tolerance(0.0f), m_lossStallNum(0), m_validStallNum(0), 
+		   m_bestMetric(0.0f), m_bestIter(0), m_bestW0(0.0f), m_bestW(NULL), m_bestV(NULL), m_pipelineDepth(0), 
+		   m_slots(NULL), m_slotHead(0), m_slotTail(0), m_pipelineStop(0), m_curSlot(NULL), m_slotRows(NULL), 
+		   m_shuffleSeed(0), m_shuffleBlock(0), m_startIter(0), m_ckptFile(NULL), m_ckptInterval(1), 
+		   m_resumeFlag(0), m_ckptSize(0), m_ckptWriting(-1), m_ckptPending(-1), m_ckptStop(0), m_psServerNum(0), 
+		   m_psHosts(NULL), m_psPorts(NULL), m_psFds(NULL), m_psTrainerId(0), m_psTrainerNum(1), m_psStaleness(-1), 
+		   m_psClock(0), m_psFeatList(NULL), m_psFeatFlag(NULL), m_psGroupList(NULL), m_psGroupOffset(NULL), 
+		   m_psBuf(NULL), m_psBufSize(0), m_psCache(NULL), m_psCacheSize(0), m_w0(0.0f), m_w(NULL), m_v(NULL), 
+		   m_sumW0(0.0f), m_sumW(NULL), m_sumV(NULL), m_precision(PRECISION_FP32), m_halfV(NULL), 
+		   m_halfMomentumV(NULL), m_roundStep(0), m_regFactor(0.0f), m_learnRate(0.0f), m_initStdDev(0.0f), 
+		   m_norm(2), m_hugePageMode(HUGE_PAGE_NONE), m_lossPartials(NULL), m_regNorm(0.0), m_normRefreshIter(0), 
+		   m_gradW0(0.0f), m_gradW(NULL), m_gradV(NULL), m_sumGrad2(0.0f), m_momentumW0(0.0f), m_momentumW(NULL), 
+		   m_momentumV(NULL), m_partialFmFlag(0), m_fmFeatFlag(NULL), m_fmFeatNum(0), m_fmFeatStride(0), 
+		   m_fmFeatIndex(NULL), m_fmFeatList(NULL)
+{
+	m_ckptBufs[0] = NULL;
+	m_ckptBufs[1] = NULL;
+}
+
+FM::~FM()
+{
+	// Free data, shared rows belong to their owner
+	if (m_data != NULL) {
+		for (int i = 0; i < m_dataNum && m_dataOwnerFlag != 0; ++i) {
+			if (m_data[i].x != NULL) {
+				delete[] m_data[i].x;
+				m_data[i].x = NULL;
+			}
+		}
+		delete[] m_data;
+		m_data = NULL;
+	}
+	delete[] m_order;
+	delete[] m_orderBounds;
+
+	if (m_featStat != NULL) {
+		delete[] m_featStat;
+		m_featStat = NULL;
+	}
+
+	// Model, gradients and momentum live in m_arena, which unmaps itself
+
+	// Free sparseFlag
+	if (m_fmFeatFlag != NULL) {
+		delete[] m_fmFeatFlag;
+		m_fmFeatFlag = NULL;
+	}		
+
+	if (m_fmFeatIndex != NULL) {
+		delete[] m_fmFeatIndex;
+		m_fmFeatIndex = NULL;
+	}
+
+	if (m_fmFeatList != NULL) {
+		delete[] m_fmFeatList;
+		m_fmFeatList = NULL;
+	}
+
+	delete[] m_lossPartials;
+	delete[] m_alsColStart;
+	delete[] m_alsRows;
+	delete[] m_alsValues;
+	delete[] m_alsError;
+	delete[] m_alsSum;
+	delete[] m_initModelFile;
+	delete m_initModel;
+	delete[] m_ckptFile;
+	delete[] m_ckptBufs[0];
+	delete[] m_ckptBufs[1];
+	delete[] m_sweepSpec;
+	delete[] m_sweepConfigs;
+	delete[] m_cvRowFold;
+	delete[] m_cvResults;
+
+	// Free validation data and the best model
+	delete[] m_validFile;
+	for (int i = 0; i < m_validNum; ++i) {
+		delete[] m_validData[i].x;
+	}
+	delete[] m_validData;
+	delete[] m_bestW;
+	delete[] m_bestV;
+
+	if (m_taskDeques != NULL) {
+		for (int t = 0; t < MAX(m_threadNum, 1); ++t) {
+			pthread_spin_destroy(&m_taskDeques[t].lock);
+		}
+		delete[] m_taskDeques;
+	}
+	delete[] m_taskStats;
+	delete[] m_taskBounds;
+
+	// Free NUMA topology and replicas
+	for (int n = 0; n < m_numaNodeNum; ++n) {
+		delete[] m_numaCpus[n];
+		if (m_numaReplicas != NULL) {
+			delete m_numaReplicas[n];
+		}
+	}
+	delete[] m_numaNodeIds;
+	delete[] m_numaCpus;
+	delete[] m_numaCpuNum;
+	delete[] m_numaReplicas;
+	delete[] m_numaSampleNum;
+	delete[] m_numaBusyTime;
+
+	// Free parameter-server connections and buffers
+	for (int s = 0; s < m_psServerNum; ++s) {
+		delete[] m_psHosts[s];
+		if (m_psFds != NULL && m_psFds[s] >= 0) {
+			close(m_psFds[s]);
+		}
+	}
+	delete[] m_psHosts;
+	delete[] m_psPorts;
+	delete[] m_psFds;
+	delete[] m_psFeatList;
+	delete[] m_psFeatFlag;
+	delete[] m_psGroupList;
+	delete[] m_psGroupOffset;
+	delete[] m_psBuf;
+	delete[] m_psCache;
+}
+
+void FM::set_regular_factor(float regFactor)
+{
+	m_regFactor = regFactor;
+}
+
+void FM::set_learn_rate(float learnRate)
+{
+	m_learnRate = learnRate;
+}
+
+void FM::set_fm_degree(int degree)
+{
+	m_degree = degree;
+}
+
+void FM::set_mini_batch(int mini_batch)
+{
+    m_mini_batch = mini_batch;
+}
+
+void FM::set_thread_num(int threadNum)
+{
+	m_threadNum = threadNum;
+}
+
+void FM::set_parallel_mode(int mode)
+{
+	m_parallelMode = mode;
+}
+
+void FM::set_solver(int solver)
+{
+	m_solver = solver;
+}
+
+void FM::set_selective_backprop(int mode, float threshold)
+{
+	m_backpropMode = mode;
+	m_backpropThreshold = threshold;
+}
+
+void FM::set_neg_sampling(float rate, int resampleFlag)
+{
+	m_negSampleRate = rate;
+	m_negResampleFlag = resampleFlag;
+}
+
+void FM::set_pipeline_depth(int depth)
+{
+	m_pipelineDepth = depth;
+}
+
+int FM::set_param_servers(const char* servers)
+{
+	// Format: host:port,host:port,...
+	int serverNum = 1;
+	for (const char* p = servers; *p != '\0'; ++p) {
+		serverNum += (*p == ',') ? 1 : 0;
+	}
+	if (serverNum > S_MAX_PS_SERVER_NUM) {
+		printf("[ERROR] Too many parameter servers (max %d)!\n", S_MAX_PS_SERVER_NUM);
+		return -1;
+	}
+
+	char** hosts = new char*[serverNum];
+	int* ports = new int[serverNum];
+	const char* begin = servers;
+	for (int s = 0; s < serverNum; ++s) {
+		const char* end = strchr(begin, ',');
+		size_t len = (end != NULL) ? static_cast<size_t>(end - begin) : strlen(begin);
+		hosts[s] = new char[len + 1];
+		memcpy(hosts[s], begin, len);
+		hosts[s][len] = '\0';
+
+		char* colon = strrchr(hosts[s], ':');
+		ports[s] = (colon != NULL) ? atoi(colon + 1) : 0;
+		if (colon == NULL || colon == hosts[s] || ports[s] <= 0 || ports[s] > 65535) {
+			printf("[ERROR] Invalid parameter server address %s (should be host:port)!\n", hosts[s]);
+			for (int n = 0; n <= s; ++n) {
+				delete[] hosts[n];
+			}
+			delete[] hosts;
+			delete[] ports;
+			return -1;
+		}
+		*colon = '\0';
+		begin = end + 1;
+	}
+
+	m_psServerNum = serverNum;
+	m_psHosts = hosts;
+	m_psPorts = ports;
+	return 0;
+}
+
+void FM::set_ps_trainer(int trainerId, int trainerNum)
+{
+	m_psTrainerId = trainerId;
+	m_psTrainerNum = trainerNum;
+}
+
+void FM::set_ps_staleness(int staleness)
+{
+	m_psStaleness = staleness;
+}
+
+void FM::set_numa_mode(int mode)
+{
+	m_numaMode = mode;
+}
+
+void FM::set_iterations_num(int iter_num)
+{
+    m_iter_num = iter_num;
+}
+
+void FM::set_factor_size(int factSize)
+{
+	m_factSize = factSize;
+}
+
+void FM::set_partial_fm_flag(int flag)
+{
+	m_partialFmFlag = flag;
+}
+
+void FM::set_init_std_dev(float stdDev)
+{
+	m_initStdDev = stdDev;
+}
+
+void FM::set_regular_term(int regularTerm)
+{
+	m_norm = regularTerm;
+}
+
+void FM::set_huge_page_mode(int mode)
+{
+	m_hugePageMode = mode;
+}
+
+void FM::set_precision(int precision)
+{
+	m_precision = precision;
+}
+
+void FM::set_min_feat_count(int minCount)
+{
+	m_minFeatCount = minCount;
+}
+
+void FM::set_dedup_flag(int flag)
+{
+	m_dedupFlag = flag;
+}
+
+void FM::set_rand_seed(unsigned int seed)
+{
+	m_randSeed = seed;
+}
+
+void FM::set_shuffle_block(int blockSize)
+{
+	m_shuffleBlock = blockSize;
+}
+
+void FM::set_init_model(const char* modelName)
+{
+	delete[] m_initModelFile;
+	m_initModelFile = new char[strlen(modelName) + 1];
+	strcpy(m_initModelFile, modelName);
+}
+
+int FM::read_data(const char* fileName)
+{
+	// Format: y(-1/0, 1) \t x1 \t x2 \t, ...
+	FILE* fp = fopen(fileName, "r");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Reading data failed!\n", fileName);
+		return -1;
+	}
+
+	const int MAX_LINE_DATA_LEN = 100000;
+	char buf[MAX_LINE_DATA_LEN];
+
+	// Count data number, and allocate data memory
+	m_dataNum = 0;
+	m_featNum = 0;
+	
+	while (fgets(buf, MAX_LINE_DATA_LEN, fp) != NULL) {
+		++m_dataNum;
+
+		// Count feature number
+		char* ptr = buf + strlen(buf);
+		while (*ptr != ' ' && *ptr != '\t' && ptr != buf) {
+			if (*ptr == ':') {
+				*ptr = '\0';
+			}
+			--ptr;
+		}
+
+		int maxFeatNum = static_cast<int>(strtol(ptr + 1, NULL, 10));
+		if (maxFeatNum < 1) {
+			printf("[ERROR] Invalid data format, wrong feature index!\n");
+			fclose(fp);
+			return -1;
+		}
+		
+		m_featNum = MAX(m_featNum, maxFeatNum);
+	}
+
+	if (m_dataNum < 1) {
+		printf("[ERROR] No data in the file!\n");
+		fclose(fp);
+		return -1;
+	}
+
+	// Allocate memory for feature statistics, filled by parse_line
+	if (m_featStat != NULL) {
+		delete[] m_featStat;
+	}
+	m_featStat = new FeatStat[m_featNum];
+	for (int i = 0; i < m_featNum; ++i) {
+		m_featStat[i].nnz = 0;
+		m_featStat[i].posNnz = 0;
+		m_featStat[i].minValue = 0.0f;
+		m_featStat[i].maxValue = 0.0f;
+	}
+	m_posNum = 0;
+
+	// Allocate memory and initialize data
+	m_data = new Data[m_dataNum];
+	for (int i = 0; i < m_dataNum; ++i) {
+		m_data[i].y = 0;
+		m_data[i].x = NULL;
+		m_data[i].score = 0.0f;
+		m_data[i].nnz = 0;
+		m_data[i].weight = 1.0f;
+		m_data[i].count = 1;
+		m_data[i].repeat = 1;
+		m_data[i].row = i;			// Rows are parsed into the next free slot, so this stays the row index
+	}
+
+	// Open addressing table of distinct rows, -1 - empty
+	int tableSize = 0;
+	int* table = NULL;
+	if (m_dedupFlag != 0) {
+		tableSize = 1;
+		while (tableSize < 2 * m_dataNum) {
+			tableSize *= 2;
+		}
+		table = new int[tableSize];
+		memset(table, -1, sizeof(int) * tableSize);
+	}
+	
+	rewind(fp);				// Back to the head of the file
+	
+	// Parse data
+	int lineNum = 0;
+	int dupNum = 0;
+	m_dataNum = 0;			// Reset data number, drop invalid data
+	m_rowNum = 0;
+	int* featList = new int[m_featNum];
+	int* featPos = new int[m_featNum];
+	memset(featPos, 0, sizeof(int) * m_featNum);
+	while (fgets(buf, MAX_LINE_DATA_LEN, fp) != NULL) {
+		++lineNum;
+		if (parse_line(buf, m_data + m_dataNum, featList, featPos) != 0) {
+			printf("[WARNING] Parsing line %d failed!\n", lineNum);
+			continue;
+		}
+		++m_rowNum;
+
+		// A parameter-server trainer keeps the lines i with i % trainers == id, statistics count all lines
+		if (m_psServerNum > 0 && m_psTrainerNum > 0 && (lineNum - 1) % m_psTrainerNum != m_psTrainerId) {
+			Data* ptrData = m_data + m_dataNum;
+			m_posNum -= (ptrData->y > 0) ? 1 : 0;
+			delete[] ptrData->x;
+			ptrData->x = NULL;
+			continue;
+		}
+
+		// A duplicate adds to the count of its first occurrence, feature statistics still count it
+		if (table != NULL) {
+			Data* ptrData = m_data + m_dataNum;
+			unsigned int slot = hash_row(ptrData, m_featNum) & (tableSize - 1);
+			while (table[slot] >= 0 && !same_row(m_data + table[slot], ptrData, m_featNum)) {
+				slot = (slot + 1) & (tableSize - 1);
+			}
+
+			if (table[slot] >= 0) {
+				++m_data[table[slot]].count;
+				delete[] ptrData->x;
+				ptrData->x = NULL;
+				++dupNum;
+				continue;
+			}
+			table[slot] = m_dataNum;
+		}
+
+		++m_dataNum;
+	}
+	delete[] featList;
+	delete[] featPos;
+
+	if (table != NULL) {
+		delete[] table;
+
+		// A heavy row is trained as several entries of at most S_MAX_ENTRY_COUNT rows each, so no single
+		// SGD step carries its whole count. Loss and metrics still weigh the row by its count
+		int entryNum = 0;
+		for (int i = 0; i < m_dataNum; ++i) {
+			m_data[i].repeat = (m_data[i].count + S_MAX_ENTRY_COUNT - 1) / S_MAX_ENTRY_COUNT;
+			m_data[i].weight = static_cast<float>(m_data[i].count) / m_data[i].repeat;
+			entryNum += m_data[i].repeat;
+		}
+		printf("[NOTICE] %d duplicate rows collapsed, %d distinct rows left in %d entries\n", dupNum, m_dataNum, 
+				entryNum);
+	}
+	
+	fclose(fp);
+	return 0;
+}
+
+int FM::parse_line(char* buf, Data* ptrData, int* featList, int* featPos)
+{
+	// Parse label
+	char* ptr = strtok(buf, "\t ");
+	if(ptr == NULL) {
+		printf("[WARNING] Parsing label failed!\n");
+		return -1;
+	}
+	
+	ptrData->y = static_cast<int>(strtol(ptr, NULL, 10));
+
+	// Get maxLabel and minLabel
+	m_maxLabel = MAX(m_maxLabel, ptrData->y);
+	m_minLabel = MIN(m_minLabel, ptrData->y);
+
+	// Allocate data memory
+	ptrData->x = new float[m_featNum];
+	memset(ptrData->x, 0, sizeof(float) * m_featNum);
+	
+	// Parse feature. Indices of the line are kept once each in featList, featPos[k] is the position
+	// of k when k is in the list, so a repeated index keeps its last value and is counted once
+	int listNum = 0;
+	ptr = strtok(NULL, ":");
+	while (ptr != NULL) {
+		int index =  static_cast<int>(strtol(ptr, NULL, 10));
+		if (index > m_featNum or index < 1) {
+			printf("[WARNING] Invalid feature index!\n");
+			delete[] ptrData->x;
+			ptrData->x = NULL;
+			return -1;
+ 		}
+
+		int k = index - 1;
+		int pos = featPos[k];
+		if (pos >= listNum || featList[pos] != k) {
+			featPos[k] = listNum;
+			featList[listNum++] = k;
+		}
+
+		ptr = strtok(NULL, "\t ");		
+		ptrData->x[k] = strtof(ptr, NULL);
+		ptr = strtok(NULL, ":");
+	}
+
+	// Update feature statistics
+	if (ptrData->y > 0) {
+		++m_posNum;
+	}
+
+	ptrData->nnz = 0;
+	for (int n = 0; n < listNum; ++n) {
+		float x = ptrData->x[featList[n]];
+		if (x < 1e-6 && x > -1e-6) {
+			continue;
+		}
+		++ptrData->nnz;
+
+		FeatStat* stat = m_featStat + featList[n];
+		if (stat->nnz == 0) {
+			stat->minValue = x;
+			stat->maxValue = x;
+		} else {
+			stat->minValue = MIN(stat->minValue, x);
+			stat->maxValue = MAX(stat->maxValue, x);
+		}
+
+		++stat->nnz;
+		if (ptrData->y > 0) {
+			++stat->posNnz;
+		}
+	}
+	
+	return 0;
+}
+
+int FM::share_data(const FM* source, const int* rowFold, int excludeFold)
+{
+	// Feature vectors are read-only and stay with the source, only the headers are copied.
+	// Rows with rowFold[i] == excludeFold are left out, a NULL rowFold keeps all rows
+	m_featNum = source->m_featNum;
+	m_maxLabel = source->m_maxLabel;
+	m_minLabel = source->m_minLabel;
+
+	m_featStat = new FeatStat[m_featNum];
+	memcpy(m_featStat, source->m_featStat, sizeof(FeatStat) * m_featNum);
+	m_data = new Data[source->m_dataNum];
+	m_dataNum = 0;
+	m_rowNum = source->m_rowNum;
+	m_posNum = 0;
+	for (int i = 0; i < source->m_dataNum; ++i) {
+		if (rowFold != NULL && rowFold[i] == excludeFold) {
+			continue;
+		}
+		m_data[m_dataNum++] = source->m_data[i];
+		m_posNum += (source->m_data[i].y > 0) ? source->m_data[i].count : 0;
+	}
+	m_dataOwnerFlag = 0;
+
+	return 0;
+}
+
+int FM::widen_data(int featNum)
+{
+	if (m_dataOwnerFlag == 0) {
+		printf("[ERROR] Cannot add features to shared data!\n");
+		return -1;
+	}
+
+	// New features are 0 in every sample and never seen
+	for (int i = 0; i < m_dataNum; ++i) {
+		float* x = new float[featNum];
+		memcpy(x, m_data[i].x, sizeof(float) * m_featNum);
+		memset(x + m_featNum, 0, sizeof(float) * (featNum - m_featNum));
+		delete[] m_data[i].x;
+		m_data[i].x = x;
+	}
+
+	FeatStat* featStat = new FeatStat[featNum];
+	memcpy(featStat, m_featStat, sizeof(FeatStat) * m_featNum);
+	memset(featStat + m_featNum, 0, sizeof(FeatStat) * (featNum - m_featNum));
+	delete[] m_featStat;
+	m_featStat = featStat;
+	m_featNum = featNum;
+
+	return 0;
+}
+
+int FM::initialize()
+{	
+	// The initial model decides the model size, so it is loaded first
+	if (m_initModelFile != NULL && load_init_model() != 0) {
+		return -1;
+	}
+
+	// Initialize w0	
+	m_w0 = 0.0f;
+	m_momentumW0 = 0.0f;
+
+	m_sumW0 = 0.0f;
+
+	m_sumGrad2 = 0.0f;
+
+	// Allocate memory for sparse flags
+	if (m_featNum < 0) {
+		printf("[ERROR] Invalid feature number!\n");
+		return -1;
+	}   
+
+	if (m_fmFeatFlag != NULL) {
+		delete[] m_fmFeatFlag;
+	}
+	m_fmFeatFlag = new int[m_featNum];
+	for (int i = 0; i < m_featNum; ++i) {
+		m_fmFeatFlag[i] = 0;
+	}
+
+	// Factors are only stored for the features selected for partial FM
+	calculate_fm_feat_flags();
+	build_fm_feat_index();
+/*	for (int i = 0; i < m_featNum; ++i) {
+		if (m_fmFeatFlag[i] == 1) {
+			printf("%d:1\t", i);
+		}
+	}
+	getchar();
+*/	
+		
+	// Placement of the arena depends on the NUMA nodes
+	if (m_numaMode != NUMA_NONE && init_numa_topology() != 0) {
+		return -1;
+	}
+
+	// Allocate zeroed memory for weights, factors and gradients
+	if (allocate_parameters(1) != 0) {
+		return -1;
+	}
+
+	// Errors and norm changes of every epoch are added up by the training threads
+	delete[] m_lossPartials;
+	m_lossPartials = new LossPartial[MAX(m_threadNum, 1)];
+	memset(m_lossPartials, 0, sizeof(LossPartial) * MAX(m_threadNum, 1));
+
+	allocate_order();
+
+	// Initialize factors, degree 0 is never used. Every model has its own random state
+	m_randState = (m_randSeed != 0) ? m_randSeed : static_cast<unsigned int>(time(0));
+	init_factors(m_randState);
+	m_shuffleSeed = static_cast<unsigned int>(rand_r(&m_randState));
+
+	if (m_initModel != NULL && copy_init_model() != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void FM::allocate_order()
+{
+	// Rows never move, every epoch trains them in the order of m_order
+	m_orderSize = 0;
+	for (int i = 0; i < m_dataNum; ++i) {
+		m_orderSize += m_data[i].repeat;
+	}
+	delete[] m_order;
+	delete[] m_orderBounds;
+	m_order = new int[MAX(m_orderSize, 1)];
+	m_orderBounds = new int[MAX(m_threadNum, 1) + 1];
+	m_orderNum = 0;
+}
+
+int FM::load_init_model()
+{
+	if (QuantizedFM::is_quantized_model(m_initModelFile)) {
+		printf("[ERROR] Cannot continue training from the int8 model %s!\n", m_initModelFile);
+		return -1;
+	}
+
+	delete m_initModel;
+	m_initModel = new FM();
+	if (m_initModel->load_model(m_initModelFile) != 0) {
+		printf("[ERROR] Load initial model %s failed!\n", m_initModelFile);
+		delete m_initModel;
+		m_initModel = NULL;
+		return -1;
+	}
+
+	if (m_initModel->m_degree != m_degree || m_initModel->m_factSize != m_factSize) {
+		printf("[WARNING] Degree %d and factor size %d of the initial model replace %d and %d!\n", 
+				m_initModel->m_degree, m_initModel->m_factSize, m_degree, m_factSize);
+		m_degree = m_initModel->m_degree;
+		m_factSize = m_initModel->m_factSize;
+	}
+
+	// Features of the model missing from today's data are kept
+	if (m_initModel->m_featNum > m_featNum && widen_data(m_initModel->m_featNum) != 0) {
+		delete m_initModel;
+		m_initModel = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int FM::copy_init_model()
+{
+	// Features the initial model does not know keep their random factors. So do features whose
+	// factors are all 0, the initial model gave them no factors
+	const FM* init = m_initModel;
+	int initFeatNum = init->m_featNum;
+	int newFeatNum = m_featNum - initFeatNum;
+
+	m_w0 = init->m_w0;
+	memcpy(m_w, init->m_w, sizeof(float) * initFeatNum);
+
+	for (int c = 0; c < m_fmFeatNum; ++c) {
+		int k = m_fmFeatList[c];
+		if (k >= initFeatNum) {
+			continue;
+		}
+
+		int zeroFlag = 1;
+		for (int i = 1; i < init->m_degree && zeroFlag != 0; ++i) {
+			for (int j = 0; j < init->m_factSize; ++j) {
+				if (init->get_factor(i, j * init->m_fmFeatStride + k) != 0.0f) {
+					zeroFlag = 0;
+					break;
+				}
+			}
+		}
+		if (zeroFlag != 0) {
+			++newFeatNum;
+			continue;
+		}
+
+		for (int i = 1; i < m_degree; ++i) {
+			for (int j = 0; j < m_factSize; ++j) {
+				set_factor(i, j * m_fmFeatStride + c, init->get_factor(i, j * init->m_fmFeatStride + k));
+			}
+		}
+	}
+
+	if (m_logFlag != 0) {
+		printf("[NOTICE] Training continues from %s, %d features get new factors\n", m_initModelFile, 
+				newFeatNum);
+	}
+
+	delete m_initModel;
+	m_initModel = NULL;
+	return 0;
+}
+
+int FM::build_fm_feat_index()
+{
+	if (m_fmFeatIndex != NULL) {
+		delete[] m_fmFeatIndex;
+	}
+	if (m_fmFeatList != NULL) {
+		delete[] m_fmFeatList;
+	}
+
+	m_fmFeatIndex = new int[m_featNum];
+	m_fmFeatList = new int[m_featNum];
+	m_fmFeatNum = 0;
+
+	for (int k = 0; k < m_featNum; ++k) {
+		if (!is_fm_feat(k)) {
+			m_fmFeatIndex[k] = -1;
+			continue;
+		}
+
+		m_fmFeatIndex[k] = m_fmFeatNum;
+		m_fmFeatList[m_fmFeatNum++] = k;
+	}
+
+	// Factor rows start on a cache line in any precision, so column ranges aligned to
+	// S_FACTOR_ALIGN never share a line between threads. Padding factors stay 0
+	m_fmFeatStride = (m_fmFeatNum + S_FACTOR_ALIGN - 1) / S_FACTOR_ALIGN * S_FACTOR_ALIGN;
+
+	return 0;
+}
+
+int FM::allocate_parameters(int trainFlag)
+{
+	if (m_featNum < 0 || m_degree < 1) {
+		printf("[ERROR] Invalid feature number!\n");
+		return -1;
+	}   
+
+	// Gradients and smoothing sums are always fp32 accumulators, factors and momentum may be 16 bits
+	int bufNum = (trainFlag != 0) ? 4 : 1;
+	int halfFlag = (m_precision != PRECISION_FP32) ? 1 : 0;
+	size_t weightSize = Arena::align_size(sizeof(float) * m_featNum);
+	size_t tableSize = Arena::align_size(sizeof(float*) * m_degree);
+	size_t factorSize = Arena::align_size(sizeof(float) * m_factSize * m_fmFeatStride);
+	size_t halfFactorSize = Arena::align_size(sizeof(unsigned short) * m_factSize * m_fmFeatStride);
+	size_t size = bufNum * (weightSize + tableSize + (m_degree - 1) * factorSize);
+	if (halfFlag != 0) {
+		size_t halfBufNum = (trainFlag != 0) ? 2 : 1;
+		size -= halfBufNum * (tableSize + (m_degree - 1) * factorSize);
+		size += halfBufNum * (tableSize + (m_degree - 1) * halfFactorSize);
+	}
+
+	// Shard gradient buffers of synchronous parallel SGD
+	int gradBufNum = 0;
+	if (trainFlag != 0 && m_parallelMode == PARALLEL_SYNC) {
+		gradBufNum = MAX(1, (m_mini_batch + S_GRAD_SHARD_SIZE - 1) / S_GRAD_SHARD_SIZE);
+		size += Arena::align_size(sizeof(GradBuffer) * gradBufNum);
+		size += gradBufNum * (weightSize + tableSize + (m_degree - 1) * factorSize);
+		size += gradBufNum * (Arena::align_size(sizeof(int) * m_featNum) + Arena::align_size(m_featNum));
+	}
+
+	// Partial and completed sums of feature-parallel SGD
+	int partialFlag = (trainFlag != 0 && m_parallelMode == PARALLEL_FEATURE) ? 1 : 0;
+	int threadNum = MAX(m_threadNum, 1);
+	size_t partialSize = Arena::align_size(sizeof(float) * m_mini_batch * feat_partial_size(m_degree, m_factSize));
+	if (partialFlag != 0) {
+		size += Arena::align_size(sizeof(float*) * threadNum) + threadNum * partialSize;
+		size += Arena::align_size(sizeof(float) * m_mini_batch * feat_total_size(m_degree, m_factSize));
+	}
+
+	if (m_arena.create(size, m_hugePageMode) != 0) {
+		return -1;
+	}
+
+	// Shared models are spread over all nodes, replicas stay on their own node
+	if (trainFlag != 0 && m_numaMode == NUMA_INTERLEAVE && m_numaNodeNum > 1) {
+		m_arena.bind_numa(1, m_numaNodeIds, m_numaNodeNum);
+	} else if (m_numaBindNode >= 0) {
+		m_arena.bind_numa(0, &m_numaBindNode, 1);
+	}
+
+	// Slabs in order: v, gradV, momentumV, sumV; gradV and sumV never have a 16-bit table
+	float*** tables[] = {&m_v, &m_gradV, &m_momentumV, &m_sumV};
+	unsigned short*** halfTables[] = {&m_halfV, NULL, &m_halfMomentumV, NULL};
+	float** weights[] = {&m_w, &m_gradW, &m_momentumW, &m_sumW};
+
+	for (int b = 0; b < 4; ++b) {
+		*tables[b] = NULL;
+		if (halfTables[b] != NULL) {
+			*halfTables[b] = NULL;
+		}
+
+		*weights[b] = NULL;
+		if (b >= bufNum) {
+			continue;
+		}
+
+		*weights[b] = static_cast<float*>(m_arena.alloc(sizeof(float) * m_featNum));
+
+		// Factors of degree 0 are never used
+		if (halfFlag != 0 && halfTables[b] != NULL) {
+			unsigned short** table = static_cast<unsigned short**>(m_arena.alloc(sizeof(unsigned short*) * m_degree));
+			table[0] = NULL;
+			for (int i = 1; i < m_degree; ++i) {
+				table[i] = static_cast<unsigned short*>(m_arena.alloc(sizeof(unsigned short) * m_factSize * m_fmFeatStride));
+			}
+			*halfTables[b] = table;
+		} else {
+			float** table = static_cast<float**>(m_arena.alloc(sizeof(float*) * m_degree));
+			table[0] = NULL;
+			for (int i = 1; i < m_degree; ++i) {
+				table[i] = static_cast<float*>(m_arena.alloc(sizeof(float) * m_factSize * m_fmFeatStride));
+			}
+			*tables[b] = table;
+		}
+	}
+
+	m_gradBufNum = gradBufNum;
+	m_gradBuf = (gradBufNum > 0) ? static_cast<GradBuffer*>(m_arena.alloc(sizeof(GradBuffer) * gradBufNum)) : NULL;
+	for (int n = 0; n < gradBufNum; ++n) {
+		GradBuffer* buf = m_gradBuf + n;
+		buf->gradW0 = 0.0f;
+		buf->loss = 0.0;
+		buf->gradW = static_cast<float*>(m_arena.alloc(sizeof(float) * m_featNum));
+		buf->gradV = static_cast<float**>(m_arena.alloc(sizeof(float*) * m_degree));
+		buf->gradV[0] = NULL;
+		for (int i = 1; i < m_degree; ++i) {
+			buf->gradV[i] = static_cast<float*>(m_arena.alloc(sizeof(float) * m_factSize * m_fmFeatStride));
+		}
+		buf->featList = static_cast<int*>(m_arena.alloc(sizeof(int) * m_featNum));
+		buf->featNum = 0;
+		buf->featFlag = static_cast<char*>(m_arena.alloc(m_featNum));
+	}
+
+	m_featPartial = NULL;
+	m_featTotal = NULL;
+	if (partialFlag != 0) {
+		m_featPartial = static_cast<float**>(m_arena.alloc(sizeof(float*) * threadNum));
+		for (int t = 0; t < threadNum; ++t) {
+			m_featPartial[t] = static_cast<float*>(m_arena.alloc(partialSize));
+		}
+		m_featTotal = static_cast<float*>(m_arena.alloc(sizeof(float) * m_mini_batch 
+					* feat_total_size(m_degree, m_factSize)));
+	}
+
+	return 0;
+}
+
+float FM::get_factor(int degree, int index) const
+{
+	if (m_precision == PRECISION_FP32) {
+		return m_v[degree][index];
+	} else if (m_precision == PRECISION_BF16) {
+		return bf16_to_float(m_halfV[degree][index]);
+	}
+	return fp16_to_float(m_halfV[degree][index]);
+}
+
+void FM::set_factor(int degree, int index, float value)
+{
+	if (m_precision == PRECISION_FP32) {
+		m_v[degree][index] = value;
+	} else {
+		m_halfV[degree][index] = round_half(value, degree, index, 0);
+	}
+}
+
+float FM::get_momentum(int degree, int index) const
+{
+	if (m_precision == PRECISION_FP32) {
+		return m_momentumV[degree][index];
+	} else if (m_precision == PRECISION_BF16) {
+		return bf16_to_float(m_halfMomentumV[degree][index]);
+	}
+	return fp16_to_float(m_halfMomentumV[degree][index]);
+}
+
+void FM::set_momentum(int degree, int index, float value)
+{
+	if (m_precision == PRECISION_FP32) {
+		m_momentumV[degree][index] = value;
+	} else {
+		m_halfMomentumV[degree][index] = round_half(value, degree, index, 1);
+	}
+}
+
+float FM::sum_factor_row(int degree, int offset, const float* x, int colBegin, int colEnd, float* squareSum, 
+		float* cubeSum) const
+{
+	if (m_precision == PRECISION_FP32) {
+		return sum_row(Fp32Row(m_v[degree] + offset), x, m_fmFeatList, colBegin, colEnd, squareSum, cubeSum);
+	} else if (m_precision == PRECISION_BF16) {
+		return sum_row(Bf16Row(m_halfV[degree] + offset), x, m_fmFeatList, colBegin, colEnd, squareSum, cubeSum);
+	}
+	return sum_row(Fp16Row(m_halfV[degree] + offset), x, m_fmFeatList, colBegin, colEnd, squareSum, cubeSum);
+}
+
+void FM::add_factor_row_grads(int degree, int offset, const float* x, int colBegin, int colEnd, float sum, 
+		float squareSum, float error, float* grad) const
+{
+	if (m_precision == PRECISION_FP32) {
+		add_row_grads(Fp32Row(m_v[degree] + offset), x, m_fmFeatList, colBegin, colEnd, degree, sum, squareSum, 
+				error, grad + offset);
+	} else if (m_precision == PRECISION_BF16) {
+		add_row_grads(Bf16Row(m_halfV[degree] + offset), x, m_fmFeatList, colBegin, colEnd, degree, sum, squareSum, 
+				error, grad + offset);
+	} else {
+		add_row_grads(Fp16Row(m_halfV[degree] + offset), x, m_fmFeatList, colBegin, colEnd, degree, sum, squareSum, 
+				error, grad + offset);
+	}
+}
+
+void FM::add_factor_table(int degree, float* sums) const
+{
+	int num = m_factSize * m_fmFeatStride;
+	if (m_precision == PRECISION_FP32) {
+		add_row(Fp32Row(m_v[degree]), num, sums);
+	} else if (m_precision == PRECISION_BF16) {
+		add_row(Bf16Row(m_halfV[degree]), num, sums);
+	} else {
+		add_row(Fp16Row(m_halfV[degree]), num, sums);
+	}
+}
+
+unsigned short FM::round_half(float value, int degree, int index, unsigned int salt) const
+{
+	// Noise depends on the slot and the update step only, so rounding is reproducible
+	unsigned int noise = hash_uint(static_cast<unsigned int>(index) * 0x9e3779b1U 
+			^ hash_uint(m_roundStep * 4 + salt + (static_cast<unsigned int>(degree) << 28)));
+
+	if (m_precision == PRECISION_BF16) {
+		return float_to_bf16(value, noise);
+	}
+	return float_to_fp16(value, noise);
+}
+
+int FM::init_factors(unsigned int seed)
+{
+	// Every value depends on the seed, the feature and the factor only, not on the thread number
+	return run_threads(&FM::init_factor_thread, &seed);
+}
+
+void FM::init_factor_thread(int threadId, void* arg)
+{
+	unsigned int key[2] = {*static_cast<unsigned int*>(arg), 0x4d464d46U};
+	int begin = 0;
+	int end = 0;
+	split_range(m_fmFeatNum, threadId, MAX(m_threadNum, 1), &begin, &end);
+
+	// One Philox block gives the normals of four factors, written as four sequential streams
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = 0; j < m_factSize; j += 4) {
+			for (int c = begin; c < end; ++c) {
+				// Features absent from the data are never trained, their factors stay 0
+				int k = m_fmFeatList[c];
+				if (m_featStat != NULL && m_featStat[k].nnz == 0) {
+					continue;
+				}
+
+				unsigned int counter[4] = {static_cast<unsigned int>(k), static_cast<unsigned int>(j / 4), 
+						static_cast<unsigned int>(i), 0};
+				float normal[4];
+				philox_normal(counter, key, normal);
+				for (int n = 0; n < 4 && j + n < m_factSize; ++n) {
+					set_factor(i, (j + n) * m_fmFeatStride + c, normal[n] * m_initStdDev);
+				}
+			}
+		}
+	}
+}
+
+int FM::calculate_fm_feat_flags()
 {
 	const int ZERO_NUM_THRESHOLD = 2;
 	const float ZERO_RATIO_THRESHOLD = 0.99f;
 	
 	for (int i = 0; i < m_featNum; ++i) {
-		int zeroNum = 0;
-		for (int j = 0; j < m_dataNum; ++j) {
-			if (fabs(m_data[j].x[i]) < 1e-6) {
-				++zeroNum;
+		int zeroNum = m_rowNum - m_featStat[i].nnz;
+		if (zeroNum > ZERO_NUM_THRESHOLD && zeroNum > ZERO_RATIO_THRESHOLD * m_rowNum) {
+			m_fmFeatFlag[i] = 1;
+		}
+	}
+	
+	return 0;
+}
+
+int FM::is_feat_filtered(int index) const
+{
+	return (m_featStat != NULL && m_featStat[index].nnz < m_minFeatCount) ? 1 : 0;
+}
+
+int FM::is_fm_feat(int index) const
+{
+	if (m_partialFmFlag != 0 && (m_fmFeatFlag == NULL || m_fmFeatFlag[index] == 0)) {
+		return 0;
+	}
+	return is_feat_filtered(index) ? 0 : 1;
+}
+
+int FM::save_feat_stats(const char* fileName)
+{
+	FILE* fp = fopen(fileName, "w");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Saving feature statistics failed!\n", fileName);
+		return -1;
+	}
+
+	// Format: index \t nnz \t positive nnz \t min \t max \t fm flag
+	for (int i = 0; i < m_featNum; ++i) {
+		const FeatStat* stat = m_featStat + i;
+		int fmFlag = is_fm_feat(i);
+		fprintf(fp, "%d\t%d\t%d\t%f\t%f\t%d\n", i + 1, stat->nnz, stat->posNnz, stat->minValue, 
+				stat->maxValue, fmFlag);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+int FM::train()
+{
+	if (m_psServerNum > 0) {
+		return train_with_servers();
+	}
+
+	if (m_solver == SOLVER_ALS && m_degree > 2) {
+		printf("[ERROR] The ALS solver supports degree 2 at most!\n");
+		return -1;
+	}
+
+	if (initialize() != 0) {
+		printf("[ERROR] Initialize failed!\n");
+		return -1;
+	}
+
+	// A resumed run continues with the state after the iterations of the checkpoint
+	CheckpointHeader resume;
+	memset(&resume, 0, sizeof(resume));
+	if (m_resumeFlag != 0 && load_checkpoint(&resume) != 0) {
+		return -1;
+	}
+	m_startIter = resume.iterNum;
+
+	if (m_numaMode != NUMA_NONE && setup_numa() != 0) {
+		return -1;
+	}
+	
+	// Kept negatives get weight 1 / rate, the others 0. Fixed samples are drawn in file order,
+	// epoch samples in the order of their epoch
+	if (m_negSampleRate < 1.0f && (m_negResampleFlag == 0 || m_startIter == 0)) {
+		sample_negatives(0);
+	}
+
+	// Calculate scores for all data
+	refresh_scores();
+  
+	float loss = calculate_loss();
+	float preLoss = 0.0f;
+	if (m_startIter > 0) {
+		loss = resume.loss;
+		m_regNorm = resume.regNorm;
+	}
+
+	// Validation samples are scored after every epoch
+	if (m_validFile != NULL && read_valid_data(m_validFile) != 0) {
+		return -1;
+	}
+	float validMetric = (m_validNum > 0) ? evaluate_valid() : 0.0f;
+	if (m_startIter == 0 || (m_validNum > 0 && m_bestW == NULL)) {
+		m_lossStallNum = 0;
+		m_validStallNum = 0;
+		m_bestIter = m_startIter;
+		m_bestMetric = validMetric;
+		if (m_validNum > 0) {
+			save_best_model();
+		}
+	}
+
+	if (m_logFlag != 0) {
+		printf("------------------------------------------------------------------------\n");
+		printf("Iteration Process... [%d iterations in total]\n", m_iter_num);
+		int activeFeatNum = 0;
+		for (int i = 0; i < m_featNum; ++i) {
+			activeFeatNum += is_feat_filtered(i) ? 0 : 1;
+		}
+		printf("Total Data Number: %d\t\tPositive Number: %d\n", m_dataNum, m_posNum);
+		printf("Feature Number: %d\t\tActive Feature Number: %d\t\tFM Feature Number: %d\n", 
+				m_featNum, activeFeatNum, m_fmFeatNum);
+		printf("------------------------------------------------------------------------\n");
+	}
+   
+	// Iteration
+	int iterNum = m_startIter;
+	int smoothNum = resume.smoothNum;
+
+	// ALS passes visit the columns of the data, in file order
+	if (m_solver == SOLVER_ALS && m_pipelineDepth > 0) {
+		printf("[WARNING] The ALS solver does not use mini-batches, pipeline disabled!\n");
+		m_pipelineDepth = 0;
+	}
+
+	// The pipeline shuffles and gathers batches of the coming epochs in the background
+	if (m_pipelineDepth > 0 && m_parallelMode == PARALLEL_HOGWILD && m_threadNum > 1) {
+		printf("[WARNING] Hogwild! SGD does not use mini-batches, pipeline disabled!\n");
+		m_pipelineDepth = 0;
+	}
+	if (m_pipelineDepth > 0 && start_pipeline() != 0) {
+		return -1;
+	}
+	if (m_ckptFile != NULL && start_checkpoint_writer() != 0) {
+		stop_pipeline();
+		return -1;
+	}
+
+	while (iterNum < m_iter_num) {
+		++iterNum;
+		if (m_logFlag != 0 && m_validNum > 0) {
+			printf("Iter[%d] \t\tLoss[%.0f]\t\tW0[%.2f]\t\t%s[%.4f]\n", iterNum, loss, m_w0, 
+					(m_validMetric == 0) ? "AUC" : "RMSE", validMetric);
+		} else if (m_logFlag != 0) {
+			printf("Iter[%d] \t\tLoss[%.0f]\t\tW0[%.2f]\n", iterNum, loss, m_w0);
+		}
+		
+		if (m_negResampleFlag != 0 && m_negSampleRate < 1.0f && iterNum > 1 && m_pipelineDepth == 0) {
+			sample_negatives(iterNum - 1);
+		}
+		if (m_pipelineDepth == 0 && m_solver == SOLVER_SGD) {
+			m_orderNum = build_epoch_order(iterNum - 1, m_order, m_orderBounds);
+		}
+
+		if (m_solver == SOLVER_ALS) {
+			// One closed-form update of every parameter
+			run_als_pass();
+		} else if (m_parallelMode == PARALLEL_SYNC) {
+			// Mini-batch SGD, same result for any thread number
+			run_sync_sgd();
+		} else if (m_parallelMode == PARALLEL_FEATURE) {
+			// Mini-batch SGD, every thread updates its own features only
+			run_feature_parallel_sgd();
+		} else if (m_threadNum > 1) {
+			// Lock-free per-sample SGD on all threads
+			if (m_numaReplicas != NULL) {
+				run_numa_replica_sgd();
+			} else {
+				run_hogwild_sgd();
+			}
+		} else if (m_pipelineDepth > 0) {
+			// Mini-batch SGD on prefetched batches
+			BatchSlot* slot = pop_batch();
+			while (slot->num > 0) {
+				run_batch_sgd(slot->data, m_slotRows, slot->num);
+				finish_batch(slot);
+				slot = pop_batch();
+			}
+			finish_batch(slot);
+		} else {
+			// Mini-batch SGD
+			int indexBegin = 0;
+			int indexEnd = MIN(indexBegin + m_mini_batch, m_orderNum);
+
+			while(indexEnd <= m_orderNum) {
+				run_mini_batch_sgd(indexBegin, indexEnd);
+				indexBegin = indexEnd;
+				indexEnd = indexBegin + m_mini_batch;
+			}
+		}
+
+		preLoss = loss;
+		loss = collect_epoch_loss(iterNum);
+
+		// Calculate sum weights for smoothing, a warm start needs no burn-in
+		if ((iterNum > 10 || m_initModelFile != NULL) && m_solver == SOLVER_SGD) {
+			for (int i = 0; i < m_featNum; ++i) {
+				m_sumW[i] += m_w[i];
+			}
+
+			for (int i = 1; i < m_degree; ++i) {
+				add_factor_table(i, m_sumV[i]);
+			}
+			++smoothNum;
+		}
+
+		if (m_validNum > 0) {
+			validMetric = evaluate_valid();
+		}
+		if (update_early_stop(iterNum, loss, preLoss, validMetric) != 0) {
+			break;
+		}
+
+		// Training only waits for the copy into a snapshot, the writer thread saves it
+		if (m_ckptFile != NULL && iterNum % m_ckptInterval == 0 && iterNum < m_iter_num) {
+			save_checkpoint(iterNum, smoothNum, loss);
+		}
+	}
+
+	stop_checkpoint_writer();
+	stop_pipeline();
+	print_numa_report();
+	if (m_logFlag != 0) {
+		print_task_report();
+	}
+
+	// The best epoch on the validation set replaces the smoothed model
+	if (m_validNum > 0) {
+		restore_best_model();
+		return 0;
+	}
+
+	// ALS converges without noise, its last iteration is the model. So is the last SGD iteration
+	// when training stopped before any iteration was summed
+	if (m_solver == SOLVER_ALS || smoothNum == 0) {
+		return 0;
+	}
+
+	// Smooth weights
+	for (int i = 0; i < m_featNum; ++i) {
+		m_w[i] = m_sumW[i] / smoothNum;
+	}
+
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = 0; j < m_factSize * m_fmFeatStride; ++j) {
+			set_factor(i, j, m_sumV[i][j] / smoothNum);
+		}
+	}
+	
+	return 0;
+}
+
+float FM::calculate_loss()
+{
+	// Partial sums in double precision, added in thread order
+	int threadNum = MAX(m_threadNum, 1);
+	LossPartial* partials = new LossPartial[threadNum];
+	run_threads(&FM::loss_thread, partials);
+
+	double loss = 0.0;
+	double regLoss = reg_norm(m_norm, m_w0);
+	for (int t = 0; t < threadNum; ++t) {
+		loss += partials[t].loss;
+		regLoss += partials[t].regLoss;
+	}
+	delete[] partials;
+	
+	m_regNorm = regLoss;
+	loss += regLoss * m_regFactor;
+
+	return static_cast<float>(loss);
+}
+
+void FM::loss_thread(int threadId, void* arg)
+{
+	LossPartial* partial = static_cast<LossPartial*>(arg) + threadId;
+	int threadNum = MAX(m_threadNum, 1);
+	int begin = 0;
+	int end = 0;
+
+	// Calculate loss
+	double loss = 0.0;
+	split_range(m_dataNum, threadId, threadNum, &begin, &end);
+	for (int i = begin; i < end; ++i) {
+		double error = m_data[i].score - m_data[i].y;  
+		loss += m_data[i].weight * m_data[i].repeat * error * error;
+	}
+
+	partial->loss = loss;
+	partial->regLoss = partial_reg_norm(threadId);
+}
+
+void FM::set_norm_refresh_iter(int refreshIter)
+{
+	m_normRefreshIter = refreshIter;
+}
+
+float FM::collect_epoch_loss(int iterNum)
+{
+	// Errors were added up by the SGD pass, norm changes by the parameter updates
+	double loss = 0.0;
+	double regDelta = 0.0;
+	for (int t = 0; t < MAX(m_threadNum, 1); ++t) {
+		loss += m_lossPartials[t].loss;
+		regDelta += m_lossPartials[t].regLoss;
+		m_lossPartials[t].loss = 0.0;
+		m_lossPartials[t].regLoss = 0.0;
+	}
+
+	// Replicas are averaged into the model, and Hogwild! updates may race, so the running norm
+	// is only an estimate there
+	if (m_numaReplicas != NULL || (m_normRefreshIter > 0 && iterNum % m_normRefreshIter == 0)) {
+		m_regNorm = calculate_reg_norm();
+	} else {
+		m_regNorm += regDelta;
+	}
+
+	return static_cast<float>(loss + m_regNorm * m_regFactor);
+}
+
+double FM::calculate_reg_norm()
+{
+	int threadNum = MAX(m_threadNum, 1);
+	LossPartial* partials = new LossPartial[threadNum];
+	run_threads(&FM::reg_norm_thread, partials);
+
+	double regLoss = reg_norm(m_norm, m_w0);
+	for (int t = 0; t < threadNum; ++t) {
+		regLoss += partials[t].regLoss;
+	}
+	delete[] partials;
+
+	return regLoss;
+}
+
+double FM::partial_reg_norm(int threadId)
+{
+	int threadNum = MAX(m_threadNum, 1);
+	int begin = 0;
+	int end = 0;
+
+	// Regularization terms of the weights and factors of this thread
+	double regLoss = 0.0;
+
+	split_range(m_featNum, threadId, threadNum, &begin, &end);
+	for (int i = begin; i < end; ++i) {
+		regLoss += reg_norm(m_norm, m_w[i]);
+	}
+	
+	split_range(m_factSize * m_fmFeatStride, threadId, threadNum, &begin, &end);
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = begin; j < end; ++j) {
+			regLoss += reg_norm(m_norm, get_factor(i, j));
+		}
+	}
+
+	return regLoss;
+}
+
+void FM::reg_norm_thread(int threadId, void* arg)
+{
+	static_cast<LossPartial*>(arg)[threadId].regLoss = partial_reg_norm(threadId);
+}
+
+int FM::refresh_scores()
+{
+	// Tasks hold similar numbers of non-zeros, idle threads steal them
+	int taskNum = build_nnz_tasks(m_data, NULL, m_dataNum, MAX(m_threadNum, 1) * S_TASKS_PER_THREAD);
+	return run_tasks(&FM::score_task, NULL, taskNum);
+}
+
+int FM::build_epoch_order(int iterNum, int* order, int* bounds)
+{
+	// The order of an epoch depends on the seed and the epoch only, so resumed and pipelined runs
+	// train the same order without replaying earlier shuffles
+	RandState rng;
+	seed_rand(&rng, hash_uint(m_shuffleSeed ^ hash_uint(static_cast<unsigned int>(iterNum) * 0x85ebca6bU)));
+	int resampleFlag = (m_negResampleFlag != 0 && m_negSampleRate < 1.0f);
+
+	// With NUMA placement samples stay in the part of the thread on their node
+	int partNum = 1;
+	if (m_numaSampleNum != NULL && m_parallelMode == PARALLEL_HOGWILD && m_threadNum > 1) {
+		partNum = m_threadNum;
+	}
+
+	// Only rows kept by negative sampling are trained, so an epoch costs as many batches as they fill
+	int num = 0;
+	for (int t = 0; t < partNum; ++t) {
+		int begin = 0;
+		int end = 0;
+		split_range(m_dataNum, t, partNum, &begin, &end);
+
+		int first = num;
+		for (int i = begin; i < end; ++i) {
+			float weight = resampleFlag ? neg_sample_weight(m_data + i, i, iterNum) : m_data[i].weight;
+			if (weight > 0.0f) {
+				order[num++] = i;
+			}
+		}
+
+		// Further entries of heavy rows follow, so block shuffles keep the single entries together
+		int rowEnd = num;
+		for (int e = first; e < rowEnd; ++e) {
+			for (int n = 1; n < m_data[order[e]].repeat; ++n) {
+				order[num++] = order[e];
+			}
+		}
+		shuffle_order(order + first, num - first, &rng);
+
+		if (bounds != NULL) {
+			bounds[t] = first;
+			bounds[t + 1] = num;
+		}
+	}
+
+	return num;
+}
+
+void FM::shuffle_order(int* order, int num, RandState* rng)
+{
+	// Row shuffle, Fisher-Yates
+	if (m_shuffleBlock <= 1 || num <= m_shuffleBlock) {
+		for (int i = num - 1; i > 0; --i) {
+			int index = rand_below(rng, i + 1);
+			int temp = order[i];
+			order[i] = order[index];
+			order[index] = temp;
+		}
+		return;
+	}
+
+	// Block shuffle, whole blocks change places and rows only move inside their block, so an epoch
+	// reads the feature vectors of a block together. The partial last block takes part in the block
+	// shuffle, so the rows cut off by the last mini-batch differ between epochs
+	int blockSize = m_shuffleBlock;
+	int blockNum = (num + blockSize - 1) / blockSize;
+	int* blockOrder = new int[blockNum];
+	for (int b = 0; b < blockNum; ++b) {
+		blockOrder[b] = b;
+	}
+	for (int b = blockNum - 1; b > 0; --b) {
+		int index = rand_below(rng, b + 1);
+		int temp = blockOrder[b];
+		blockOrder[b] = blockOrder[index];
+		blockOrder[index] = temp;
+	}
+
+	int* source = new int[num];
+	memcpy(source, order, sizeof(int) * num);
+	int first = 0;
+	for (int b = 0; b < blockNum; ++b) {
+		int begin = blockOrder[b] * blockSize;
+		int size = MIN(blockSize, num - begin);
+		int* block = order + first;
+		memcpy(block, source + begin, sizeof(int) * size);
+		for (int i = size - 1; i > 0; --i) {
+			int index = rand_below(rng, i + 1);
+			int temp = block[i];
+			block[i] = block[index];
+			block[index] = temp;
+		}
+		first += size;
+	}
+
+	delete[] source;
+	delete[] blockOrder;
+}
+
+int FM::run_mini_batch_sgd(int begin, int end)
+{
+	return run_batch_sgd(m_data, m_order + begin, end - begin);
+}
+
+int FM::run_batch_sgd(Data* data, const int* rows, int num)
+{
+	// Set gradients to 0 at the begining of mini-batch SGD
+	m_gradW0 = 0.0f;
+	for (int i = 0; i < m_featNum; ++i) {
+		m_gradW[i] = 0.0f;
+	}
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = 0; j < m_factSize * m_fmFeatStride; ++j) {
+			m_gradV[i][j] = 0.0f;
+		}
+	}
+
+	// Calculate scores and gradients for mini-batch data
+	LossPartial* partial = m_lossPartials;
+	for (int i = 0; i < num; ++i) {
+		Data* ptrData = data + rows[i];
+		ptrData->score = predict(ptrData);
+		calculate_gradients(ptrData);
+
+		double error = ptrData->score - ptrData->y;
+		partial->loss += ptrData->weight * error * error;
+	}
+
+	float step = m_learnRate;
+
+	// Update weights
+	double regDelta = update_bias(m_gradW0, step);
+
+	for (int i = 0; i < m_featNum; ++i) {
+		if (is_feat_filtered(i)) {
+			continue;
+		}
+
+		regDelta += update_weight(i, m_gradW[i], step);
+	}
+
+	// Update factors
+	++m_roundStep;
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = 0; j < m_factSize * m_fmFeatStride; ++j) {
+			regDelta += update_factor(i, j, m_gradV[i][j], step);
+		}
+	}
+	partial->regLoss += regDelta;
+	
+	return 0;
+}
+
+float FM::update_bias(float grad, float step)
+{
+	// Returns the change of the regularization norm
+	float w0 = m_w0;
+	if (m_norm == 1) {
+		m_w0 = proximal_operator_L1(m_w0 - step * grad);
+	} else {
+		grad += 2 * m_regFactor * m_w0;
+		//	m_sumGrad2 += grad * grad;
+		m_momentumW0 = S_MOMENTUM_FACTOR * m_momentumW0 - step * grad;
+		m_w0 += m_momentumW0;
+	}
+
+	return reg_norm(m_norm, m_w0) - reg_norm(m_norm, w0);
+}
+
+float FM::update_weight(int index, float grad, float step)
+{
+	float w = m_w[index];
+	if (m_norm == 1) {
+		m_w[index] = proximal_operator_L1(m_w[index] - step * grad);
+	} else {
+		grad += 2 * m_regFactor * m_w[index];
+		//m_sumGrad2 += grad * grad;
+		m_momentumW[index] = S_MOMENTUM_FACTOR * m_momentumW[index] - step * grad;
+		m_w[index] += m_momentumW[index];
+	}
+
+	return reg_norm(m_norm, m_w[index]) - reg_norm(m_norm, w);
+}
+
+float FM::update_factor(int degree, int index, float grad, float step)
+{
+	// The norm change uses the stored value, so 16-bit rounding does not drift the running norm
+	float v = get_factor(degree, index);
+	float newV = 0.0f;
+	if (m_norm == 1) {
+		newV = proximal_operator_L1(v - step * grad);
+	} else {
+		grad += 2 * m_regFactor * v;
+		//				m_sumGrad2 += grad * grad;
+		float momentum = S_MOMENTUM_FACTOR * get_momentum(degree, index) - step * grad;
+		set_momentum(degree, index, momentum);
+		newV = v + momentum;
+	}
+	set_factor(degree, index, newV);
+	newV = get_factor(degree, index);
+
+	return reg_norm(m_norm, newV) - reg_norm(m_norm, v);
+}
+
+int FM::run_hogwild_sgd()
+{
+	return run_threads(&FM::hogwild_sgd_thread, NULL);
+}
+
+void FM::hogwild_sgd_thread(int threadId, void* /* arg */)
+{
+	// Each thread takes a contiguous part of the epoch order, NUMA parts are the ones of the order
+	int begin = 0;
+	int end = 0;
+	if (m_numaSampleNum != NULL) {
+		begin = m_orderBounds[threadId];
+		end = m_orderBounds[threadId + 1];
+	} else {
+		split_range(m_orderNum, threadId, m_threadNum, &begin, &end);
+	}
+	double beginTime = get_time_sec();
+
+	LossPartial* partial = m_lossPartials + threadId;
+	for (int i = begin; i < end; ++i) {
+		Data* ptrData = m_data + m_order[i];
+		predict(ptrData);
+		run_sample_sgd(ptrData, partial);
+	}
+
+	if (m_numaSampleNum != NULL) {
+		m_numaSampleNum[threadId] += end - begin;
+		m_numaBusyTime[threadId] += get_time_sec() - beginTime;
+	}
+}
+
+int FM::run_sample_sgd(Data* ptrData, LossPartial* partial)
+{
+	// Sparse SGD step on one scored sample, only touching its non-zero features.
+	// Shared parameters are read and written without locks, as in Hogwild!
+	float rawError = ptrData->score - ptrData->y;
+	float scale = backprop_scale(ptrData);
+	if (scale == 0.0f) {
+		partial->loss += static_cast<double>(ptrData->weight) * rawError * rawError;
+		return 0;
+	}
+
+	float error = ptrData->weight * scale * rawError;
+	float step = m_learnRate;
+	const float* x = ptrData->x;
+
+	float w0 = m_w0;
+	if (m_norm == 1) {
+		m_w0 = proximal_operator_L1(w0 - step * 2 * error);
+	} else {
+		m_w0 = w0 - step * (2 * error + 2 * m_regFactor * w0);
+	}
+	double regDelta = reg_norm(m_norm, m_w0) - reg_norm(m_norm, w0);
+
+	for (int k = 0; k < m_featNum; ++k) {
+		if ((x[k] < 1e-6 && x[k] > -1e-6) || is_feat_filtered(k)) {
+			continue;
+		}
+		regDelta += update_weight(k, x[k] * 2 * error, step);
+	}
+
+	// Same factor gradients as calculate_gradients, the sums are taken before the factor is updated
+	__atomic_fetch_add(&m_roundStep, 1, __ATOMIC_RELAXED);
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = 0; j < m_factSize; ++j) {
+			float squareSum = 0.0f;
+			float cubeSum = 0.0f;
+			float sum = sum_factor_row(i, j * m_fmFeatStride, x, 0, m_fmFeatNum, &squareSum, &cubeSum);
+			float sumSquare = sum * sum;
+
+			for (int c = 0; c < m_fmFeatNum; ++c) {
+				float xc = x[m_fmFeatList[c]];
+				if (xc < 1e-6 && xc > -1e-6) {
+					continue;
+				}
+
+				int index = j * m_fmFeatStride + c;
+				float gradItem = 0.0f;
+				float item = get_factor(i, index) * xc;
+
+				if (i == 1) {
+					gradItem = xc * (sum - item);
+				} else if (i == 2) {
+					gradItem = xc * (0.5 * sumSquare - sum * item - 0.5 * squareSum + item * item);
+				}
+
+				regDelta += update_factor(i, index, 2 * error * gradItem, step);
+			}
+		}
+	}
+
+	partial->loss += static_cast<double>(ptrData->weight) * rawError * rawError;
+	partial->regLoss += regDelta;
+
+	return 0;
+}
+
+int FM::run_sync_sgd()
+{
+	// Threads stay alive for the whole epoch and meet at barriers between phases
+	pthread_barrier_init(&m_barrier, NULL, MAX(m_threadNum, 1));
+	run_threads(&FM::sync_sgd_thread, NULL);
+	pthread_barrier_destroy(&m_barrier);
+
+	return 0;
+}
+
+void FM::sync_sgd_thread(int threadId, void* /* arg */)
+{
+	int threadNum = MAX(m_threadNum, 1);
+	float step = m_learnRate;
+
+	// Features and factor columns updated by this thread
+	int featBegin = 0;
+	int featEnd = 0;
+	int colBegin = 0;
+	int colEnd = 0;
+	split_range(m_featNum, threadId, threadNum, &featBegin, &featEnd);
+	split_range(m_fmFeatNum, threadId, threadNum, &colBegin, &colEnd);
+
+	int indexBegin = 0;
+	int indexEnd = MIN(indexBegin + m_mini_batch, m_orderNum);
+
+	while (1) {
+		// Batches come from the pipeline or from the epoch order
+		BatchRows batch;
+		batch.data = NULL;
+		batch.rows = NULL;
+		int batchNum = 0;
+		if (m_pipelineDepth > 0) {
+			if (threadId == 0) {
+				m_curSlot = pop_batch();
+			}
+			pthread_barrier_wait(&m_barrier);
+			batch.data = m_curSlot->data;
+			batch.rows = m_slotRows;
+			batchNum = m_curSlot->num;
+		} else if (indexEnd <= m_orderNum) {
+			batch.data = m_data;
+			batch.rows = m_order + indexBegin;
+			batchNum = indexEnd - indexBegin;
+		}
+
+		if (batchNum == 0) {
+			// Everyone must read the marker before thread 0 hands it back
+			pthread_barrier_wait(&m_barrier);
+			break;
+		}
+
+		// Shards depend on the batch only, never on the thread number. They hold similar numbers
+		// of non-zeros and any thread may take any shard, so gradients are still reproducible
+		int shardNum = (batchNum + S_GRAD_SHARD_SIZE - 1) / S_GRAD_SHARD_SIZE;
+		if (threadId == 0) {
+			build_nnz_tasks(batch.data, batch.rows, batchNum, shardNum);
+			reset_tasks(shardNum);
+		}
+		pthread_barrier_wait(&m_barrier);
+
+		process_tasks(threadId, &FM::sync_shard_task, &batch);
+
+		double waitTime = get_time_sec();
+		pthread_barrier_wait(&m_barrier);
+		m_taskStats[threadId].idleTime += get_time_sec() - waitTime;
+
+		// Fixed-order tree reduction into shard 0
+		for (int stride = 1; stride < shardNum; stride *= 2) {
+			int pair = 0;
+			for (int s = 0; s + stride < shardNum; s += 2 * stride, ++pair) {
+				if (pair % threadNum == threadId) {
+					merge_grad_buffer(m_gradBuf + s, m_gradBuf + s + stride);
+				}
+			}
+			pthread_barrier_wait(&m_barrier);
+		}
+
+		// Update the parameters owned by this thread
+		const GradBuffer* grad = m_gradBuf;
+		double regDelta = 0.0;
+		if (threadId == 0) {
+			regDelta += update_bias(grad->gradW0, step);
+			m_lossPartials[0].loss += grad->loss;
+		}
+
+		for (int k = featBegin; k < featEnd; ++k) {
+			if (!is_feat_filtered(k)) {
+				regDelta += update_weight(k, grad->gradW[k], step);
+			}
+		}
+
+		for (int i = 1; i < m_degree; ++i) {
+			for (int j = 0; j < m_factSize; ++j) {
+				for (int c = colBegin; c < colEnd; ++c) {
+					int index = j * m_fmFeatStride + c;
+					regDelta += update_factor(i, index, grad->gradV[i][index], step);
+				}
+			}
+		}
+		m_lossPartials[threadId].regLoss += regDelta;
+		pthread_barrier_wait(&m_barrier);
+
+		if (threadId == 0) {
+			++m_roundStep;
+			if (m_pipelineDepth > 0) {
+				finish_batch(m_curSlot);
+			}
+		}
+
+		indexBegin = indexEnd;
+		indexEnd = indexBegin + m_mini_batch;
+	}
+
+	// Hand the end-of-epoch marker back to the producer
+	if (m_pipelineDepth > 0 && threadId == 0) {
+		finish_batch(m_curSlot);
+	}
+}
+
+int FM::run_feature_parallel_sgd()
+{
+	// Threads own their feature ranges for the whole epoch and meet at barriers between phases
+	pthread_barrier_init(&m_barrier, NULL, MAX(m_threadNum, 1));
+	run_threads(&FM::feature_parallel_sgd_thread, NULL);
+	pthread_barrier_destroy(&m_barrier);
+
+	return 0;
+}
+
+void FM::feature_parallel_sgd_thread(int threadId, void* /* arg */)
+{
+	const int CACHE_LINE_FLOATS = 16;
+	int lineFactors = (m_precision == PRECISION_FP32) ? CACHE_LINE_FLOATS : 2 * CACHE_LINE_FLOATS;
+
+	int threadNum = MAX(m_threadNum, 1);
+	int partialSize = feat_partial_size(m_degree, m_factSize);
+	int totalSize = feat_total_size(m_degree, m_factSize);
+	float step = m_learnRate;
+
+	// Weights and factor columns owned by this thread, only it reads and writes them
+	int featBegin = 0;
+	int featEnd = 0;
+	int colBegin = 0;
+	int colEnd = 0;
+	split_aligned_range(m_featNum, CACHE_LINE_FLOATS, threadId, threadNum, &featBegin, &featEnd);
+	split_aligned_range(m_fmFeatNum, lineFactors, threadId, threadNum, &colBegin, &colEnd);
+	float* partial = m_featPartial[threadId];
+
+	int indexBegin = 0;
+	int indexEnd = MIN(indexBegin + m_mini_batch, m_orderNum);
+
+	while (1) {
+		// Batches come from the pipeline or from the epoch order
+		BatchRows batch;
+		batch.data = NULL;
+		batch.rows = NULL;
+		int batchNum = 0;
+		if (m_pipelineDepth > 0) {
+			if (threadId == 0) {
+				m_curSlot = pop_batch();
+			}
+			pthread_barrier_wait(&m_barrier);
+			batch.data = m_curSlot->data;
+			batch.rows = m_slotRows;
+			batchNum = m_curSlot->num;
+		} else if (indexEnd <= m_orderNum) {
+			batch.data = m_data;
+			batch.rows = m_order + indexBegin;
+			batchNum = indexEnd - indexBegin;
+		}
+
+		if (batchNum == 0) {
+			// Everyone must read the marker before thread 0 hands it back
+			pthread_barrier_wait(&m_barrier);
+			break;
+		}
+
+		// Partial sums of every sample over the owned features
+		for (int n = 0; n < batchNum; ++n) {
+			const Data* ptrData = batch.data + batch.rows[n];
+			const float* x = ptrData->x;
+			float* p = partial + n * partialSize;
+
+			float linear = 0.0f;
+			for (int k = featBegin; k < featEnd; ++k) {
+				linear += m_w[k] * x[k];
+			}
+			p[0] = linear;
+
+			for (int i = 1; i < m_degree; ++i) {
+				for (int j = 0; j < m_factSize; ++j) {
+					float squareSum = 0.0f;
+					float cubeSum = 0.0f;
+					float sum = sum_factor_row(i, j * m_fmFeatStride, x, colBegin, colEnd, &squareSum, &cubeSum);
+
+					float* q = p + 1 + 3 * ((i - 1) * m_factSize + j);
+					q[0] = sum;
+					q[1] = squareSum;
+					q[2] = cubeSum;
+				}
+			}
+		}
+		pthread_barrier_wait(&m_barrier);
+
+		// Complete the scores of a share of the samples, partials are added in thread order
+		int begin = 0;
+		int end = 0;
+		split_range(batchNum, threadId, threadNum, &begin, &end);
+		for (int n = begin; n < end; ++n) {
+			Data* ptrData = batch.data + batch.rows[n];
+			float* total = m_featTotal + n * totalSize;
+			float score = m_w0;
+			for (int t = 0; t < threadNum; ++t) {
+				score += m_featPartial[t][n * partialSize];
+			}
+
+			for (int i = 1; i < m_degree; ++i) {
+				for (int j = 0; j < m_factSize; ++j) {
+					int offset = (i - 1) * m_factSize + j;
+					float sum = 0.0f;
+					float squareSum = 0.0f;
+					float cubeSum = 0.0f;
+					for (int t = 0; t < threadNum; ++t) {
+						const float* q = m_featPartial[t] + n * partialSize + 1 + 3 * offset;
+						sum += q[0];
+						squareSum += q[1];
+						cubeSum += q[2];
+					}
+
+					// Same terms as predict
+					if (i == 1) {
+						score += 0.5 * (sum * sum - squareSum);
+					} else if (i == 2) {
+						score += 1.0f / 6 * (sum * sum * sum - 3 * squareSum * sum + 2 * cubeSum);
+					}
+
+					total[1 + 2 * offset] = sum;
+					total[2 + 2 * offset] = squareSum;
+				}
+			}
+
+			// Truncate
+			score = MAX(score, m_minLabel);
+			score = MIN(score, m_maxLabel);
+
+			ptrData->score = score;
+			total[0] = score;
+
+			double error = score - ptrData->y;
+			m_lossPartials[threadId].loss += ptrData->weight * error * error;
+		}
+
+		if (threadId == 0) {
+			++m_roundStep;
+		}
+		pthread_barrier_wait(&m_barrier);
+
+		// Gradients of the owned parameters, every factor uses its own completed sums
+		float gradW0 = 0.0f;
+		for (int k = featBegin; k < featEnd; ++k) {
+			m_gradW[k] = 0.0f;
+		}
+		for (int i = 1; i < m_degree; ++i) {
+			for (int j = 0; j < m_factSize; ++j) {
+				for (int c = colBegin; c < colEnd; ++c) {
+					m_gradV[i][j * m_fmFeatStride + c] = 0.0f;
+				}
+			}
+		}
+
+		for (int n = 0; n < batchNum; ++n) {
+			const Data* ptrData = batch.data + batch.rows[n];
+			// Every thread reads the same completed score, so all skip the same samples
+			float scale = backprop_scale(ptrData);
+			if (scale == 0.0f) {
+				continue;
+			}
+			const float* x = ptrData->x;
+			const float* total = m_featTotal + n * totalSize;
+			float error = ptrData->weight * scale * (total[0] - ptrData->y);
+			gradW0 += 2 * error;
+
+			for (int k = featBegin; k < featEnd; ++k) {
+				if (x[k] != 0.0f) {
+					m_gradW[k] += x[k] * 2 * error;
+				}
+			}
+
+			for (int i = 1; i < m_degree; ++i) {
+				for (int j = 0; j < m_factSize; ++j) {
+					int offset = (i - 1) * m_factSize + j;
+					add_factor_row_grads(i, j * m_fmFeatStride, x, colBegin, colEnd, total[1 + 2 * offset], 
+							total[2 + 2 * offset], error, m_gradV[i]);
+				}
+			}
+		}
+
+		// Update the owned parameters, w0 belongs to thread 0
+		double regDelta = 0.0;
+		if (threadId == 0) {
+			m_gradW0 = gradW0;
+			regDelta += update_bias(gradW0, step);
+		}
+
+		for (int k = featBegin; k < featEnd; ++k) {
+			if (!is_feat_filtered(k)) {
+				regDelta += update_weight(k, m_gradW[k], step);
+			}
+		}
+
+		for (int i = 1; i < m_degree; ++i) {
+			for (int j = 0; j < m_factSize; ++j) {
+				for (int c = colBegin; c < colEnd; ++c) {
+					int index = j * m_fmFeatStride + c;
+					regDelta += update_factor(i, index, m_gradV[i][index], step);
+				}
+			}
+		}
+		m_lossPartials[threadId].regLoss += regDelta;
+
+		// The next batch only reads owned parameters, but a pipeline slot is reused once released
+		if (m_pipelineDepth > 0) {
+			pthread_barrier_wait(&m_barrier);
+			if (threadId == 0) {
+				finish_batch(m_curSlot);
+			}
+		}
+
+		indexBegin = indexEnd;
+		indexEnd = indexBegin + m_mini_batch;
+	}
+
+	// Hand the end-of-epoch marker back to the producer
+	if (m_pipelineDepth > 0 && threadId == 0) {
+		finish_batch(m_curSlot);
+	}
+}
+
+void FM::clear_grad_buffer(GradBuffer* buf)
+{
+	buf->gradW0 = 0.0f;
+	buf->loss = 0.0;
+
+	for (int n = 0; n < buf->featNum; ++n) {
+		int k = buf->featList[n];
+		buf->gradW[k] = 0.0f;
+		buf->featFlag[k] = 0;
+
+		int c = m_fmFeatIndex[k];
+		if (c < 0) {
+			continue;
+		}
+
+		for (int i = 1; i < m_degree; ++i) {
+			for (int j = 0; j < m_factSize; ++j) {
+				buf->gradV[i][j * m_fmFeatStride + c] = 0.0f;
+			}
+		}
+	}
+
+	buf->featNum = 0;
+}
+
+void FM::merge_grad_buffer(GradBuffer* dst, const GradBuffer* src)
+{
+	dst->gradW0 += src->gradW0;
+	dst->loss += src->loss;
+
+	for (int n = 0; n < src->featNum; ++n) {
+		int k = src->featList[n];
+		dst->gradW[k] += src->gradW[k];
+
+		if (dst->featFlag[k] == 0) {
+			dst->featFlag[k] = 1;
+			dst->featList[dst->featNum++] = k;
+		}
+
+		int c = m_fmFeatIndex[k];
+		if (c < 0) {
+			continue;
+		}
+
+		for (int i = 1; i < m_degree; ++i) {
+			for (int j = 0; j < m_factSize; ++j) {
+				int index = j * m_fmFeatStride + c;
+				dst->gradV[i][index] += src->gradV[i][index];
+			}
+		}
+	}
+}
+
+int FM::start_pipeline()
+{
+	m_slots = new BatchSlot[m_pipelineDepth];
+	for (int n = 0; n < m_pipelineDepth; ++n) {
+		m_slots[n].data = new Data[m_mini_batch];
+		m_slots[n].xBuf = new float[static_cast<size_t>(m_mini_batch) * m_featNum];
+		m_slots[n].rowIndex = new int[m_mini_batch];
+		m_slots[n].num = 0;
+	}
+
+	// Slots hold their batch in order, so every slot trains rows 0 .. num - 1
+	m_slotRows = new int[m_mini_batch];
+	for (int n = 0; n < m_mini_batch; ++n) {
+		m_slotRows[n] = n;
+	}
+
+	m_slotHead = 0;
+	m_slotTail = 0;
+	m_pipelineStop = 0;
+	pthread_mutex_init(&m_slotMutex, NULL);
+	pthread_cond_init(&m_slotCond, NULL);
+
+	if (pthread_create(&m_producer, NULL, pipeline_entry, this) != 0) {
+		printf("[ERROR] Creating pipeline thread failed!\n");
+		stop_pipeline();
+		return -1;
+	}
+
+	return 0;
+}
+
+void FM::stop_pipeline()
+{
+	if (m_slots == NULL) {
+		return;
+	}
+
+	// The producer may still be prefetching epochs that will not run
+	pthread_mutex_lock(&m_slotMutex);
+	int runFlag = (m_pipelineStop == 0);
+	m_pipelineStop = 1;
+	pthread_cond_broadcast(&m_slotCond);
+	pthread_mutex_unlock(&m_slotMutex);
+
+	if (runFlag) {
+		pthread_join(m_producer, NULL);
+	}
+	pthread_mutex_destroy(&m_slotMutex);
+	pthread_cond_destroy(&m_slotCond);
+
+	for (int n = 0; n < m_pipelineDepth; ++n) {
+		delete[] m_slots[n].data;
+		delete[] m_slots[n].xBuf;
+		delete[] m_slots[n].rowIndex;
+	}
+	delete[] m_slots;
+	m_slots = NULL;
+	delete[] m_slotRows;
+	m_slotRows = NULL;
+}
+
+void FM::pipeline_thread(int /* threadId */, void* /* arg */)
+{
+	// The producer runs ahead of training, so it keeps its own epoch order
+	int* order = new int[MAX(m_orderSize, 1)];
+
+	// Iterations restored from a checkpoint are skipped
+	for (int iter = m_startIter; iter < m_iter_num; ++iter) {
+		int orderNum = build_epoch_order(iter, order, NULL);
+
+		// Same batches as the non-pipelined loop, plus an end-of-epoch marker
+		int indexBegin = 0;
+		int indexEnd = MIN(indexBegin + m_mini_batch, orderNum);
+		int endFlag = 0;
+
+		while (!endFlag) {
+			endFlag = (indexEnd > orderNum);
+
+			// Wait for a free slot
+			pthread_mutex_lock(&m_slotMutex);
+			while (m_slotTail - m_slotHead >= m_pipelineDepth && !m_pipelineStop) {
+				pthread_cond_wait(&m_slotCond, &m_slotMutex);
+			}
+			int stopFlag = m_pipelineStop;
+			pthread_mutex_unlock(&m_slotMutex);
+
+			if (stopFlag) {
+				delete[] order;
+				return;
+			}
+
+			// Gather rows into contiguous memory
+			BatchSlot* slot = m_slots + m_slotTail % m_pipelineDepth;
+			slot->num = endFlag ? 0 : indexEnd - indexBegin;
+			for (int n = 0; n < slot->num; ++n) {
+				int row = order[indexBegin + n];
+				const Data* src = m_data + row;
+				Data* dst = slot->data + n;
+
+				dst->x = slot->xBuf + static_cast<size_t>(n) * m_featNum;
+				memcpy(dst->x, src->x, sizeof(float) * m_featNum);
+				// Scores are written back by finish_batch meanwhile, training predicts them again anyway
+				dst->y = src->y;
+				dst->nnz = src->nnz;
+				dst->weight = src->weight;
+				dst->count = src->count;
+				dst->repeat = src->repeat;
+				dst->row = src->row;
+				if (m_negResampleFlag != 0 && m_negSampleRate < 1.0f) {
+					dst->weight = neg_sample_weight(src, row, iter);
+				}
+				slot->rowIndex[n] = row;
+			}
+
+			pthread_mutex_lock(&m_slotMutex);
+			++m_slotTail;
+			pthread_cond_broadcast(&m_slotCond);
+			pthread_mutex_unlock(&m_slotMutex);
+
+			indexBegin = indexEnd;
+			indexEnd = indexBegin + m_mini_batch;
+		}
+	}
+
+	delete[] order;
+}
+
+BatchSlot* FM::pop_batch()
+{
+	pthread_mutex_lock(&m_slotMutex);
+	while (m_slotHead == m_slotTail) {
+		pthread_cond_wait(&m_slotCond, &m_slotMutex);
+	}
+	BatchSlot* slot = m_slots + m_slotHead % m_pipelineDepth;
+	pthread_mutex_unlock(&m_slotMutex);
+
+	return slot;
+}
+
+void FM::finish_batch(BatchSlot* slot)
+{
+	// Scores of the batch feed calculate_loss
+	for (int n = 0; n < slot->num; ++n) {
+		m_data[slot->rowIndex[n]].score = slot->data[n].score;
+	}
+
+	pthread_mutex_lock(&m_slotMutex);
+	++m_slotHead;
+	pthread_cond_broadcast(&m_slotCond);
+	pthread_mutex_unlock(&m_slotMutex);
+}
+
+int FM::train_with_servers()
+{
+	if (m_solver != SOLVER_SGD) {
+		printf("[ERROR] Parameter-server training only supports SGD!\n");
+		return -1;
+	}
+
+	// Servers initialize their own shards
+	if (m_initModelFile != NULL) {
+		printf("[ERROR] Parameter-server training cannot continue from a model!\n");
+		return -1;
+	}
+
+	// read_data kept the rows i with i % m_psTrainerNum == m_psTrainerId, statistics cover all rows
+	if (init_ps_trainer() != 0 || connect_param_servers() != 0) {
+		return -1;
+	}
+
+	if (m_parallelMode != PARALLEL_HOGWILD || m_pipelineDepth > 0) {
+		printf("[WARNING] Parameter-server training runs mini-batch SGD on one thread, -m and -u ignored!\n");
+	}
+
+	int pushNum = 0;
+	collect_batch_features(m_data, NULL, m_dataNum, &pushNum);
+
+	printf("------------------------------------------------------------------------\n");
+	printf("Iteration Process... [%d iterations in total]\n", m_iter_num);
+	printf("Trainer %d of %d\t\tParameter Servers: %d\t\tStaleness: %d\n", m_psTrainerId, m_psTrainerNum, 
+			m_psServerNum, m_psStaleness);
+	printf("Local Data Number: %d\t\tPositive Number: %d\n", m_dataNum, m_posNum);
+	printf("Feature Number: %d\t\tLocal Feature Number: %d\n", m_featNum, pushNum);
+	printf("------------------------------------------------------------------------\n");
+
+	// The trainer never holds the whole model, so the loss of an iteration is the loss of its batches
+	// before their updates, without the regularization term
+	int iterNum = 0;
+	while (iterNum < m_iter_num) {
+		m_orderNum = build_epoch_order(iterNum, m_order, NULL);
+		memset(m_lossPartials, 0, sizeof(LossPartial));
+
+		// Mini-batch SGD, parameters are pulled before and gradients pushed after every batch
+		int indexBegin = 0;
+		int indexEnd = MIN(indexBegin + m_mini_batch, m_orderNum);
+
+		while(indexEnd <= m_orderNum) {
+			if (run_ps_batch_sgd(m_data, m_order + indexBegin, indexEnd - indexBegin) != 0) {
+				return -1;
+			}
+			indexBegin = indexEnd;
+			indexEnd = indexBegin + m_mini_batch;
+		}
+
+		printf("Iter[%d] \t\tLoss[%.0f]\t\tW0[%.2f]\n", ++iterNum, m_lossPartials[0].loss, m_w0);
+	}
+
+	// Servers keep no weight sums, so the final model is not smoothed
+	return finish_param_servers();
+}
+
+int FM::init_ps_trainer()
+{
+	if (m_psTrainerId < 0 || m_psTrainerId >= m_psTrainerNum) {
+		printf("[ERROR] Invalid trainer id %d of %d trainers!\n", m_psTrainerId, m_psTrainerNum);
+		return -1;
+	}
+
+	// Servers store fp32 factors and send them as fp32
+	if (m_precision != PRECISION_FP32) {
+		printf("[WARNING] Parameter-server training keeps fp32 factors, -e ignored!\n");
+		m_precision = PRECISION_FP32;
+	}
+
+	m_w0 = 0.0f;
+	delete[] m_fmFeatFlag;
+	m_fmFeatFlag = new int[m_featNum];
+	memset(m_fmFeatFlag, 0, sizeof(int) * m_featNum);
+	calculate_fm_feat_flags();
+
+	// No feature has a factor column until a batch maps it, see map_ps_features
+	delete[] m_fmFeatIndex;
+	delete[] m_fmFeatList;
+	m_fmFeatIndex = new int[m_featNum];
+	for (int k = 0; k < m_featNum; ++k) {
+		m_fmFeatIndex[k] = -1;
+	}
+	m_fmFeatList = NULL;
+	m_fmFeatNum = 0;
+	m_fmFeatStride = 0;
+
+	// Weights stay dense like the feature index, factors and their gradients live in m_psCache
+	size_t weightSize = Arena::align_size(sizeof(float) * m_featNum);
+	size_t tableSize = Arena::align_size(sizeof(float*) * m_degree);
+	if (m_arena.create(2 * (weightSize + tableSize), m_hugePageMode) != 0) {
+		return -1;
+	}
+	m_w = static_cast<float*>(m_arena.alloc(sizeof(float) * m_featNum));
+	m_gradW = static_cast<float*>(m_arena.alloc(sizeof(float) * m_featNum));
+	m_v = static_cast<float**>(m_arena.alloc(sizeof(float*) * m_degree));
+	m_gradV = static_cast<float**>(m_arena.alloc(sizeof(float*) * m_degree));
+	for (int i = 0; i < m_degree; ++i) {
+		m_v[i] = NULL;
+		m_gradV[i] = NULL;
+	}
+
+	delete[] m_lossPartials;
+	m_lossPartials = new LossPartial[1];
+	memset(m_lossPartials, 0, sizeof(LossPartial));
+	allocate_order();
+
+	m_randState = (m_randSeed != 0) ? m_randSeed : static_cast<unsigned int>(time(0));
+	m_shuffleSeed = static_cast<unsigned int>(rand_r(&m_randState));
+
+	return 0;
+}
+
+int FM::reserve_ps_cache(int colNum)
+{
+	if (colNum <= m_psCacheSize) {
+		return 0;
+	}
+
+	// The cache doubles until it holds the largest batch, columns are only valid while mapped
+	int size = MAX(colNum, 2 * m_psCacheSize);
+	size_t factorNum = static_cast<size_t>(m_factSize) * size;
+	delete[] m_psCache;
+	delete[] m_fmFeatList;
+	m_psCache = new float[2 * (m_degree - 1) * factorNum];
+	m_fmFeatList = new int[size];
+	m_psCacheSize = size;
+
+	for (int i = 1; i < m_degree; ++i) {
+		m_v[i] = m_psCache + (2 * (i - 1)) * factorNum;
+		m_gradV[i] = m_psCache + (2 * (i - 1) + 1) * factorNum;
+	}
+
+	return 0;
+}
+
+int FM::map_ps_features(const int* featList, int featNum)
+{
+	// Features with factors get the columns 0, 1, ... of the cache, with zero gradients
+	int colNum = 0;
+	for (int f = 0; f < featNum; ++f) {
+		colNum += is_fm_feat(featList[f]) ? 1 : 0;
+	}
+	reserve_ps_cache(colNum);
+
+	m_fmFeatNum = 0;
+	for (int f = 0; f < featNum; ++f) {
+		int k = featList[f];
+		if (is_fm_feat(k)) {
+			m_fmFeatIndex[k] = m_fmFeatNum;
+			m_fmFeatList[m_fmFeatNum++] = k;
+		}
+	}
+	m_fmFeatStride = m_fmFeatNum;
+
+	for (int i = 1; i < m_degree; ++i) {
+		memset(m_gradV[i], 0, sizeof(float) * m_factSize * m_fmFeatStride);
+	}
+
+	return m_fmFeatNum;
+}
+
+void FM::unmap_ps_features()
+{
+	for (int c = 0; c < m_fmFeatNum; ++c) {
+		m_fmFeatIndex[m_fmFeatList[c]] = -1;
+	}
+	m_fmFeatNum = 0;
+	m_fmFeatStride = 0;
+}
+
+int FM::connect_param_servers()
+{
+	const int CONNECT_RETRY_NUM = 100;			// Servers may start after the trainers
+	const int CONNECT_RETRY_INTERVAL = 100000;	// In microseconds
+
+	PsConfig config;
+	config.degree = m_degree;
+	config.factSize = m_factSize;
+	config.featNum = m_featNum;
+	config.norm = m_norm;
+	config.regFactor = m_regFactor;
+	config.learnRate = m_learnRate;
+	config.initStdDev = m_initStdDev;
+	config.serverNum = m_psServerNum;
+	config.trainerNum = m_psTrainerNum;
+	config.staleness = m_psStaleness;
+
+	m_psFds = new int[m_psServerNum];
+	for (int s = 0; s < m_psServerNum; ++s) {
+		m_psFds[s] = -1;
+	}
+
+	for (int s = 0; s < m_psServerNum; ++s) {
+		for (int n = 0; n < CONNECT_RETRY_NUM && m_psFds[s] < 0; ++n) {
+			m_psFds[s] = ps_connect(m_psHosts[s], m_psPorts[s]);
+			if (m_psFds[s] < 0) {
+				usleep(CONNECT_RETRY_INTERVAL);
+			}
+		}
+		if (m_psFds[s] < 0) {
+			printf("[ERROR] Cannot connect to parameter server %s:%d!\n", m_psHosts[s], m_psPorts[s]);
+			return -1;
+		}
+
+		config.serverId = s;
+		if (ps_send_message(m_psFds[s], PS_MSG_CONFIG, &config, sizeof(config)) != 0 
+				|| ps_recv_ack(m_psFds[s], &m_psBuf, &m_psBufSize) != 0) {
+			printf("[ERROR] Parameter server %s:%d rejected the model settings!\n", m_psHosts[s], m_psPorts[s]);
+			return -1;
+		}
+	}
+
+	m_psFeatList = new int[m_featNum];
+	m_psFeatFlag = new char[m_featNum];
+	memset(m_psFeatFlag, 0, m_featNum);
+	m_psGroupList = new int[S_MAX_PS_PULL_NUM];
+	m_psGroupOffset = new int[m_psServerNum + 1];
+	m_psClock = 0;
+
+	return 0;
+}
+
+int FM::collect_batch_features(const Data* data, const int* rows, int num, int* pushNum)
+{
+	// Touched features of the batch in m_psFeatList, rows NULL - data[0 .. num - 1]
+	int featNum = 0;
+	for (int i = 0; i < num; ++i) {
+		const float* x = data[(rows != NULL) ? rows[i] : i].x;
+		for (int k = 0; k < m_featNum; ++k) {
+			if (x[k] != 0.0f && m_psFeatFlag[k] == 0) {
+				m_psFeatFlag[k] = 1;
+				m_psFeatList[featNum++] = k;
+			}
+		}
+	}
+
+	// Filtered features are not trained, move them behind the pushed ones
+	int n = 0;
+	for (int f = 0; f < featNum; ++f) {
+		int k = m_psFeatList[f];
+		m_psFeatFlag[k] = 0;
+		if (!is_feat_filtered(k)) {
+			m_psFeatList[f] = m_psFeatList[n];
+			m_psFeatList[n++] = k;
+		}
+	}
+
+	*pushNum = n;
+	return featNum;
+}
+
+int FM::run_ps_batch_sgd(Data* data, const int* rows, int num)
+{
+	// Only the pushed features are cached, filtered features are neither pulled nor scored
+	int pushNum = 0;
+	int featNum = collect_batch_features(data, rows, num, &pushNum);
+	map_ps_features(m_psFeatList, pushNum);
+
+	if (wait_ps_clock() != 0 || pull_parameters(m_psFeatList, pushNum) != 0) {
+		unmap_ps_features();
+		return -1;
+	}
+
+	// Calculate scores and gradients for mini-batch data
+	m_gradW0 = 0.0f;
+	LossPartial* partial = m_lossPartials;
+	for (int i = 0; i < num; ++i) {
+		Data* ptrData = data + rows[i];
+		ptrData->score = predict(ptrData);
+		calculate_gradients(ptrData);
+
+		double error = ptrData->score - ptrData->y;
+		partial->loss += ptrData->weight * error * error;
+	}
+
+	int ret = push_gradients(m_psFeatList, pushNum);
+
+	// Only touched features have non-zero weight gradients, factor gradients go with the columns
+	for (int f = 0; f < featNum; ++f) {
+		m_gradW[m_psFeatList[f]] = 0.0f;
+	}
+	unmap_ps_features();
+
+	++m_psClock;
+	return ret;
+}
+
+int FM::wait_ps_clock()
+{
+	// Negative staleness is unbounded, the clock is never checked
+	if (m_psStaleness < 0) {
+		return 0;
+	}
+
+	int msg[2] = {m_psTrainerId, m_psClock};
+	if (ps_send_message(m_psFds[0], PS_MSG_CLOCK, msg, sizeof(msg)) != 0 
+			|| ps_recv_ack(m_psFds[0], &m_psBuf, &m_psBufSize) != 0) {
+		printf("[ERROR] Clock of trainer %d lost by parameter server 0!\n", m_psTrainerId);
+		return -1;
+	}
+
+	return 0;
+}
+
+int FM::group_ps_features(const int* featList, int featNum)
+{
+	// Counting sort by owner, group s is m_psGroupList[m_psGroupOffset[s], m_psGroupOffset[s + 1])
+	int* offset = m_psGroupOffset;
+	for (int s = 0; s <= m_psServerNum; ++s) {
+		offset[s] = 0;
+	}
+	for (int f = 0; f < featNum; ++f) {
+		++offset[ps_owner(featList[f], m_psServerNum) + 1];
+	}
+	for (int s = 0; s < m_psServerNum; ++s) {
+		offset[s + 1] += offset[s];
+	}
+	for (int f = 0; f < featNum; ++f) {
+		m_psGroupList[offset[ps_owner(featList[f], m_psServerNum)]++] = featList[f];
+	}
+	for (int s = m_psServerNum; s > 0; --s) {
+		offset[s] = offset[s - 1];
+	}
+	offset[0] = 0;
+
+	return 0;
+}
+
+int FM::pull_parameters(const int* featList, int featNum)
+{
+	int rowSize = ps_row_size(m_degree, m_factSize);
+	int begin = 0;
+
+	do {
+		int num = MIN(featNum - begin, S_MAX_PS_PULL_NUM);
+		group_ps_features(featList + begin, num);
+
+		// Send all requests before reading any reply, server 0 is always asked for w0
+		for (int s = 0; s < m_psServerNum; ++s) {
+			int count = m_psGroupOffset[s + 1] - m_psGroupOffset[s];
+			if (count == 0 && s != 0) {
+				continue;
+			}
+			if (ps_send_message(m_psFds[s], PS_MSG_PULL, m_psGroupList + m_psGroupOffset[s], 
+						sizeof(int) * count) != 0) {
+				printf("[ERROR] Pulling parameters from %s:%d failed!\n", m_psHosts[s], m_psPorts[s]);
+				return -1;
+			}
+		}
+
+		for (int s = 0; s < m_psServerNum; ++s) {
+			int count = m_psGroupOffset[s + 1] - m_psGroupOffset[s];
+			if (count == 0 && s != 0) {
+				continue;
+			}
+
+			PsHeader header;
+			if (ps_recv_message(m_psFds[s], &header, &m_psBuf, &m_psBufSize) != 0 || header.type != PS_MSG_PULL 
+					|| header.len != static_cast<int>(sizeof(float) * (1 + count * rowSize))) {
+				printf("[ERROR] Pulling parameters from %s:%d failed!\n", m_psHosts[s], m_psPorts[s]);
+				return -1;
+			}
+
+			const float* values = reinterpret_cast<const float*>(m_psBuf);
+			if (s == 0) {
+				m_w0 = values[0];
+			}
+
+			const int* group = m_psGroupList + m_psGroupOffset[s];
+			for (int f = 0; f < count; ++f) {
+				int k = group[f];
+				const float* row = values + 1 + f * rowSize;
+				m_w[k] = row[0];
+
+				int c = m_fmFeatIndex[k];
+				if (c < 0) {
+					continue;
+				}
+				for (int i = 1; i < m_degree; ++i) {
+					for (int j = 0; j < m_factSize; ++j) {
+						set_factor(i, j * m_fmFeatStride + c, row[1 + (i - 1) * m_factSize + j]);
+					}
+				}
+			}
+		}
+
+		begin += num;
+	} while (begin < featNum);
+
+	return 0;
+}
+
+int FM::push_gradients(const int* featList, int featNum)
+{
+	int rowSize = ps_row_size(m_degree, m_factSize);
+	int begin = 0;
+
+	do {
+		int num = MIN(featNum - begin, S_MAX_PS_PULL_NUM);
+		group_ps_features(featList + begin, num);
+
+		// Server 0 always gets the gradient of w0 with the first group
+		for (int s = 0; s < m_psServerNum; ++s) {
+			int count = m_psGroupOffset[s + 1] - m_psGroupOffset[s];
+			if (count == 0 && !(s == 0 && begin == 0)) {
+				continue;
+			}
+
+			size_t len = sizeof(PsPushHeader) + sizeof(int) * count + sizeof(float) * count * rowSize;
+			char* buf = ps_reserve(&m_psBuf, &m_psBufSize, len);
+			PsPushHeader* head = reinterpret_cast<PsPushHeader*>(buf);
+			int* ids = reinterpret_cast<int*>(buf + sizeof(PsPushHeader));
+			float* grads = reinterpret_cast<float*>(ids + count);
+
+			head->featNum = count;
+			head->gradW0 = (s == 0 && begin == 0) ? m_gradW0 : 0.0f;
+			memcpy(ids, m_psGroupList + m_psGroupOffset[s], sizeof(int) * count);
+
+			for (int f = 0; f < count; ++f) {
+				int k = ids[f];
+				float* row = grads + f * rowSize;
+				row[0] = m_gradW[k];
+
+				int c = m_fmFeatIndex[k];
+				for (int i = 1; i < m_degree; ++i) {
+					for (int j = 0; j < m_factSize; ++j) {
+						row[1 + (i - 1) * m_factSize + j] = (c >= 0) ? m_gradV[i][j * m_fmFeatStride + c] : 0.0f;
+					}
+				}
+			}
+
+			if (ps_send_message(m_psFds[s], PS_MSG_PUSH, buf, len) != 0) {
+				printf("[ERROR] Pushing gradients to %s:%d failed!\n", m_psHosts[s], m_psPorts[s]);
+				return -1;
+			}
+		}
+
+		// Acknowledged pushes are applied, so the next clock only counts finished updates
+		for (int s = 0; s < m_psServerNum; ++s) {
+			int count = m_psGroupOffset[s + 1] - m_psGroupOffset[s];
+			if (count == 0 && !(s == 0 && begin == 0)) {
+				continue;
+			}
+			if (ps_recv_ack(m_psFds[s], &m_psBuf, &m_psBufSize) != 0) {
+				printf("[ERROR] Pushing gradients to %s:%d failed!\n", m_psHosts[s], m_psPorts[s]);
+				return -1;
+			}
+		}
+
+		begin += num;
+	} while (begin < featNum);
+
+	return 0;
+}
+
+int FM::finish_param_servers()
+{
+	int ret = 0;
+	if (ps_send_message(m_psFds[0], PS_MSG_FINISH, &m_psTrainerId, sizeof(int)) != 0) {
+		printf("[ERROR] Finishing trainer %d failed!\n", m_psTrainerId);
+		ret = -1;
+	}
+
+	// Trainer 0 waits for all trainers and stays connected, save_server_model then stops the servers
+	if (ret == 0 && m_psTrainerId == 0) {
+		if (ps_send_message(m_psFds[0], PS_MSG_WAIT_ALL, NULL, 0) != 0 
+				|| ps_recv_ack(m_psFds[0], &m_psBuf, &m_psBufSize) != 0) {
+			printf("[ERROR] Waiting for other trainers failed!\n");
+			ret = -1;
+		}
+	}
+
+	if (ret != 0 || m_psTrainerId != 0) {
+		close_param_servers(ret == 0 ? 0 : m_psTrainerId == 0);
+	}
+
+	return ret;
+}
+
+void FM::close_param_servers(int shutdownFlag)
+{
+	for (int s = 0; s < m_psServerNum; ++s) {
+		if (m_psFds[s] < 0) {
+			continue;
+		}
+		if (shutdownFlag != 0) {
+			ps_send_message(m_psFds[s], PS_MSG_SHUTDOWN, NULL, 0);
+		}
+		close(m_psFds[s]);
+		m_psFds[s] = -1;
+	}
+}
+
+int FM::save_server_model(const char* modelName)
+{
+	FILE* fp = fopen(modelName, "w");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Saving model failed!\n", modelName);
+		close_param_servers(1);
+		return -1;
+	}
+
+	// Same format as save_model. The model is pulled S_MAX_PS_PULL_NUM features at a time, once for
+	// the weights and once for every factor column, so the trainer never holds all of it
+	int chunkSize = MAX(MIN(m_featNum, S_MAX_PS_PULL_NUM), 1);
+	int* featList = new int[chunkSize];
+	int ret = pull_parameters(featList, 0);
+	if (ret == 0) {
+		fprintf(fp, "%d\n%d\n%d\n%f\n", m_degree, m_factSize, m_featNum, m_w0);
+	}
+
+	int columnNum = 1 + (m_degree - 1) * m_factSize;
+	for (int col = 0; col < columnNum && ret == 0; ++col) {
+		int i = (col == 0) ? 0 : (col - 1) / m_factSize + 1;
+		int j = (col == 0) ? 0 : (col - 1) % m_factSize;
+
+		for (int begin = 0; begin < m_featNum && ret == 0; begin += chunkSize) {
+			int num = MIN(chunkSize, m_featNum - begin);
+			for (int f = 0; f < num; ++f) {
+				featList[f] = begin + f;
+			}
+
+			// Features without factors get zeros
+			map_ps_features(featList, num);
+			ret = pull_parameters(featList, num);
+			for (int f = 0; f < num && ret == 0; ++f) {
+				int k = featList[f];
+				int c = m_fmFeatIndex[k];
+				if (col == 0) {
+					fprintf(fp, "%f\n", m_w[k]);
+				} else {
+					fprintf(fp, "%f\n", c < 0 ? 0.0f : get_factor(i, j * m_fmFeatStride + c));
+				}
+			}
+			unmap_ps_features();
+		}
+	}
+
+	delete[] featList;
+	fclose(fp);
+	close_param_servers(1);
+
+	if (ret != 0) {
+		printf("[ERROR] Pulling the model from the parameter servers failed!\n");
+	}
+	return ret;
+}
+
+int FM::init_numa_topology()
+{
+	const int MAX_PATH_LEN = 256;
+	const int MAX_LIST_LEN = 4096;
+	char path[MAX_PATH_LEN];
+	char buf[MAX_LIST_LEN];
+
+	if (m_numaNodeNum > 0) {
+		return 0;
+	}
+
+	// Nodes without CPUs only hold memory and get no threads
+	int* nodeIds = NULL;
+	int nodeNum = 0;
+	if (read_sys_file("/sys/devices/system/node/online", buf, MAX_LIST_LEN) == 0) {
+		nodeNum = parse_id_list(buf, &nodeIds);
+	}
+
+	m_numaNodeIds = new int[MAX(nodeNum, 1)];
+	m_numaCpus = new int*[MAX(nodeNum, 1)];
+	m_numaCpuNum = new int[MAX(nodeNum, 1)];
+	for (int n = 0; n < nodeNum; ++n) {
+		snprintf(path, MAX_PATH_LEN, "/sys/devices/system/node/node%d/cpulist", nodeIds[n]);
+		int* cpus = NULL;
+		int cpuNum = (read_sys_file(path, buf, MAX_LIST_LEN) == 0) ? parse_id_list(buf, &cpus) : 0;
+		if (cpuNum == 0) {
+			delete[] cpus;
+			continue;
+		}
+
+		m_numaNodeIds[m_numaNodeNum] = nodeIds[n];
+		m_numaCpus[m_numaNodeNum] = cpus;
+		m_numaCpuNum[m_numaNodeNum] = cpuNum;
+		++m_numaNodeNum;
+	}
+	delete[] nodeIds;
+
+	// Without sysfs all CPUs form node 0
+	if (m_numaNodeNum == 0) {
+		printf("[WARNING] Cannot read the NUMA topology, using one node!\n");
+		int cpuNum = MAX(1, static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)));
+		m_numaNodeIds[0] = 0;
+		m_numaCpus[0] = new int[cpuNum];
+		m_numaCpuNum[0] = cpuNum;
+		for (int c = 0; c < cpuNum; ++c) {
+			m_numaCpus[0][c] = c;
+		}
+		m_numaNodeNum = 1;
+	}
+
+	return 0;
+}
+
+int FM::get_thread_node(int threadId) const
+{
+	// Consecutive threads share a node
+	return static_cast<int>(static_cast<long long>(threadId) * m_numaNodeNum / MAX(m_threadNum, 1));
+}
+
+int FM::setup_numa()
+{
+	int threadNum = MAX(m_threadNum, 1);
+	m_numaSampleNum = new long long[threadNum];
+	m_numaBusyTime = new double[threadNum];
+	for (int t = 0; t < threadNum; ++t) {
+		m_numaSampleNum[t] = 0;
+		m_numaBusyTime[t] = 0.0;
+	}
+
+	// Samples are first touched by the pinned thread that trains them
+	run_threads(&FM::numa_data_thread, NULL);
+
+	if (m_numaMode == NUMA_REPLICATE) {
+		if (m_parallelMode != PARALLEL_HOGWILD || threadNum == 1) {
+			printf("[WARNING] Model replicas need Hogwild! SGD with -t > 1, the model is interleaved!\n");
+			m_numaMode = NUMA_INTERLEAVE;
+		} else {
+			m_numaReplicas = new FM*[m_numaNodeNum];
+			for (int n = 0; n < m_numaNodeNum; ++n) {
+				m_numaReplicas[n] = NULL;
+			}
+			run_threads(&FM::numa_replica_init_thread, NULL);
+		}
+	}
+
+	printf("NUMA Nodes: %d\t\tThreads per Node: %.1f\t\tModel: %s\n", m_numaNodeNum, 
+			static_cast<float>(threadNum) / m_numaNodeNum, (m_numaMode == NUMA_REPLICATE) ? "replicated" : "interleaved");
+
+	return 0;
+}
+
+void FM::numa_data_thread(int threadId, void* /* arg */)
+{
+	// Same parts as Hogwild! SGD, scoring and loss
+	int begin = 0;
+	int end = 0;
+	split_range(m_dataNum, threadId, MAX(m_threadNum, 1), &begin, &end);
+
+	for (int i = begin; i < end; ++i) {
+		float* x = new float[m_featNum];
+		memcpy(x, m_data[i].x, sizeof(float) * m_featNum);
+		delete[] m_data[i].x;
+		m_data[i].x = x;
+	}
+}
+
+void FM::numa_replica_init_thread(int threadId, void* /* arg */)
+{
+	// The first thread of every node builds its replica, so the tables are first touched locally
+	int node = get_thread_node(threadId);
+	if (threadId > 0 && get_thread_node(threadId - 1) == node) {
+		return;
+	}
+
+	FM* replica = new FM();
+	replica->m_degree = m_degree;
+	replica->m_factSize = m_factSize;
+	replica->m_norm = m_norm;
+	replica->m_regFactor = m_regFactor;
+	replica->m_learnRate = m_learnRate;
+	replica->m_precision = m_precision;
+	replica->m_hugePageMode = m_hugePageMode;
+	replica->m_maxLabel = m_maxLabel;
+	replica->m_minLabel = m_minLabel;
+	replica->m_minFeatCount = m_minFeatCount;
+	replica->m_backpropMode = m_backpropMode;
+	replica->m_backpropThreshold = m_backpropThreshold;
+	replica->m_featNum = m_featNum;
+	replica->m_fmFeatNum = m_fmFeatNum;
+	replica->m_fmFeatStride = m_fmFeatStride;
+
+	replica->m_featStat = new FeatStat[m_featNum];
+	memcpy(replica->m_featStat, m_featStat, sizeof(FeatStat) * m_featNum);
+	replica->m_fmFeatIndex = new int[m_featNum];
+	memcpy(replica->m_fmFeatIndex, m_fmFeatIndex, sizeof(int) * m_featNum);
+	replica->m_fmFeatList = new int[m_featNum];
+	memcpy(replica->m_fmFeatList, m_fmFeatList, sizeof(int) * m_fmFeatNum);
+
+	replica->m_numaBindNode = m_numaNodeIds[node];
+	if (replica->allocate_parameters(1) != 0) {
+		delete replica;
+		return;
+	}
+
+	m_numaReplicas[node] = replica;
+}
+
+int FM::run_numa_replica_sgd()
+{
+	// Replicas start from the master model and are averaged back after the epoch
+	int averageFlag = 0;
+	run_threads(&FM::numa_sync_thread, &averageFlag);
+
+	run_threads(&FM::numa_replica_sgd_thread, NULL);
+
+	averageFlag = 1;
+	run_threads(&FM::numa_sync_thread, &averageFlag);
+
+	return 0;
+}
+
+void FM::numa_replica_sgd_thread(int threadId, void* /* arg */)
+{
+	// Lock-free SGD on the replica of the node, nodes without a replica use the master model
+	FM* replica = m_numaReplicas[get_thread_node(threadId)];
+	if (replica == NULL) {
+		replica = this;
+	}
+
+	int begin = m_orderBounds[threadId];
+	int end = m_orderBounds[threadId + 1];
+	double beginTime = get_time_sec();
+
+	// Norm changes of a replica are dropped, the norm is recomputed after averaging
+	LossPartial* partial = m_lossPartials + threadId;
+	for (int i = begin; i < end; ++i) {
+		Data* ptrData = m_data + m_order[i];
+		replica->predict(ptrData);
+		replica->run_sample_sgd(ptrData, partial);
+	}
+
+	m_numaSampleNum[threadId] += end - begin;
+	m_numaBusyTime[threadId] += get_time_sec() - beginTime;
+}
+
+void FM::numa_sync_thread(int threadId, void* arg)
+{
+	int averageFlag = *static_cast<int*>(arg);
+	int threadNum = MAX(m_threadNum, 1);
+
+	FM** replicas = static_cast<FM**>(alloca(sizeof(FM*) * m_numaNodeNum));
+	int replicaNum = 0;
+	for (int n = 0; n < m_numaNodeNum; ++n) {
+		if (m_numaReplicas[n] != NULL) {
+			replicas[replicaNum++] = m_numaReplicas[n];
+		}
+	}
+	if (replicaNum == 0) {
+		return;
+	}
+
+	if (threadId == 0) {
+		if (averageFlag != 0) {
+			float sum = 0.0f;
+			for (int r = 0; r < replicaNum; ++r) {
+				sum += replicas[r]->m_w0;
+			}
+			m_w0 = sum / replicaNum;
+		} else {
+			for (int r = 0; r < replicaNum; ++r) {
+				replicas[r]->m_w0 = m_w0;
+			}
+		}
+	}
+
+	int begin = 0;
+	int end = 0;
+	split_range(m_featNum, threadId, threadNum, &begin, &end);
+	for (int k = begin; k < end; ++k) {
+		if (averageFlag != 0) {
+			float sum = 0.0f;
+			for (int r = 0; r < replicaNum; ++r) {
+				sum += replicas[r]->m_w[k];
+			}
+			m_w[k] = sum / replicaNum;
+		} else {
+			for (int r = 0; r < replicaNum; ++r) {
+				replicas[r]->m_w[k] = m_w[k];
+			}
+		}
+	}
+
+	split_range(m_factSize * m_fmFeatStride, threadId, threadNum, &begin, &end);
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = begin; j < end; ++j) {
+			if (averageFlag != 0) {
+				float sum = 0.0f;
+				for (int r = 0; r < replicaNum; ++r) {
+					sum += replicas[r]->get_factor(i, j);
+				}
+				set_factor(i, j, sum / replicaNum);
+			} else {
+				float v = get_factor(i, j);
+				for (int r = 0; r < replicaNum; ++r) {
+					replicas[r]->set_factor(i, j, v);
+				}
+			}
+		}
+	}
+}
+
+void FM::print_numa_report()
+{
+	if (m_numaSampleNum == NULL) {
+		return;
+	}
+
+	// Node throughput is its sample number over the mean busy time of its threads
+	printf("------------------------------------------------------------------------\n");
+	for (int n = 0; n < m_numaNodeNum; ++n) {
+		long long sampleNum = 0;
+		double busyTime = 0.0;
+		int threadNum = 0;
+		for (int t = 0; t < MAX(m_threadNum, 1); ++t) {
+			if (get_thread_node(t) == n) {
+				sampleNum += m_numaSampleNum[t];
+				busyTime += m_numaBusyTime[t];
+				++threadNum;
+			}
+		}
+
+		if (threadNum == 0 || busyTime <= 0.0) {
+			printf("Node[%d] \t\tThreads[%d]\n", m_numaNodeIds[n], threadNum);
+			continue;
+		}
+		printf("Node[%d] \t\tThreads[%d]\t\tSamples[%lld]\t\tSamples/s[%.0f]\n", m_numaNodeIds[n], threadNum, 
+				sampleNum, sampleNum / (busyTime / threadNum));
+	}
+}
+
+int FM::set_sweep(const char* spec, int randomNum)
+{
+	// Grid is built by run_sweep, so keys left out take the final values of the other options
+	delete[] m_sweepSpec;
+	m_sweepSpec = new char[strlen(spec) + 1];
+	strcpy(m_sweepSpec, spec);
+	m_sweepRandomNum = randomNum;
+
+	return 0;
+}
+
+int FM::build_sweep_configs()
+{
+	// Format: d=2,3;k=4,8;l=0.01,0.001;c=0,0.1
+	const int MAX_SWEEP_VALUE_NUM = 64;
+	const char* KEYS = "dklc";
+	const int KEY_NUM = 4;
+	float values[KEY_NUM][MAX_SWEEP_VALUE_NUM];
+	int valueNum[KEY_NUM] = {0, 0, 0, 0};
+
+	char* spec = new char[strlen(m_sweepSpec) + 1];
+	strcpy(spec, m_sweepSpec);
+
+	char* itemSave = NULL;
+	for (char* item = strtok_r(spec, ";", &itemSave); item != NULL; item = strtok_r(NULL, ";", &itemSave)) {
+		const char* key = (item[0] != '\0' && item[1] == '=') ? strchr(KEYS, item[0]) : NULL;
+		if (key == NULL) {
+			printf("[ERROR] Invalid sweep item %s (should be d=, k=, l= or c= with values)!\n", item);
+			delete[] spec;
+			return -1;
+		}
+
+		int keyIndex = static_cast<int>(key - KEYS);
+		char* valueSave = NULL;
+		for (char* value = strtok_r(item + 2, ",", &valueSave); value != NULL; 
+				value = strtok_r(NULL, ",", &valueSave)) {
+			if (valueNum[keyIndex] >= MAX_SWEEP_VALUE_NUM) {
+				printf("[ERROR] Too many sweep values of %c (max %d)!\n", *key, MAX_SWEEP_VALUE_NUM);
+				delete[] spec;
+				return -1;
+			}
+			values[keyIndex][valueNum[keyIndex]++] = atof(value);
+		}
+	}
+	delete[] spec;
+
+	// Keys left out keep the current setting
+	float defaults[KEY_NUM] = {static_cast<float>(m_degree), static_cast<float>(m_factSize), m_learnRate, 
+			m_regFactor};
+	for (int n = 0; n < KEY_NUM; ++n) {
+		if (valueNum[n] == 0) {
+			values[n][0] = defaults[n];
+			valueNum[n] = 1;
+		}
+	}
+
+	int gridNum = valueNum[0] * valueNum[1] * valueNum[2] * valueNum[3];
+	delete[] m_sweepConfigs;
+	m_sweepConfigs = new SweepConfig[gridNum];
+	m_sweepNum = 0;
+
+	for (int a = 0; a < valueNum[0]; ++a) {
+		for (int b = 0; b < valueNum[1]; ++b) {
+			for (int c = 0; c < valueNum[2]; ++c) {
+				for (int d = 0; d < valueNum[3]; ++d) {
+					SweepConfig* config = m_sweepConfigs + m_sweepNum++;
+					config->degree = static_cast<int>(values[0][a]);
+					config->factSize = static_cast<int>(values[1][b]);
+					config->learnRate = values[2][c];
+					config->regFactor = values[3][d];
+					config->loss = 0.0f;
+					config->status = -1;
+
+					if (config->degree < 1 || config->degree > 10 || config->factSize <= 0 
+							|| config->learnRate < 0 || config->regFactor < 0) {
+						printf("[ERROR] Invalid sweep configuration d=%d k=%d l=%g c=%g!\n", config->degree, 
+								config->factSize, config->learnRate, config->regFactor);
+						return -1;
+					}
+				}
+			}
+		}
+	}
+
+	// Random subset of the grid
+	if (m_sweepRandomNum > 0 && m_sweepRandomNum < m_sweepNum) {
+		RandState rng;
+		seed_rand(&rng, (m_randSeed != 0) ? m_randSeed : static_cast<unsigned int>(time(0)));
+		for (int n = 0; n < m_sweepRandomNum; ++n) {
+			int index = n + rand_below(&rng, m_sweepNum - n);
+			SweepConfig config = m_sweepConfigs[n];
+			m_sweepConfigs[n] = m_sweepConfigs[index];
+			m_sweepConfigs[index] = config;
+		}
+		m_sweepNum = m_sweepRandomNum;
+	}
+
+	return 0;
+}
+
+int FM::run_sweep(const char* modelFile)
+{
+	if (build_sweep_configs() != 0) {
+		return -1;
+	}
+
+	printf("------------------------------------------------------------------------\n");
+	printf("Sweep of %d configurations on %d threads... [%d iterations each]\n", m_sweepNum, 
+			MAX(m_threadNum, 1), m_iter_num);
+	printf("Total Data Number: %d\t\tFeature Number: %d\n", m_dataNum, m_featNum);
+	printf("------------------------------------------------------------------------\n");
+
+	// Threads take the next configuration until none is left
+	m_sweepNext = 0;
+	m_sweepModelFile = modelFile;
+	run_threads(&FM::sweep_thread, NULL);
+
+	// Summary table, also saved next to the models
+	const int MAX_FILE_NAME_LEN = 1024;
+	char fileName[MAX_FILE_NAME_LEN];
+	snprintf(fileName, MAX_FILE_NAME_LEN, "%s.sweep", modelFile);
+	FILE* fp = fopen(fileName, "w");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Saving sweep summary failed!\n", fileName);
+	}
+
+	printf("------------------------------------------------------------------------\n");
+	printf("Config\tDegree\tFactor\tLearnRate\tRegFactor\tLoss\n");
+	for (int n = 0; n < m_sweepNum; ++n) {
+		const SweepConfig* config = m_sweepConfigs + n;
+		char loss[32];
+		snprintf(loss, sizeof(loss), (config->status == 0) ? "%.4f" : "failed", config->loss);
+		printf("%d\t%d\t%d\t%g\t\t%g\t\t%s\n", n, config->degree, config->factSize, config->learnRate, 
+				config->regFactor, loss);
+		if (fp != NULL) {
+			fprintf(fp, "%d\t%d\t%d\t%g\t%g\t%s\n", n, config->degree, config->factSize, config->learnRate, 
+					config->regFactor, loss);
+		}
+	}
+
+	if (fp != NULL) {
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+void FM::copy_options(FM* model) const
+{
+	// Training options of a model trained on shared rows by one thread of a sweep or cross-validation.
+	// Threads, NUMA, pipeline, servers, checkpoints, validation and warm start belong to the whole run
+	model->set_fm_degree(m_degree);
+	model->set_factor_size(m_factSize);
+	model->set_learn_rate(m_learnRate);
+	model->set_regular_factor(m_regFactor);
+	model->set_partial_fm_flag(m_partialFmFlag);
+	model->set_init_std_dev(m_initStdDev);
+	model->set_regular_term(m_norm);
+	model->set_huge_page_mode(m_hugePageMode);
+	model->set_precision(m_precision);
+	model->set_min_feat_count(m_minFeatCount);
+	model->set_dedup_flag(m_dedupFlag);
+	model->set_shuffle_block(m_shuffleBlock);
+	model->set_parallel_mode(m_parallelMode);
+	model->set_solver(m_solver);
+	model->set_neg_sampling(m_negSampleRate, m_negResampleFlag);
+	model->set_selective_backprop(m_backpropMode, m_backpropThreshold);
+	model->set_norm_refresh_iter(m_normRefreshIter);
+	model->set_early_stop(m_patience, m_tolerance);
+	model->set_mini_batch(m_mini_batch);
+	model->set_iterations_num(m_iter_num);
+}
+
+void FM::sweep_thread(int /* threadId */, void* /* arg */)
+{
+	const int MAX_FILE_NAME_LEN = 1024;
+	char fileName[MAX_FILE_NAME_LEN];
+
+	while (1) {
+		int n = __atomic_fetch_add(&m_sweepNext, 1, __ATOMIC_RELAXED);
+		if (n >= m_sweepNum) {
+			break;
+		}
+		SweepConfig* config = m_sweepConfigs + n;
+
+		// Single-threaded model on the shared rows, with its own seed and shuffle order
+		FM* model = new FM();
+		copy_options(model);
+		model->set_fm_degree(config->degree);
+		model->set_factor_size(config->factSize);
+		model->set_learn_rate(config->learnRate);
+		model->set_regular_factor(config->regFactor);
+		model->m_randSeed = hash_uint(((m_randSeed != 0) ? m_randSeed : static_cast<unsigned int>(time(0))) + n) | 1;
+		model->m_logFlag = 0;
+		model->share_data(this, NULL, 0);
+
+		config->status = model->train();
+		if (config->status == 0) {
+			model->refresh_scores();
+			config->loss = model->calculate_loss();
+
+			snprintf(fileName, MAX_FILE_NAME_LEN, "%s.%d", m_sweepModelFile, n);
+			model->save_model(fileName);
+		}
+
+		printf("Config[%d] \t\td=%d k=%d l=%g c=%g\t\tLoss[%.0f]\n", n, config->degree, config->factSize, 
+				config->learnRate, config->regFactor, config->loss);
+		delete model;
+	}
+}
+
+void FM::set_cv_fold_num(int foldNum)
+{
+	m_cvFoldNum = foldNum;
+}
+
+int FM::run_cross_validation()
+{
+	if (m_cvFoldNum < 2 || m_cvFoldNum > m_dataNum) {
+		printf("[ERROR] Invalid fold number %d for %d samples!\n", m_cvFoldNum, m_dataNum);
+		return -1;
+	}
+
+	// Folds of a random permutation of the row indices, rows are never copied
+	RandState rng;
+	seed_rand(&rng, (m_randSeed != 0) ? m_randSeed : static_cast<unsigned int>(time(0)));
+	int* order = new int[m_dataNum];
+	for (int i = 0; i < m_dataNum; ++i) {
+		order[i] = i;
+	}
+	for (int i = m_dataNum - 1; i > 0; --i) {
+		int index = rand_below(&rng, i + 1);
+		int temp = order[i];
+		order[i] = order[index];
+		order[index] = temp;
+	}
+
+	delete[] m_cvRowFold;
+	m_cvRowFold = new int[m_dataNum];
+	for (int i = 0; i < m_dataNum; ++i) {
+		m_cvRowFold[order[i]] = i % m_cvFoldNum;
+	}
+	delete[] order;
+
+	delete[] m_cvResults;
+	m_cvResults = new FoldResult[m_cvFoldNum];
+
+	printf("------------------------------------------------------------------------\n");
+	printf("%d-fold cross-validation on %d threads... [%d iterations each]\n", m_cvFoldNum, 
+			MAX(m_threadNum, 1), m_iter_num);
+	printf("Total Data Number: %d\t\tFeature Number: %d\n", m_dataNum, m_featNum);
+	printf("------------------------------------------------------------------------\n");
+
+	// Threads take the next fold until none is left
+	m_cvNext = 0;
+	run_threads(&FM::cv_thread, NULL);
+
+	// Mean and sample standard deviation over the trained folds
+	double sumAuc = 0.0;
+	double sumSquareAuc = 0.0;
+	double sumRmse = 0.0;
+	double sumSquareRmse = 0.0;
+	int foldNum = 0;
+
+	printf("------------------------------------------------------------------------\n");
+	printf("Fold\tTrain\tTest\tAUC\tRMSE\n");
+	for (int f = 0; f < m_cvFoldNum; ++f) {
+		const FoldResult* result = m_cvResults + f;
+		if (result->status != 0) {
+			printf("%d\t%d\t%d\tfailed\n", f, result->trainNum, result->testNum);
+			continue;
+		}
+
+		printf("%d\t%d\t%d\t%.4f\t%.4f\n", f, result->trainNum, result->testNum, result->auc, result->rmse);
+		sumAuc += result->auc;
+		sumSquareAuc += static_cast<double>(result->auc) * result->auc;
+		sumRmse += result->rmse;
+		sumSquareRmse += static_cast<double>(result->rmse) * result->rmse;
+		++foldNum;
+	}
+
+	if (foldNum == 0) {
+		printf("[ERROR] No fold was trained!\n");
+		return -1;
+	}
+
+	double meanAuc = sumAuc / foldNum;
+	double meanRmse = sumRmse / foldNum;
+	double stdAuc = (foldNum > 1) ? sqrt(MAX(0.0, (sumSquareAuc - foldNum * meanAuc * meanAuc) / (foldNum - 1))) : 0.0;
+	double stdRmse = (foldNum > 1) ? sqrt(MAX(0.0, (sumSquareRmse - foldNum * meanRmse * meanRmse) / (foldNum - 1))) : 0.0;
+	printf("Mean\t\t\t%.4f\t%.4f\n", meanAuc, meanRmse);
+	printf("StdDev\t\t\t%.4f\t%.4f\n", stdAuc, stdRmse);
+
+	return 0;
+}
+
+void FM::cv_thread(int /* threadId */, void* /* arg */)
+{
+	while (1) {
+		int f = __atomic_fetch_add(&m_cvNext, 1, __ATOMIC_RELAXED);
+		if (f >= m_cvFoldNum) {
+			break;
+		}
+		FoldResult* result = m_cvResults + f;
+
+		// Single-threaded model on the shared rows outside the fold
+		FM* model = new FM();
+		copy_options(model);
+		model->m_randSeed = hash_uint(((m_randSeed != 0) ? m_randSeed : static_cast<unsigned int>(time(0))) + f) | 1;
+		model->m_logFlag = 0;
+		model->share_data(this, m_cvRowFold, f);
+
+		// Headers of the held-out rows, scored by the fold model
+		Data* heldOut = new Data[m_dataNum - model->m_dataNum];
+		int testNum = 0;
+		for (int i = 0; i < m_dataNum; ++i) {
+			if (m_cvRowFold[i] == f) {
+				heldOut[testNum++] = m_data[i];
+			}
+		}
+
+		result->trainNum = model->m_dataNum;
+		result->testNum = testNum;
+		result->status = model->train();
+		if (result->status == 0) {
+			for (int i = 0; i < testNum; ++i) {
+				model->predict(heldOut + i);
+			}
+			result->auc = calculate_auc(heldOut, testNum);
+			result->rmse = calculate_rmse(heldOut, testNum);
+		}
+
+		printf("Fold[%d] \t\tTrain[%d]\t\tTest[%d]\t\tAUC[%.4f]\n", f, result->trainNum, testNum, 
+				result->auc);
+		delete[] heldOut;
+		delete model;
+	}
+}
+
+// Ranking order of scored samples for AUC
+static int compare_score(const void* a, const void* b)
+{
+	float scoreA = static_cast<const Data*>(a)->score;
+	float scoreB = static_cast<const Data*>(b)->score;
+	return (scoreA < scoreB) ? -1 : ((scoreA > scoreB) ? 1 : 0);
+}
+
+float FM::calculate_auc(const Data* data, int num) const
+{
+	// Rank sum of positive (y > 0) samples, tied scores share their mean rank.
+	// A collapsed row stands for count samples with the same score
+	Data* sorted = new Data[num];
+	memcpy(sorted, data, sizeof(Data) * num);
+	qsort(sorted, num, sizeof(Data), compare_score);
+
+	double rankSum = 0.0;
+	long long posNum = 0;
+	long long totalNum = 0;
+	for (int i = 0; i < num; ) {
+		int j = i;
+		long long tieNum = 0;
+		long long tiePosNum = 0;
+		while (j < num && sorted[j].score == sorted[i].score) {
+			tieNum += sorted[j].count;
+			tiePosNum += (sorted[j].y > 0) ? sorted[j].count : 0;
+			++j;
+		}
+		rankSum += tiePosNum * (2 * totalNum + tieNum + 1) / 2.0;
+		posNum += tiePosNum;
+		totalNum += tieNum;
+		i = j;
+	}
+	delete[] sorted;
+
+	long long negNum = totalNum - posNum;
+	if (posNum == 0 || negNum == 0) {
+		return 0.5f;
+	}
+
+	return static_cast<float>((rankSum - posNum * (posNum + 1) / 2.0) / (static_cast<double>(posNum) * negNum));
+}
+
+float FM::calculate_rmse(const Data* data, int num) const
+{
+	double sum = 0.0;
+	long long totalNum = 0;
+	for (int i = 0; i < num; ++i) {
+		double error = data[i].score - data[i].y;
+		sum += data[i].count * error * error;
+		totalNum += data[i].count;
+	}
+
+	return (totalNum > 0) ? static_cast<float>(sqrt(sum / totalNum)) : 0.0f;
+}
+
+int FM::set_valid_file(const char* fileName)
+{
+	delete[] m_validFile;
+	m_validFile = new char[strlen(fileName) + 1];
+	strcpy(m_validFile, fileName);
+
+	return 0;
+}
+
+void FM::set_valid_metric(int metric)
+{
+	m_validMetric = metric;
+}
+
+void FM::set_early_stop(int patience, float tolerance)
+{
+	m_patience = patience;
+	m_tolerance = tolerance;
+}
+
+int FM::read_valid_data(const char* fileName)
+{
+	// Rows are read by a helper and widened to the features of the training data
+	FM* reader = new FM();
+	if (reader->read_data(fileName) != 0) {
+		printf("[ERROR] Read validation data %s failed!\n", fileName);
+		delete reader;
+		return -1;
+	}
+
+	if (reader->m_featNum > m_featNum) {
+		printf("[ERROR] Invalid feature index in validation file %s (should be <= %d)!\n", fileName, m_featNum);
+		delete reader;
+		return -1;
+	}
+
+	for (int i = 0; i < m_validNum; ++i) {
+		delete[] m_validData[i].x;
+	}
+	delete[] m_validData;
+
+	m_validNum = reader->m_dataNum;
+	m_validData = new Data[m_validNum];
+	for (int i = 0; i < m_validNum; ++i) {
+		m_validData[i] = reader->m_data[i];
+		m_validData[i].x = new float[m_featNum];
+		memcpy(m_validData[i].x, reader->m_data[i].x, sizeof(float) * reader->m_featNum);
+		memset(m_validData[i].x + reader->m_featNum, 0, sizeof(float) * (m_featNum - reader->m_featNum));
+	}
+	delete reader;
+
+	return 0;
+}
+
+float FM::evaluate_valid()
+{
+	int taskNum = build_nnz_tasks(m_validData, NULL, m_validNum, MAX(m_threadNum, 1) * S_TASKS_PER_THREAD);
+	run_tasks(&FM::valid_score_task, NULL, taskNum);
+
+	if (m_validMetric == 0) {
+		return calculate_auc(m_validData, m_validNum);
+	}
+	return calculate_rmse(m_validData, m_validNum);
+}
+
+void FM::valid_score_task(int /* threadId */, int task, void* /* arg */)
+{
+	for (int i = m_taskBounds[task]; i < m_taskBounds[task + 1]; ++i) {
+		predict(m_validData + i);
+	}
+}
+
+int FM::update_early_stop(int iterNum, float loss, float preLoss, float validMetric)
+{
+	// Training loss stalls when it falls by less than the tolerance, relative to the previous epoch
+	if (preLoss - loss < m_tolerance * fabs(preLoss)) {
+		++m_lossStallNum;
+	} else {
+		m_lossStallNum = 0;
+	}
+
+	// The validation metric stalls until it beats the best epoch by the tolerance
+	if (m_validNum > 0) {
+		float gain = (m_validMetric == 0) ? validMetric - m_bestMetric : m_bestMetric - validMetric;
+		if (gain > 0.0f) {
+			m_bestMetric = validMetric;
+			m_bestIter = iterNum;
+			save_best_model();
+		}
+		if (gain > m_tolerance) {
+			m_validStallNum = 0;
+		} else {
+			++m_validStallNum;
+		}
+	}
+
+	if (m_patience <= 0) {
+		return 0;
+	}
+
+	if (m_lossStallNum >= m_patience || m_validStallNum >= m_patience) {
+		if (m_logFlag != 0) {
+			printf("[NOTICE] Early stopping at iteration %d, %s has not improved for %d iterations\n", iterNum, 
+					(m_validStallNum >= m_patience) ? "validation metric" : "training loss", m_patience);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+void FM::save_best_model()
+{
+	int factorNum = m_factSize * m_fmFeatStride;
+	if (m_bestW == NULL) {
+		m_bestW = new float[m_featNum];
+		m_bestV = new float[MAX(1, (m_degree - 1) * factorNum)];
+	}
+
+	m_bestW0 = m_w0;
+	memcpy(m_bestW, m_w, sizeof(float) * m_featNum);
+	for (int i = 1; i < m_degree; ++i) {
+		float* bestV = m_bestV + (i - 1) * factorNum;
+		for (int j = 0; j < factorNum; ++j) {
+			bestV[j] = get_factor(i, j);
+		}
+	}
+}
+
+void FM::restore_best_model()
+{
+	int factorNum = m_factSize * m_fmFeatStride;
+	m_w0 = m_bestW0;
+	memcpy(m_w, m_bestW, sizeof(float) * m_featNum);
+	for (int i = 1; i < m_degree; ++i) {
+		const float* bestV = m_bestV + (i - 1) * factorNum;
+		for (int j = 0; j < factorNum; ++j) {
+			set_factor(i, j, bestV[j]);
+		}
+	}
+
+	if (m_logFlag != 0) {
+		printf("[NOTICE] Best %s[%.4f] at iteration %d is kept\n", (m_validMetric == 0) ? "AUC" : "RMSE", 
+				m_bestMetric, m_bestIter);
+	}
+}
+
+void FM::set_checkpoint(const char* fileName, int interval)
+{
+	delete[] m_ckptFile;
+	m_ckptFile = new char[strlen(fileName) + 1];
+	strcpy(m_ckptFile, fileName);
+	m_ckptInterval = interval;
+}
+
+void FM::set_resume_flag(int flag)
+{
+	m_resumeFlag = flag;
+}
+
+int FM::get_checkpoint_slabs(void** slabs, size_t* sizes)
+{
+	// Model and momentum in their storage precision, fp32 smoothing sums, then the best model
+	int num = 0;
+	float* weights[] = {m_w, m_momentumW, m_sumW};
+	for (int b = 0; b < 3; ++b) {
+		slabs[num] = weights[b];
+		sizes[num++] = sizeof(float) * m_featNum;
+	}
+
+	size_t factorNum = static_cast<size_t>(m_factSize) * m_fmFeatStride;
+	for (int i = 1; i < m_degree; ++i) {
+		if (m_precision == PRECISION_FP32) {
+			float** tables[] = {m_v, m_momentumV};
+			for (int b = 0; b < 2; ++b) {
+				slabs[num] = tables[b][i];
+				sizes[num++] = sizeof(float) * factorNum;
+			}
+		} else {
+			unsigned short** tables[] = {m_halfV, m_halfMomentumV};
+			for (int b = 0; b < 2; ++b) {
+				slabs[num] = tables[b][i];
+				sizes[num++] = sizeof(unsigned short) * factorNum;
+			}
+		}
+		slabs[num] = m_sumV[i];
+		sizes[num++] = sizeof(float) * factorNum;
+	}
+
+	if (m_bestW != NULL) {
+		slabs[num] = m_bestW;
+		sizes[num++] = sizeof(float) * m_featNum;
+		slabs[num] = m_bestV;
+		sizes[num++] = sizeof(float) * MAX(static_cast<size_t>(1), (m_degree - 1) * factorNum);
+	}
+
+	return num;
+}
+
+int FM::start_checkpoint_writer()
+{
+	m_ckptWriting = -1;
+	m_ckptPending = -1;
+	m_ckptStop = 0;
+	pthread_mutex_init(&m_ckptMutex, NULL);
+	pthread_cond_init(&m_ckptCond, NULL);
+
+	if (pthread_create(&m_ckptWriter, NULL, checkpoint_entry, this) != 0) {
+		printf("[ERROR] Creating checkpoint thread failed!\n");
+		pthread_mutex_destroy(&m_ckptMutex);
+		pthread_cond_destroy(&m_ckptCond);
+		return -1;
+	}
+
+	return 0;
+}
+
+void FM::stop_checkpoint_writer()
+{
+	if (m_ckptFile == NULL) {
+		return;
+	}
+
+	// The last pending snapshot is still written
+	pthread_mutex_lock(&m_ckptMutex);
+	m_ckptStop = 1;
+	pthread_cond_broadcast(&m_ckptCond);
+	pthread_mutex_unlock(&m_ckptMutex);
+
+	pthread_join(m_ckptWriter, NULL);
+	pthread_mutex_destroy(&m_ckptMutex);
+	pthread_cond_destroy(&m_ckptCond);
+}
+
+void FM::checkpoint_thread(int /* threadId */, void* /* arg */)
+{
+	const int MAX_FILE_NAME_LEN = 1024;
+	char tempFileName[MAX_FILE_NAME_LEN];
+	snprintf(tempFileName, MAX_FILE_NAME_LEN, "%s.tmp", m_ckptFile);
+
+	while (1) {
+		pthread_mutex_lock(&m_ckptMutex);
+		while (m_ckptPending < 0 && m_ckptStop == 0) {
+			pthread_cond_wait(&m_ckptCond, &m_ckptMutex);
+		}
+		if (m_ckptPending < 0) {
+			pthread_mutex_unlock(&m_ckptMutex);
+			break;
+		}
+		m_ckptWriting = m_ckptPending;
+		m_ckptPending = -1;
+		pthread_mutex_unlock(&m_ckptMutex);
+
+		// Written aside and renamed, so a crash never leaves a partial checkpoint
+		const char* buf = m_ckptBufs[m_ckptWriting];
+		FILE* fp = fopen(tempFileName, "wb");
+		int ret = (fp != NULL && fwrite(buf, 1, m_ckptSize, fp) == m_ckptSize) ? 0 : -1;
+		if (fp != NULL && fclose(fp) != 0) {
+			ret = -1;
+		}
+		if (ret != 0 || rename(tempFileName, m_ckptFile) != 0) {
+			printf("[WARNING] Writing checkpoint %s failed!\n", m_ckptFile);
+		}
+
+		pthread_mutex_lock(&m_ckptMutex);
+		m_ckptWriting = -1;
+		pthread_mutex_unlock(&m_ckptMutex);
+	}
+}
+
+int FM::save_checkpoint(int iterNum, int smoothNum, float loss)
+{
+	const int MAX_SLAB_NUM = 64;
+	void* slabs[MAX_SLAB_NUM];
+	size_t sizes[MAX_SLAB_NUM];
+	int slabNum = get_checkpoint_slabs(slabs, sizes);
+
+	if (m_ckptBufs[0] == NULL) {
+		m_ckptSize = sizeof(CheckpointHeader);
+		for (int n = 0; n < slabNum; ++n) {
+			m_ckptSize += sizes[n];
+		}
+		m_ckptBufs[0] = new char[m_ckptSize];
+		m_ckptBufs[1] = new char[m_ckptSize];
+	}
+
+	// Fill the snapshot the writer is not using, a newer snapshot replaces a pending one
+	pthread_mutex_lock(&m_ckptMutex);
+	int b = (m_ckptWriting == 0) ? 1 : 0;
+	if (m_ckptPending == b) {
+		m_ckptPending = -1;
+	}
+	pthread_mutex_unlock(&m_ckptMutex);
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, S_CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.degree = m_degree;
+	header.factSize = m_factSize;
+	header.featNum = m_featNum;
+	header.fmFeatNum = m_fmFeatNum;
+	header.precision = m_precision;
+	header.dataNum = m_dataNum;
+	header.miniBatch = m_mini_batch;
+	header.learnRate = m_learnRate;
+	header.regFactor = m_regFactor;
+	header.norm = m_norm;
+	header.solver = m_solver;
+	header.parallelMode = m_parallelMode;
+	header.threadNum = m_threadNum;
+	header.negSampleRate = m_negSampleRate;
+	header.negResampleFlag = m_negResampleFlag;
+	header.dedupFlag = m_dedupFlag;
+	header.backpropMode = m_backpropMode;
+	header.backpropThreshold = m_backpropThreshold;
+	header.shuffleBlock = m_shuffleBlock;
+	header.randSeed = m_randSeed;
+	header.iterNum = iterNum;
+	header.smoothNum = smoothNum;
+	header.bestFlag = (m_bestW != NULL) ? 1 : 0;
+	header.roundStep = m_roundStep;
+	header.shuffleSeed = m_shuffleSeed;
+	header.randState = m_randState;
+	header.lossStallNum = m_lossStallNum;
+	header.validStallNum = m_validStallNum;
+	header.bestIter = m_bestIter;
+	header.loss = loss;
+	header.w0 = m_w0;
+	header.momentumW0 = m_momentumW0;
+	header.sumW0 = m_sumW0;
+	header.bestMetric = m_bestMetric;
+	header.bestW0 = m_bestW0;
+	header.regNorm = m_regNorm;
+
+	char* ptr = m_ckptBufs[b];
+	memcpy(ptr, &header, sizeof(header));
+	ptr += sizeof(header);
+	for (int n = 0; n < slabNum; ++n) {
+		memcpy(ptr, slabs[n], sizes[n]);
+		ptr += sizes[n];
+	}
+
+	pthread_mutex_lock(&m_ckptMutex);
+	m_ckptPending = b;
+	pthread_cond_broadcast(&m_ckptCond);
+	pthread_mutex_unlock(&m_ckptMutex);
+
+	return 0;
+}
+
+int FM::load_checkpoint(CheckpointHeader* header)
+{
+	FILE* fp = fopen(m_ckptFile, "rb");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Resuming failed!\n", m_ckptFile);
+		return -1;
+	}
+
+	if (fread(header, sizeof(CheckpointHeader), 1, fp) != 1 
+			|| memcmp(header->magic, S_CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) {
+		printf("[ERROR] %s is not a checkpoint!\n", m_ckptFile);
+		fclose(fp);
+		return -1;
+	}
+
+	// The checkpoint must come from the same data and model options
+	if (header->degree != m_degree || header->factSize != m_factSize || header->featNum != m_featNum 
+			|| header->fmFeatNum != m_fmFeatNum || header->precision != m_precision 
+			|| header->dataNum != m_dataNum || header->miniBatch != m_mini_batch) {
+		printf("[ERROR] Checkpoint %s does not match the training data or options!\n", m_ckptFile);
+		fclose(fp);
+		return -1;
+	}
+
+	// Updates, epoch orders, sampling and the thread schedule depend on these, a resumed run that
+	// changed any of them would not continue the same training
+	if (header->learnRate != m_learnRate || header->regFactor != m_regFactor || header->norm != m_norm 
+			|| header->solver != m_solver || header->parallelMode != m_parallelMode 
+			|| header->threadNum != m_threadNum || header->negSampleRate != m_negSampleRate 
+			|| header->negResampleFlag != m_negResampleFlag || header->dedupFlag != m_dedupFlag 
+			|| header->backpropMode != m_backpropMode || header->backpropThreshold != m_backpropThreshold 
+			|| header->shuffleBlock != m_shuffleBlock || header->randSeed != m_randSeed) {
+		printf("[ERROR] Checkpoint %s was written with other -l, -c, -n, -so, -m, -t, -ds, -de, -dd, -sb, -st, "
+				"-sk or -s options!\n", m_ckptFile);
+		fclose(fp);
+		return -1;
+	}
+
+	if (header->bestFlag != 0 && m_bestW == NULL) {
+		m_bestW = new float[m_featNum];
+		m_bestV = new float[MAX(1, (m_degree - 1) * m_factSize * m_fmFeatStride)];
+	}
+
+	const int MAX_SLAB_NUM = 64;
+	void* slabs[MAX_SLAB_NUM];
+	size_t sizes[MAX_SLAB_NUM];
+	int slabNum = get_checkpoint_slabs(slabs, sizes);
+	for (int n = 0; n < slabNum; ++n) {
+		if (fread(slabs[n], 1, sizes[n], fp) != sizes[n]) {
+			printf("[ERROR] Checkpoint %s is truncated!\n", m_ckptFile);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+
+	m_roundStep = header->roundStep;
+	m_shuffleSeed = header->shuffleSeed;
+	m_randState = header->randState;
+	m_lossStallNum = header->lossStallNum;
+	m_validStallNum = header->validStallNum;
+	m_bestIter = header->bestIter;
+	m_w0 = header->w0;
+	m_momentumW0 = header->momentumW0;
+	m_sumW0 = header->sumW0;
+	m_bestMetric = header->bestMetric;
+	m_bestW0 = header->bestW0;
+
+	if (m_logFlag != 0) {
+		printf("[NOTICE] Resuming from %s after iteration %d\n", m_ckptFile, header->iterNum);
+	}
+
+	return 0;
+}
+
+int FM::build_nnz_tasks(const Data* data, const int* rows, int num, int taskNum)
+{
+	if (m_taskBoundSize < taskNum + 1) {
+		delete[] m_taskBounds;
+		m_taskBoundSize = taskNum + 1;
+		m_taskBounds = new int[m_taskBoundSize];
+	}
+
+	// Cut where the running cost passes every 1 / taskNum of the total, a row costs its non-zeros plus one.
+	// Tasks cover rows[0 .. num - 1], rows NULL - data[0 .. num - 1]
+	long long totalCost = 0;
+	for (int i = 0; i < num; ++i) {
+		totalCost += data[(rows != NULL) ? rows[i] : i].nnz + 1;
+	}
+
+	int n = 0;
+	long long cost = 0;
+	m_taskBounds[0] = 0;
+	for (int i = 0; i < num; ++i) {
+		cost += data[(rows != NULL) ? rows[i] : i].nnz + 1;
+		while (n + 1 < taskNum && cost * taskNum >= totalCost * (n + 1)) {
+			m_taskBounds[++n] = i + 1;
+		}
+	}
+	while (n < taskNum) {
+		m_taskBounds[++n] = num;
+	}
+
+	return taskNum;
+}
+
+void FM::reset_tasks(int taskNum)
+{
+	int threadNum = MAX(m_threadNum, 1);
+	if (m_taskDeques == NULL) {
+		m_taskDeques = new TaskDeque[threadNum];
+		m_taskStats = new TaskStat[threadNum];
+		for (int t = 0; t < threadNum; ++t) {
+			pthread_spin_init(&m_taskDeques[t].lock, PTHREAD_PROCESS_PRIVATE);
+			memset(m_taskStats + t, 0, sizeof(TaskStat));
+		}
+	}
+
+	// Every thread starts with a contiguous range of tasks
+	for (int t = 0; t < threadNum; ++t) {
+		split_range(taskNum, t, threadNum, &m_taskDeques[t].head, &m_taskDeques[t].tail);
+	}
+}
+
+void FM::process_tasks(int threadId, TaskFunc func, void* arg)
+{
+	int threadNum = MAX(m_threadNum, 1);
+	TaskDeque* own = m_taskDeques + threadId;
+	TaskStat* stat = m_taskStats + threadId;
+	double beginTime = get_time_sec();
+	double busyTime = 0.0;
+
+	while (1) {
+		int task = -1;
+		pthread_spin_lock(&own->lock);
+		if (own->head < own->tail) {
+			task = --own->tail;
+		}
+		pthread_spin_unlock(&own->lock);
+
+		// Steal the oldest task of the next non-empty deque, tasks never create tasks,
+		// so all deques being empty means the work is done
+		for (int n = 1; n < threadNum && task < 0; ++n) {
+			TaskDeque* victim = m_taskDeques + (threadId + n) % threadNum;
+			pthread_spin_lock(&victim->lock);
+			if (victim->head < victim->tail) {
+				task = victim->head++;
+				++stat->stealNum;
+			}
+			pthread_spin_unlock(&victim->lock);
+		}
+
+		if (task < 0) {
+			break;
+		}
+
+		double taskTime = get_time_sec();
+		(this->*func)(threadId, task, arg);
+		busyTime += get_time_sec() - taskTime;
+		++stat->taskNum;
+	}
+
+	stat->exitTime = get_time_sec();
+	stat->busyTime += busyTime;
+	stat->idleTime += stat->exitTime - beginTime - busyTime;
+}
+
+// Task function and argument of FM::run_tasks
+struct TaskRun {
+	TaskFunc func;
+	void* arg;
+};
+
+int FM::run_tasks(TaskFunc func, void* arg, int taskNum)
+{
+	reset_tasks(taskNum);
+
+	TaskRun run;
+	run.func = func;
+	run.arg = arg;
+	run_threads(&FM::task_thread, &run);
+
+	// Threads that ran out of tasks early waited for the last one
+	int threadNum = MAX(m_threadNum, 1);
+	double lastExitTime = 0.0;
+	for (int t = 0; t < threadNum; ++t) {
+		lastExitTime = MAX(lastExitTime, m_taskStats[t].exitTime);
+	}
+	for (int t = 0; t < threadNum; ++t) {
+		m_taskStats[t].idleTime += lastExitTime - m_taskStats[t].exitTime;
+	}
+
+	return 0;
+}
+
+void FM::task_thread(int threadId, void* arg)
+{
+	const TaskRun* run = static_cast<const TaskRun*>(arg);
+	process_tasks(threadId, run->func, run->arg);
+}
+
+void FM::score_task(int /* threadId */, int task, void* arg)
+{
+	// Int8 models score through the QuantizedFM in arg
+	const QuantizedFM* qfm = static_cast<const QuantizedFM*>(arg);
+	for (int i = m_taskBounds[task]; i < m_taskBounds[task + 1]; ++i) {
+		if (qfm != NULL) {
+			m_data[i].score = qfm->predict(m_data + i, m_minLabel, m_maxLabel);
+		} else {
+			predict(m_data + i);
+		}
+	}
+}
+
+void FM::sync_shard_task(int /* threadId */, int task, void* arg)
+{
+	const BatchRows* batch = static_cast<const BatchRows*>(arg);
+	GradBuffer* buf = m_gradBuf + task;
+	clear_grad_buffer(buf);
+
+	for (int i = m_taskBounds[task]; i < m_taskBounds[task + 1]; ++i) {
+		Data* ptrData = batch->data + batch->rows[i];
+		ptrData->score = predict(ptrData);
+		accumulate_gradients(ptrData, &buf->gradW0, buf->gradW, buf->gradV);
+
+		double error = ptrData->score - ptrData->y;
+		buf->loss += ptrData->weight * error * error;
+		if (backprop_scale(ptrData) == 0.0f) {
+			continue;
+		}
+
+		for (int k = 0; k < m_featNum; ++k) {
+			if (ptrData->x[k] != 0.0f && buf->featFlag[k] == 0) {
+				buf->featFlag[k] = 1;
+				buf->featList[buf->featNum++] = k;
+			}
+		}
+	}
+}
+
+void FM::print_task_report()
+{
+	if (m_taskStats == NULL || m_threadNum <= 1) {
+		return;
+	}
+
+	printf("------------------------------------------------------------------------\n");
+	for (int t = 0; t < m_threadNum; ++t) {
+		const TaskStat* stat = m_taskStats + t;
+		printf("Thread[%d] \t\tBusy[%.3fs]\t\tIdle[%.3fs]\t\tTasks[%lld]\t\tStolen[%lld]\n", t, stat->busyTime, 
+				stat->idleTime, stat->taskNum, stat->stealNum);
+	}
+}
+
+float FM::neg_sample_weight(const Data* ptrData, int index, int iterNum) const
+{
+	// Same draw for the same position and epoch, so resumed runs sample alike. Weights are per entry
+	float weight = static_cast<float>(ptrData->count) / ptrData->repeat;
+	if (ptrData->y > 0) {
+		return weight;
+	}
+
+	unsigned int seed = hash_uint(m_shuffleSeed ^ hash_uint(static_cast<unsigned int>(iterNum) * 0x9e3779b1U));
+	float r = hash_uint(seed ^ static_cast<unsigned int>(index)) / 4294967296.0f;
+	return (r < m_negSampleRate) ? weight / m_negSampleRate : 0.0f;
+}
+
+int FM::sample_negatives(int iterNum)
+{
+	int keepNum = 0;
+	int negNum = 0;
+	for (int i = 0; i < m_dataNum; ++i) {
+		m_data[i].weight = neg_sample_weight(m_data + i, i, iterNum);
+		negNum += (m_data[i].y > 0) ? 0 : 1;
+		keepNum += (m_data[i].y <= 0 && m_data[i].weight > 0.0f) ? 1 : 0;
+	}
+
+	if (iterNum == 0 && m_logFlag != 0) {
+		printf("[NOTICE] Negative sampling keeps %d of %d negatives, weighted by %.2f\n", keepNum, negNum, 
+				1.0f / m_negSampleRate);
+	}
+
+	return keepNum;
+}
+
+float FM::backprop_scale(const Data* ptrData) const
+{
+	// Gradient scale of a scored example, 0 - its backward pass is skipped
+	if (m_backpropMode == BACKPROP_ALL) {
+		return 1.0f;
+	}
+
+	float error = fabs(ptrData->score - ptrData->y);
+	if (m_backpropMode == BACKPROP_THRESHOLD) {
+		return (error < m_backpropThreshold) ? 0.0f : 1.0f;
+	}
+
+	// Kept examples are scaled by 1 / p, so the expected gradient is unchanged and no scaled
+	// gradient exceeds the threshold. The draw depends on the row, its score and the update counter
+	// only, so reproducible modes stay reproducible and rows with equal scores draw independently
+	float prob = error / m_backpropThreshold;
+	if (prob >= 1.0f) {
+		return 1.0f;
+	}
+
+	unsigned int noise = hash_uint(m_roundStep * 0x9e3779b1U ^ hash_uint(float_to_bits(ptrData->score) 
+			^ hash_uint(static_cast<unsigned int>(ptrData->row))));
+	return (noise / 4294967296.0f < prob) ? 1.0f / prob : 0.0f;
+}
+
+// Closed-form minimizer of one parameter, given the sums of h^2 and error * h over the samples,
+// where h is the derivative of the prediction by the parameter
+static inline float als_solve(int norm, float regFactor, float value, double sumH2, double sumEH)
+{
+	double rho = value * sumH2 - sumEH;
+	if (norm == 1) {
+		if (sumH2 <= 0.0) {
+			return 0.0f;
+		}
+		double shrink = 0.5 * regFactor;
+		double num = (rho > shrink) ? rho - shrink : ((rho < -shrink) ? rho + shrink : 0.0);
+		return static_cast<float>(num / sumH2);
+	}
+
+	if (sumH2 + regFactor <= 0.0) {
+		return value;
+	}
+	return static_cast<float>(rho / (sumH2 + regFactor));
+}
+
+int FM::build_als_columns()
+{
+	// Column copy of the non-zeros, so a feature's samples are found without scanning rows
+	m_alsColStart = new int[m_featNum + 1];
+	memset(m_alsColStart, 0, sizeof(int) * (m_featNum + 1));
+	for (int i = 0; i < m_dataNum; ++i) {
+		const float* x = m_data[i].x;
+		for (int k = 0; k < m_featNum; ++k) {
+			if (x[k] != 0.0f) {
+				++m_alsColStart[k + 1];
+			}
+		}
+	}
+	for (int k = 0; k < m_featNum; ++k) {
+		m_alsColStart[k + 1] += m_alsColStart[k];
+	}
+
+	int* fill = new int[m_featNum];
+	memcpy(fill, m_alsColStart, sizeof(int) * m_featNum);
+	m_alsRows = new int[m_alsColStart[m_featNum]];
+	m_alsValues = new float[m_alsColStart[m_featNum]];
+	for (int i = 0; i < m_dataNum; ++i) {
+		const float* x = m_data[i].x;
+		for (int k = 0; k < m_featNum; ++k) {
+			if (x[k] != 0.0f) {
+				m_alsRows[fill[k]] = i;
+				m_alsValues[fill[k]++] = x[k];
+			}
+		}
+	}
+	delete[] fill;
+
+	m_alsError = new double[m_dataNum];
+	m_alsSum = new double[static_cast<size_t>(m_dataNum) * m_factSize];
+
+	return 0;
+}
+
+int FM::run_als_pass()
+{
+	if (m_alsColStart == NULL) {
+		build_als_columns();
+	}
+
+	// Refresh the caches from the model, so rounding errors never pile up over passes
+	int degree = MIN(m_degree, 2);
+	for (int i = 0; i < m_dataNum; ++i) {
+		const float* x = m_data[i].x;
+		double* sum = m_alsSum + static_cast<size_t>(i) * m_factSize;
+		double score = m_w0;
+		for (int k = 0; k < m_featNum; ++k) {
+			score += m_w[k] * x[k];
+		}
+
+		for (int j = 0; j < m_factSize && degree == 2; ++j) {
+			double sumVX = 0.0;
+			double squareSum = 0.0;
+			for (int c = 0; c < m_fmFeatNum; ++c) {
+				double vx = get_factor(1, j * m_fmFeatStride + c) * x[m_fmFeatList[c]];
+				sumVX += vx;
+				squareSum += vx * vx;
+			}
+			sum[j] = sumVX;
+			score += 0.5 * (sumVX * sumVX - squareSum);
+		}
+
+		m_alsError[i] = score - m_data[i].y;
+	}
+
+	LossPartial* partial = m_lossPartials;
+	double regDelta = 0.0;
+
+	// Bias, h = 1, every sum is weighted by the sample weights of all entries of a row
+	double sumW = 0.0;
+	double sumE = 0.0;
+	for (int i = 0; i < m_dataNum; ++i) {
+		sumW += m_data[i].weight * m_data[i].repeat;
+		sumE += m_data[i].weight * m_data[i].repeat * m_alsError[i];
+	}
+	float w0 = als_solve(m_norm, m_regFactor, m_w0, sumW, sumE);
+	for (int i = 0; i < m_dataNum; ++i) {
+		m_alsError[i] += w0 - m_w0;
+	}
+	regDelta += reg_norm(m_norm, w0) - reg_norm(m_norm, m_w0);
+	m_w0 = w0;
+
+	// Weights, h = x
+	for (int k = 0; k < m_featNum; ++k) {
+		if (is_feat_filtered(k) || m_alsColStart[k] == m_alsColStart[k + 1]) {
+			continue;
+		}
+
+		double sumH2 = 0.0;
+		double sumEH = 0.0;
+		for (int n = m_alsColStart[k]; n < m_alsColStart[k + 1]; ++n) {
+			double h = m_alsValues[n];
+			double weight = m_data[m_alsRows[n]].weight * m_data[m_alsRows[n]].repeat;
+			sumH2 += weight * h * h;
+			sumEH += weight * m_alsError[m_alsRows[n]] * h;
+		}
+
+		float w = als_solve(m_norm, m_regFactor, m_w[k], sumH2, sumEH);
+		double delta = w - m_w[k];
+		for (int n = m_alsColStart[k]; n < m_alsColStart[k + 1]; ++n) {
+			m_alsError[m_alsRows[n]] += delta * m_alsValues[n];
+		}
+		regDelta += reg_norm(m_norm, w) - reg_norm(m_norm, m_w[k]);
+		m_w[k] = w;
+	}
+
+	// Factors, factor by factor as in libFM, h = x * (sum - v * x)
+	++m_roundStep;
+	for (int j = 0; j < m_factSize && degree == 2; ++j) {
+		for (int c = 0; c < m_fmFeatNum; ++c) {
+			int k = m_fmFeatList[c];
+			int index = j * m_fmFeatStride + c;
+			if (is_feat_filtered(k) || m_alsColStart[k] == m_alsColStart[k + 1]) {
+				continue;
+			}
+
+			float v = get_factor(1, index);
+			double sumH2 = 0.0;
+			double sumEH = 0.0;
+			for (int n = m_alsColStart[k]; n < m_alsColStart[k + 1]; ++n) {
+				double x = m_alsValues[n];
+				double h = x * (m_alsSum[static_cast<size_t>(m_alsRows[n]) * m_factSize + j] - v * x);
+				double weight = m_data[m_alsRows[n]].weight * m_data[m_alsRows[n]].repeat;
+				sumH2 += weight * h * h;
+				sumEH += weight * m_alsError[m_alsRows[n]] * h;
+			}
+
+			// 16-bit factors are rounded, the caches follow the stored value
+			set_factor(1, index, als_solve(m_norm, m_regFactor, v, sumH2, sumEH));
+			float newV = get_factor(1, index);
+			double delta = newV - v;
+			for (int n = m_alsColStart[k]; n < m_alsColStart[k + 1]; ++n) {
+				double x = m_alsValues[n];
+				double* sum = m_alsSum + static_cast<size_t>(m_alsRows[n]) * m_factSize + j;
+				double h = x * (*sum - v * x);
+				m_alsError[m_alsRows[n]] += delta * h;
+				*sum += delta * x;
+			}
+			regDelta += reg_norm(m_norm, newV) - reg_norm(m_norm, v);
+		}
+	}
+
+	// Loss of the pass, with the unclamped predictions ALS minimizes
+	for (int i = 0; i < m_dataNum; ++i) {
+		partial->loss += m_data[i].weight * m_data[i].repeat * m_alsError[i] * m_alsError[i];
+	}
+	partial->regLoss += regDelta;
+
+	return 0;
+}
+
+int FM::run_threads(ThreadFunc func, void* arg)
+{
+	int threadNum = MAX(m_threadNum, 1);
+	ThreadTask* tasks = new ThreadTask[threadNum];
+	pthread_t* threads = new pthread_t[threadNum];
+
+	for (int t = 0; t < threadNum; ++t) {
+		tasks[t].fm = this;
+		tasks[t].func = func;
+		tasks[t].threadId = t;
+		tasks[t].arg = arg;
+	}
+
+	// Thread 0 runs on the calling thread, with NUMA placement every thread is pinned to its node.
+	// The calling thread gets its own mask back afterwards
+	cpu_set_t cpuSet;
+	cpu_set_t callerSet;
+	int restoreFlag = 0;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (m_numaNodeNum > 0) {
+		restoreFlag = (pthread_getaffinity_np(pthread_self(), sizeof(callerSet), &callerSet) == 0) ? 1 : 0;
+		int node = get_thread_node(0);
+		build_cpu_set(m_numaCpus[node], m_numaCpuNum[node], &cpuSet);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+	}
+
+	int createdNum = 1;
+	for (int t = 1; t < threadNum; ++t) {
+		if (m_numaNodeNum > 0) {
+			int node = get_thread_node(t);
+			build_cpu_set(m_numaCpus[node], m_numaCpuNum[node], &cpuSet);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpuSet), &cpuSet);
+		}
+		if (pthread_create(threads + t, &attr, thread_entry, tasks + t) != 0) {
+			printf("[ERROR] Creating thread %d failed!\n", t);
+			break;
+		}
+		++createdNum;
+	}
+	pthread_attr_destroy(&attr);
+
+	// Threads that failed to start run here, so the work is always complete
+	for (int t = createdNum; t < threadNum; ++t) {
+		thread_entry(tasks + t);
+	}
+	thread_entry(tasks);
+
+	for (int t = 1; t < createdNum; ++t) {
+		pthread_join(threads[t], NULL);
+	}
+
+	if (restoreFlag != 0) {
+		pthread_setaffinity_np(pthread_self(), sizeof(callerSet), &callerSet);
+	}
+
+	delete[] tasks;
+	delete[] threads;
+
+	return 0;
+}
+
+int FM::save_model(const char* modelName)
+{
+	FILE* fp = fopen(modelName, "w");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Saving model failed!\n", modelName);
+		return -1;
+	}
+
+	// Print model size and w0
+	fprintf(fp, "%d\n%d\n%d\n%f\n", m_degree, m_factSize, m_featNum, m_w0);
+
+	// Print weights
+	for (int i = 0; i < m_featNum; ++i) {
+		fprintf(fp, "%f\n", m_w[i]);
+	}
+
+	// Print factors for all features, features without factors get zeros
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = 0; j < m_factSize; ++j) {
+			for (int k = 0; k < m_featNum; ++k) {
+				int c = m_fmFeatIndex[k];
+				fprintf(fp, "%f\n", c < 0 ? 0.0f : get_factor(i, j * m_fmFeatStride + c));
+			}
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+int FM::export_quantized_model(const char* modelName)
+{
+	QuantizedFM qfm;
+	if (qfm.quantize(this) != 0 || qfm.save_model(modelName) != 0) {
+		printf("[ERROR] Exporting quantized model %s failed!\n", modelName);
+		return -1;
+	}
+
+	// Report the score error against the float model on the training data
+	double sumError = 0.0;
+	float maxError = 0.0f;
+	for (int i = 0; i < m_dataNum; ++i) {
+		float score = predict(m_data + i);
+		float error = fabs(qfm.predict(m_data + i, m_minLabel, m_maxLabel) - score);
+		sumError += error;
+		maxError = MAX(maxError, error);
+	}
+
+	size_t floatSize = sizeof(float) * (static_cast<size_t>(m_featNum) * (1 + m_factSize * (m_degree - 1)) + 1);
+	printf("[NOTICE] Quantized model is saved in %s, %lu bytes (%.1fx smaller than fp32)\n", 
+			modelName, qfm.get_model_size(), static_cast<double>(floatSize) / qfm.get_model_size());
+	printf("[NOTICE] Quantized score error on %d samples: max %g, mean %g\n", 
+			m_dataNum, maxError, m_dataNum > 0 ? sumError / m_dataNum : 0.0);
+
+	return 0;
+}
+
+float FM::proximal_operator_L1(float weight)
+{
+	float t = m_regFactor * m_learnRate;
+	if (weight >= t) {
+		return weight - t;
+	}
+	else if (weight <= -t) {
+		return weight + t;
+	}
+	else {
+		return 0;
+	}
+}
+
+int FM::calculate_gradients(const Data* ptrData)
+{
+	return accumulate_gradients(ptrData, &m_gradW0, m_gradW, m_gradV);
+}
+
+int FM::accumulate_gradients(const Data* ptrData, float* gradW0, float* gradW, float** gradV)
+{
+	float scale = backprop_scale(ptrData);
+	if (scale == 0.0f) {
+		return 0;
+	}
+
+	float score = ptrData->score;
+	int y = ptrData->y;
+	float error = ptrData->weight * scale * (score - y);
+
+	*gradW0 += 2 * error;
+	
+	// Calculate the gradients of weights, zero features add nothing
+	for (int i = 0; i < m_featNum; ++i) {
+		if (ptrData->x[i] != 0.0f) {
+			gradW[i] += ptrData->x[i] * 2 * error;
+		}
+	}
+		
+	// Calculate the gradients of factors
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = 0; j < m_factSize; ++j) {
+			// Pre-calculate the sums of this factor, like the feature-parallel mode
+			int offset = j * m_fmFeatStride;
+			float squareSum = 0.0f;
+			float cubeSum = 0.0f;
+			float sum = sum_factor_row(i, offset, ptrData->x, 0, m_fmFeatNum, &squareSum, &cubeSum);
+			add_factor_row_grads(i, offset, ptrData->x, 0, m_fmFeatNum, sum, squareSum, error, gradV[i]);
+		}
+	}
+	
+	return 0;
+}
+
+int FM::test(const char* fileName, const char* modelName)
+{
+	// Quantized models are scored by QuantizedFM
+	QuantizedFM* qfm = NULL;
+	if (QuantizedFM::is_quantized_model(modelName)) {
+		qfm = new QuantizedFM();
+		if (qfm->load_model(modelName) != 0) {
+			printf("[ERROR] Load model %s failed!\n", modelName);
+			delete qfm;
+			return -1;
+		}
+		m_featNum = qfm->m_featNum;
+	} else if (load_model(modelName) != 0) {
+		printf("[ERROR] Load model %s failed!\n", modelName);
+		return -1;
+	}
+
+	int featNum = m_featNum;
+
+	if (read_data(fileName) != 0) {
+		printf("[ERROR] Read test data %s failed!\n", fileName);
+		delete qfm;
+		return -1;
+	}
+
+	// Check feature size in the data with the model
+	if (m_featNum > featNum) {
+		printf("[ERROR] Invalid feature index in test_file!\n");
+		delete qfm;
+		return -1;
+	}
+
+	// Rows are sized by the largest index in the data, models read up to their own feature count
+	if (m_featNum < featNum && widen_data(featNum) != 0) {
+		delete qfm;
+		return -1;
+	}
+
+	const int MAX_FILE_NAME_LEN = 1024;
+	char resFileName[MAX_FILE_NAME_LEN];
+	snprintf(resFileName, MAX_FILE_NAME_LEN, "%s.res", fileName);
+
+	FILE* fp = fopen(resFileName, "w");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s!\n", resFileName);
+		delete qfm;
+		return -1;
+	}
+
+	// Score on all threads, then write in file order
+	int taskNum = build_nnz_tasks(m_data, NULL, m_dataNum, MAX(m_threadNum, 1) * S_TASKS_PER_THREAD);
+	run_tasks(&FM::score_task, qfm, taskNum);
+
+	for (int i = 0; i < m_dataNum; ++i) {
+		float score = m_data[i].score;
+		int label = m_data[i].y;
+
+		fprintf(fp, "%f\t%d\t%d\n", score, m_maxLabel, label);
+	}
+
+	printf("[NOTICE] Predict results are saved in %s\n", resFileName);
+	print_task_report();
+	fclose(fp);
+	delete qfm;
+	
+	return 0;
+}
+
+float FM::predict(Data* ptrData)
+{
+	float score = m_w0;
+
+	for (int i = 0; i < m_featNum; ++i) {
+		score += m_w[i] * ptrData->x[i];
+	}
+
+	for (int i = 1; i < m_degree; ++i) {
+		for (int j = 0; j < m_factSize; ++j) {
+			float squareSum = 0.0f;
+			float cubeSum = 0.0f;
+			float sum = sum_factor_row(i, j * m_fmFeatStride, ptrData->x, 0, m_fmFeatNum, &squareSum, &cubeSum);
+			float sumSquare = sum * sum;
+			float sumCube = sumSquare * sum;
+			
+			if (i == 1) {
+				score += 0.5 * (sumSquare - squareSum);
+			} else if (i == 2) {
+				score += 1.0f / 6 * (sumCube - 3 * squareSum * sum + 2 * cubeSum);
+			}
+		}
+	}
+
+	// Truncate
+	score = MAX(score, m_minLabel);
+	score = MIN(score, m_maxLabel);
+
+	ptrData->score = score;
+	
+	return score;	
+}
+
+/*
+int FM::calculate_factorial(int n)
+{
+	const int MAX_FACTORIAL_N = 10;
+	
+	if (n > MAX_FACTORIAL_N or n < 0) {
+		printf("[WARNING] Invalid degree for factorial!\n");
+		return 1;
+	}
+	
+	int factorial = 1;
+	for (int i = 2; i <= n; ++i) {
+		factorial *= i;
+	}
+
+	return factorial;
+}
+*/
+
+int FM::load_model(const char* modelName)
+{
+	FILE* fp = fopen(modelName, "r");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Loading model failed!\n", modelName);
+		return -1;
+	}
+
+	const int MAX_MODEL_LINE_LEN = 1024;
+	char buf[MAX_MODEL_LINE_LEN];
+	int lineNum = 1;
+
+	while (fgets(buf, MAX_MODEL_LINE_LEN, fp) != NULL) {
+		switch(lineNum) {
+		case 1: {
+			m_degree = static_cast<int>(strtol(buf, NULL, 10));
+			if (m_degree < 1) {
+				printf("[ERROR] Invalid factorization degree!\n");
+				fclose(fp);
+				return -1;
 			}
+			
+			break;
 		}
+		case 2: {
+			m_factSize = static_cast<int>(strtol(buf, NULL, 10));
+			if (m_factSize < 1) {
+				printf("[ERROR] Invalid factor size!\n");
+				fclose(fp);
+				return -1;
+			}
 		
-		if (zeroNum > ZERO_NUM_THRESHOLD && zeroNum > ZERO_RATIO_THRESHOLD * m_dataNum) {
-			m_fmFeatFlag[i] = 1;
+			break;
+		}
+		case 3: {
+			m_featNum = static_cast<int>(strtol(buf, NULL, 10));
+			if (m_featNum < 1) {
+				printf("[ERROR] Invalid feature number!\n");
+				fclose(fp);
+				return -1;
+			}		   
+
+			// Allocate memory for weights and factors of all features
+			m_partialFmFlag = 0;
+			build_fm_feat_index();
+			if (allocate_parameters(0) != 0) {
+				fclose(fp);
+				return -1;
+			}
+			
+			break;
+		}
+		case 4: {
+			m_w0 = strtof(buf, NULL);
+			break;
+		}		   
+		default: {
+			// Read weights and factors
+			if (lineNum <= m_featNum + 4) {
+				m_w[lineNum - 5] = strtof(buf, NULL);
+			} else if (lineNum <= (m_degree - 1) * m_factSize * m_featNum + m_featNum + 4) {
+				int index = lineNum - m_featNum - 5;
+				int i = static_cast<int> (index / (m_factSize * m_featNum)) + 1;
+				int j = index % (m_factSize * m_featNum);
+				set_factor(i, j / m_featNum * m_fmFeatStride + j % m_featNum, strtof(buf, NULL));
+			} else {
+				// Do nothing
+			} 
+		}
 		}
+		
+		++lineNum;
 	}
-	
+
+	fclose(fp);
 	return 0;
 }
 
-int FM::train()
+const int QuantizedFM::S_WEIGHT_BLOCK_SIZE = 64;
+const char QuantizedFM::S_MAGIC[4] = {'F', 'M', 'Q', '8'};
+
+QuantizedFM::QuantizedFM() : m_degree(0), m_factSize(0), m_featNum(0), m_w0(0.0f), m_wScale(NULL), 
+							 m_qW(NULL), m_vScale(NULL), m_qV(NULL)
 {
-	if (initialize() != 0) {
-		printf("[ERROR] Initialize failed!\n");
-		return -1;
+}
+
+QuantizedFM::~QuantizedFM()
+{
+	release();
+}
+
+void QuantizedFM::release()
+{
+	delete[] m_wScale;
+	m_wScale = NULL;
+	delete[] m_qW;
+	m_qW = NULL;
+
+	if (m_vScale != NULL) {
+		for (int i = 0; i < m_degree; ++i) {
+			delete[] m_vScale[i];
+			delete[] m_qV[i];
+		}
+		delete[] m_vScale;
+		delete[] m_qV;
+		m_vScale = NULL;
+		m_qV = NULL;
 	}
-	
-	// Calculate scores for all data
-	for (int i = 0; i < m_dataNum; ++i) {
-		m_data[i].score = predict(m_data + i);
+}
+
+int QuantizedFM::is_quantized_model(const char* modelName)
+{
+	FILE* fp = fopen(modelName, "rb");
+	if (fp == NULL) {
+		return 0;
 	}
-  
-	float loss = calculate_loss();
-	float preLoss = 0.0f;
 
-	printf("------------------------------------------------------------------------\n");
-	printf("Iteration Process... [%d iterations in total]\n", m_iter_num);
-	printf("Total Data Number: %d\t\tFeature Number: %d\n", m_dataNum, m_featNum);
-	printf("------------------------------------------------------------------------\n");
-   
-	// Iteration
-	int iterNum = 0;
-	int smoothNum = 0;
-	
-	while (iterNum < m_iter_num) {
-		printf("Iter[%d] \t\tLoss[%.0f]\t\tW0[%.2f]\n", ++iterNum, loss, m_w0);
-		
-		shuffle_data();
+	char magic[sizeof(S_MAGIC)];
+	int flag = (fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, S_MAGIC, sizeof(magic)) == 0);
+	fclose(fp);
 
-		// Mini-batch SGD
-		int indexBegin = 0;
-		int indexEnd = MIN(indexBegin + m_mini_batch, m_dataNum);
+	return flag;
+}
 
-		while(indexEnd <= m_dataNum) {
-			run_mini_batch_sgd(indexBegin, indexEnd);
-			indexBegin = indexEnd;
-			indexEnd = indexBegin + m_mini_batch;
+int QuantizedFM::quantize(const FM* fm)
+{
+	release();
+
+	m_degree = fm->m_degree;
+	m_factSize = fm->m_factSize;
+	m_featNum = fm->m_featNum;
+	m_w0 = fm->m_w0;
+
+	// Symmetric quantization of weights, one scale per block
+	int blockNum = (m_featNum + S_WEIGHT_BLOCK_SIZE - 1) / S_WEIGHT_BLOCK_SIZE;
+	m_wScale = new float[blockNum];
+	m_qW = new signed char[m_featNum];
+
+	for (int b = 0; b < blockNum; ++b) {
+		int begin = b * S_WEIGHT_BLOCK_SIZE;
+		int end = MIN(begin + S_WEIGHT_BLOCK_SIZE, m_featNum);
+
+		float maxAbs = 0.0f;
+		for (int k = begin; k < end; ++k) {
+			maxAbs = MAX(maxAbs, fabs(fm->m_w[k]));
 		}
 
-		preLoss = loss;
-		loss = calculate_loss();
+		m_wScale[b] = maxAbs / 127.0f;
+		for (int k = begin; k < end; ++k) {
+			m_qW[k] = (maxAbs > 0.0f) ? static_cast<signed char>(lrintf(fm->m_w[k] / m_wScale[b])) : 0;
+		}
+	}
 
-		// Calculate sum weights for smoothing
-		if ( iterNum > 10) {
-			for (int i = 0; i < m_featNum; ++i) {
-				m_sumW[i] += m_w[i];
+	// Factors are transposed to feature-major so one feature's vector is contiguous
+	m_vScale = new float* [m_degree];
+	m_qV = new signed char* [m_degree];
+	m_vScale[0] = NULL;
+	m_qV[0] = NULL;
+
+	for (int i = 1; i < m_degree; ++i) {
+		m_vScale[i] = new float[m_featNum];
+		m_qV[i] = new signed char[static_cast<size_t>(m_featNum) * m_factSize];
+
+		for (int k = 0; k < m_featNum; ++k) {
+			signed char* q = m_qV[i] + static_cast<size_t>(k) * m_factSize;
+			int c = fm->m_fmFeatIndex[k];
+			if (c < 0) {
+				m_vScale[i][k] = 0.0f;
+				memset(q, 0, m_factSize);
+				continue;
 			}
 
-			for (int i = 1; i < m_degree; ++i) {
-				for (int j = 0; j < m_factSize * m_featNum; ++j) {
-					m_sumV[i][j] += m_v[i][j];
-				}
+			float maxAbs = 0.0f;
+			for (int j = 0; j < m_factSize; ++j) {
+				maxAbs = MAX(maxAbs, fabs(fm->get_factor(i, j * fm->m_fmFeatStride + c)));
+			}
+
+			m_vScale[i][k] = maxAbs / 127.0f;
+			for (int j = 0; j < m_factSize; ++j) {
+				float v = fm->get_factor(i, j * fm->m_fmFeatStride + c);
+				q[j] = (maxAbs > 0.0f) ? static_cast<signed char>(lrintf(v / m_vScale[i][k])) : 0;
 			}
 		}
-		++smoothNum;
 	}
 
-	// Smooth weights
-	for (int i = 0; i < m_featNum; ++i) {
-		m_w[i] = m_sumW[i] / smoothNum;
+	return 0;
+}
+
+size_t QuantizedFM::get_model_size() const
+{
+	int blockNum = (m_featNum + S_WEIGHT_BLOCK_SIZE - 1) / S_WEIGHT_BLOCK_SIZE;
+	size_t size = sizeof(S_MAGIC) + 3 * sizeof(int) + sizeof(float);
+
+	size += blockNum * sizeof(float) + m_featNum;
+	size += (m_degree - 1) * (m_featNum * sizeof(float) + static_cast<size_t>(m_featNum) * m_factSize);
+
+	return size;
+}
+
+int QuantizedFM::save_model(const char* modelName) const
+{
+	FILE* fp = fopen(modelName, "wb");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Saving model failed!\n", modelName);
+		return -1;
 	}
 
+	// Format: magic, degree, factor size, feature number, w0, weights, then factors per degree
+	int blockNum = (m_featNum + S_WEIGHT_BLOCK_SIZE - 1) / S_WEIGHT_BLOCK_SIZE;
+	fwrite(S_MAGIC, sizeof(S_MAGIC), 1, fp);
+	fwrite(&m_degree, sizeof(int), 1, fp);
+	fwrite(&m_factSize, sizeof(int), 1, fp);
+	fwrite(&m_featNum, sizeof(int), 1, fp);
+	fwrite(&m_w0, sizeof(float), 1, fp);
+	fwrite(m_wScale, sizeof(float), blockNum, fp);
+	fwrite(m_qW, 1, m_featNum, fp);
+
 	for (int i = 1; i < m_degree; ++i) {
-		for (int j = 0; j < m_factSize * m_featNum; ++j) {
-			m_v[i][j] = m_sumV[i][j] / smoothNum;
-		}
+		fwrite(m_vScale[i], sizeof(float), m_featNum, fp);
+		fwrite(m_qV[i], 1, static_cast<size_t>(m_featNum) * m_factSize, fp);
 	}
-	
+
+	if (ferror(fp)) {
+		printf("[ERROR] Writing %s failed!\n", modelName);
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
 	return 0;
 }
 
-float FM::calculate_loss()
+int QuantizedFM::load_model(const char* modelName)
 {
-	float loss = 0.0f;
-	
-	// Calculate loss
-	for (int i = 0; i < m_dataNum; ++i) {
-		float error = m_data[i].score - m_data[i].y;  
-		loss += error * error;
+	release();
+
+	FILE* fp = fopen(modelName, "rb");
+	if (fp == NULL) {
+		printf("[ERROR] Cannot open %s! Loading model failed!\n", modelName);
+		return -1;
 	}
 
-	// Regularization terms
-	float regLoss = 0.0f;
+	char magic[sizeof(S_MAGIC)];
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, S_MAGIC, sizeof(magic)) != 0
+			|| fread(&m_degree, sizeof(int), 1, fp) != 1 || fread(&m_factSize, sizeof(int), 1, fp) != 1
+			|| fread(&m_featNum, sizeof(int), 1, fp) != 1 || fread(&m_w0, sizeof(float), 1, fp) != 1) {
+		printf("[ERROR] Invalid quantized model header!\n");
+		m_degree = 0;
+		fclose(fp);
+		return -1;
+	}
 
-	if (m_norm == 1) {
-		regLoss += fabs(m_w0);
-	} else {
-		regLoss += m_w0 * m_w0;
+	if (m_degree < 1 || m_factSize < 1 || m_featNum < 1) {
+		printf("[ERROR] Invalid quantized model size!\n");
+		m_degree = 0;
+		fclose(fp);
+		return -1;
 	}
-	
-	for (int i = 0; i < m_featNum; ++i) {
-		if (m_norm == 1) {
-			regLoss += fabs(m_w[i]);
-		} else {
-			regLoss += m_w[i] * m_w[i];
+
+	int blockNum = (m_featNum + S_WEIGHT_BLOCK_SIZE - 1) / S_WEIGHT_BLOCK_SIZE;
+	m_wScale = new float[blockNum];
+	m_qW = new signed char[m_featNum];
+	m_vScale = new float* [m_degree];
+	m_qV = new signed char* [m_degree];
+	for (int i = 0; i < m_degree; ++i) {
+		m_vScale[i] = NULL;
+		m_qV[i] = NULL;
+	}
+
+	int okFlag = (fread(m_wScale, sizeof(float), blockNum, fp) == static_cast<size_t>(blockNum)
+			&& fread(m_qW, 1, m_featNum, fp) == static_cast<size_t>(m_featNum));
+
+	for (int i = 1; i < m_degree && okFlag; ++i) {
+		size_t factNum = static_cast<size_t>(m_featNum) * m_factSize;
+		m_vScale[i] = new float[m_featNum];
+		m_qV[i] = new signed char[factNum];
+		okFlag = (fread(m_vScale[i], sizeof(float), m_featNum, fp) == static_cast<size_t>(m_featNum)
+				&& fread(m_qV[i], 1, factNum, fp) == factNum);
+	}
+
+	fclose(fp);
+	if (!okFlag) {
+		printf("[ERROR] Quantized model %s is truncated!\n", modelName);
+		release();
+		return -1;
+	}
+
+	return 0;
+}
+
+float QuantizedFM::predict(const Data* ptrData, int minLabel, int maxLabel) const
+{
+	const float* x = ptrData->x;
+	float score = m_w0;
+
+	for (int k = 0; k < m_featNum; ++k) {
+		if (x[k] != 0.0f) {
+			score += m_wScale[k / S_WEIGHT_BLOCK_SIZE] * m_qW[k] * x[k];
 		}
 	}
-	
-	for (int i = 1; i < m_degree; ++i) {
+
+	int* sum = static_cast<int*>(alloca(sizeof(int) * m_factSize));
+	long long* squareSum = static_cast<long long*>(alloca(sizeof(long long) * m_factSize));
+	double* cubeSum = static_cast<double*>(alloca(sizeof(double) * m_factSize));
+
+	// Only the degree 2 and 3 terms of FM::predict exist
+	for (int i = 1; i < MIN(m_degree, 3); ++i) {
+		// Coefficients scale_k * x_k become integer multipliers sharing one unit,
+		// bounded so that the int32 sums over all non-zero features cannot overflow
+		float maxCoef = 0.0f;
+		int nnz = 0;
+		for (int k = 0; k < m_featNum; ++k) {
+			if (x[k] < 1e-6 && x[k] > -1e-6) {
+				continue;
+			}
+			maxCoef = MAX(maxCoef, fabs(m_vScale[i][k] * x[k]));
+			++nnz;
+		}
+
+		if (maxCoef == 0.0f) {
+			continue;
+		}
+
+		int maxMult = MAX(1, MIN(32767, INT_MAX / (127 * nnz)));
+		float unit = maxCoef / maxMult;
+
 		for (int j = 0; j < m_factSize; ++j) {
-			for (int k = 0; k < m_featNum; ++k) {
-				if (m_partialFmFlag != 0 && m_fmFeatFlag[k] == 0) {
-					continue;
+			sum[j] = 0;
+			squareSum[j] = 0;
+			cubeSum[j] = 0.0;
+		}
+
+		for (int k = 0; k < m_featNum; ++k) {
+			if (x[k] < 1e-6 && x[k] > -1e-6) {
+				continue;
+			}
+
+			int mult = static_cast<int>(lrintf(m_vScale[i][k] * x[k] / unit));
+			const signed char* q = m_qV[i] + static_cast<size_t>(k) * m_factSize;
+
+			// Contiguous int8 x int32 loops, vectorized by the compiler
+			if (i == 1) {
+				for (int j = 0; j < m_factSize; ++j) {
+					int item = mult * q[j];
+					sum[j] += item;
+					squareSum[j] += static_cast<long long>(item) * item;
 				}
-		
-				int index = j * m_featNum + k;
-				if (m_norm == 1) {
-					regLoss += fabs(m_v[i][index]);
-				} else {
-					regLoss += m_v[i][index] * m_v[i][index];
+			} else {
+				for (int j = 0; j < m_factSize; ++j) {
+					int item = mult * q[j];
+					sum[j] += item;
+					squareSum[j] += static_cast<long long>(item) * item;
+					cubeSum[j] += static_cast<double>(item) * item * item;
 				}
 			}
 		}
+
+		for (int j = 0; j < m_factSize; ++j) {
+			double s = static_cast<double>(unit) * sum[j];
+			double q = static_cast<double>(unit) * unit * squareSum[j];
+			if (i == 1) {
+				score += 0.5 * (s * s - q);
+			} else {
+				score += 1.0 / 6 * (s * s * s - 3 * q * s + 2 * static_cast<double>(unit) * unit * unit * cubeSum[j]);
+			}
+		}
 	}
-	
-	loss += regLoss * m_regFactor;
 
-	return loss;
+	// Truncate
+	score = MAX(score, minLabel);
+	score = MIN(score, maxLabel);
+
+	return score;
 }
 
-int FM::shuffle_data()
-{	
-	for(int i = 0; i < m_dataNum; ++i) {
-		// Get a random index
-		int index = rand() % (i + 1);
-
-		// Swap data[i] with data[index]
-		if (index != i) {
-			int y = m_data[i].y;
-			m_data[i].y = m_data[index].y;
-			m_data[index].y = y;
-
-			float* x = m_data[i].x;
-			m_data[i].x = m_data[index].x;
-			m_data[index].x = x;
-
-			float score = m_data[i].score;
-			m_data[i].score = m_data[index].score;
-			m_data[index].score = score;
-			
-			float sumVX = m_data[i].sumVX;
-			m_data[i].sumVX = m_data[index].sumVX;
-			m_data[index].sumVX = sumVX;
-		}
+ParamServer::ParamServer() : m_configFlag(0), m_clocks(NULL), m_finishNum(0), m_listenFd(-1), m_stopFlag(0), 
+							 m_connNum(0)
+{
+	memset(&m_config, 0, sizeof(m_config));
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_cond, NULL);
+}
+
+ParamServer::~ParamServer()
+{
+	if (m_clocks != NULL) {
+		delete[] m_clocks;
+		m_clocks = NULL;
 	}
-	
-	return 0;
+
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_mutex);
 }
 
-int FM::run_mini_batch_sgd(int begin, int end)
+int ParamServer::run(int port)
 {
-	const float MOMENTUM_FACTOR = 0.0f;
+	m_listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	if (m_listenFd < 0) {
+		printf("[ERROR] Cannot create the listening socket!\n");
+		return -1;
+	}
 
-	// Set gradients to 0 at the begining of mini-batch SGD
-	m_gradW0 = 0.0f;
-	for (int i = 0; i < m_featNum; ++i) {
-		m_gradW[i] = 0.0f;
+	int flag = 1;
+	setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(m_listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 
+			|| listen(m_listenFd, SOMAXCONN) != 0) {
+		printf("[ERROR] Cannot listen on port %d!\n", port);
+		close(m_listenFd);
+		m_listenFd = -1;
+		return -1;
 	}
-	for (int i = 1; i < m_degree; ++i) {
-		for (int k = 0; k < m_featNum; ++k) {
-			if (m_partialFmFlag != 0 && m_fmFeatFlag[k] == 0) {
+
+	printf("Parameter server listening on port %d\n", port);
+	fflush(stdout);
+
+	// One thread per trainer connection
+	while (m_stopFlag == 0) {
+		int fd = accept(m_listenFd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
 				continue;
 			}
-			for (int j = 0; j < m_factSize; ++j) {
-				m_gradV[i][j * m_featNum + k] = 0.0f;
-			}
+			break;
 		}
-	}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
 
-	// Calculate scores and gradients for mini-batch data
-	for (int i = begin; i < end; ++i) {
-		m_data[i].score = predict(m_data + i);
-		calculate_gradients(m_data + i);
-	}
+		PsConnection* conn = new PsConnection;
+		conn->server = this;
+		conn->fd = fd;
 
-	float step = m_learnRate;
+		pthread_mutex_lock(&m_mutex);
+		++m_connNum;
+		pthread_mutex_unlock(&m_mutex);
 
-	// Update weights
-	if (m_norm == 1) {
-		m_w0 = proximal_operator_L1(m_w0 - step * m_gradW0);
-	} else {
-		m_gradW0 += 2 * m_regFactor * m_w0;
-		//	m_sumGrad2 += m_gradW0 * m_gradW0;
-		m_momentumW0 = MOMENTUM_FACTOR * m_momentumW0 - step * m_gradW0;
-		m_w0 += m_momentumW0;
-	}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, ps_connection_entry, conn) != 0) {
+			printf("[ERROR] Creating a connection thread failed!\n");
+			close(fd);
+			delete conn;
 
-	for (int i = 0; i < m_featNum; ++i) {
-		if (m_norm == 1) {
-			m_w[i] = proximal_operator_L1(m_w[i] - step * m_gradW[i]);
-		} else {
-			m_gradW[i] += 2 * m_regFactor * m_w[i];
-			//m_sumGrad2 += m_gradW[i] * m_gradW[i];
-			m_momentumW[i] = MOMENTUM_FACTOR * m_momentumW[i] - step * m_gradW[i];
-			m_w[i] += m_momentumW[i];
+			pthread_mutex_lock(&m_mutex);
+			--m_connNum;
+			pthread_mutex_unlock(&m_mutex);
+			continue;
 		}
+		pthread_detach(thread);
 	}
 
-	// Update factors
-	int index = 0;
-	for (int i = 1; i < m_degree; ++i) {
-		for (int k = 0; k < m_featNum; ++k) {
-			if (m_partialFmFlag != 0 && m_fmFeatFlag[k] == 0) {
-				continue;
-			}
+	// Wait for the remaining connections
+	pthread_mutex_lock(&m_mutex);
+	while (m_connNum > 0) {
+		pthread_cond_wait(&m_cond, &m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
 
-			for (int j = 0; j < m_factSize; ++j) {
-				index = j * m_featNum + k;
-				if (m_norm == 1) {
-					m_v[i][index] = proximal_operator_L1(m_v[i][index] - step * m_gradV[i][index]);
-				} else {
-					m_gradV[i][index] += 2 * m_regFactor * m_v[i][index];
-					//				m_sumGrad2 += m_gradV[i][index] * m_gradV[i][index];
-					m_momentumV[i][index] = MOMENTUM_FACTOR * m_momentumV[i][index] - step * m_gradV[i][index];
-					m_v[i][index] += m_momentumV[i][index];
-				}
+	close(m_listenFd);
+	m_listenFd = -1;
+
+	return (m_stopFlag != 0) ? 0 : -1;
+}
+
+void ParamServer::serve_connection(int fd)
+{
+	char* buf = NULL;
+	size_t bufSize = 0;
+	char* reply = NULL;
+	size_t replySize = 0;
+	PsHeader header;
+
+	while (ps_recv_message(fd, &header, &buf, &bufSize) == 0) {
+		const int* ints = reinterpret_cast<const int*>(buf);
+		int ret = -1;
+
+		if (header.type == PS_MSG_SHUTDOWN) {
+			stop();
+			break;
+		} else if (header.type == PS_MSG_CONFIG) {
+			int status = (header.len == sizeof(PsConfig)) ? configure(reinterpret_cast<PsConfig*>(buf)) : -1;
+			ret = ps_send_ack(fd, status);
+		} else if (m_configFlag == 0) {
+			printf("[ERROR] Parameter server is not configured!\n");
+		} else if (header.type == PS_MSG_PULL) {
+			int featNum = header.len / sizeof(int);
+			size_t len = sizeof(float) * (1 + featNum * ps_row_size(m_config.degree, m_config.factSize));
+			float* values = reinterpret_cast<float*>(ps_reserve(&reply, &replySize, len));
+			if (pull(ints, featNum, values) == 0) {
+				ret = ps_send_message(fd, PS_MSG_PULL, values, len);
 			}
+		} else if (header.type == PS_MSG_PUSH && header.len >= static_cast<int>(sizeof(PsPushHeader))) {
+			const PsPushHeader* head = reinterpret_cast<const PsPushHeader*>(buf);
+			const int* ids = reinterpret_cast<const int*>(buf + sizeof(PsPushHeader));
+			const float* grads = reinterpret_cast<const float*>(ids + head->featNum);
+			size_t len = sizeof(PsPushHeader) + sizeof(int) * head->featNum 
+					+ sizeof(float) * head->featNum * ps_row_size(m_config.degree, m_config.factSize);
+			if (head->featNum >= 0 && static_cast<size_t>(header.len) == len 
+					&& push(head->gradW0, ids, head->featNum, grads) == 0) {
+				ret = ps_send_ack(fd, 0);
+			}
+		} else if (header.type == PS_MSG_CLOCK && header.len == 2 * sizeof(int)) {
+			wait_clock(ints[0], ints[1]);
+			ret = ps_send_ack(fd, 0);
+		} else if (header.type == PS_MSG_FINISH && header.len == sizeof(int)) {
+			finish_trainer(ints[0]);
+			ret = 0;
+		} else if (header.type == PS_MSG_WAIT_ALL) {
+			wait_all_trainers();
+			ret = ps_send_ack(fd, 0);
+		} else {
+			printf("[ERROR] Invalid parameter server message %d!\n", header.type);
+		}
+
+		if (ret != 0) {
+			break;
 		}
 	}
-	
-	return 0;
+
+	delete[] buf;
+	delete[] reply;
+	close(fd);
+
+	pthread_mutex_lock(&m_mutex);
+	--m_connNum;
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
 }
 
-int FM::save_model(const char* modelName)
+int ParamServer::configure(const PsConfig* config)
 {
-	FILE* fp = fopen(modelName, "w");
-	if (fp == NULL) {
-		printf("[ERROR] Cannot open %s! Saving model failed!\n", modelName);
-		return -1;
-	}
+	int status = 0;
+	pthread_mutex_lock(&m_mutex);
 
-	// Print model size and w0
-	fprintf(fp, "%d\n%d\n%d\n%f\n", m_degree, m_factSize, m_featNum, m_w0);
+	if (m_configFlag != 0) {
+		// Later trainers must agree with the first one
+		if (config->degree != m_config.degree || config->factSize != m_config.factSize 
+				|| config->featNum != m_config.featNum || config->serverId != m_config.serverId 
+				|| config->serverNum != m_config.serverNum || config->trainerNum != m_config.trainerNum 
+				|| config->staleness != m_config.staleness) {
+			printf("[ERROR] Trainer settings differ from the first trainer!\n");
+			status = -1;
+		}
+	} else if (config->degree < 1 || config->factSize <= 0 || config->featNum < 0 || config->serverNum <= 0 
+			|| config->serverId < 0 || config->serverId >= config->serverNum || config->trainerNum <= 0) {
+		printf("[ERROR] Invalid trainer settings!\n");
+		status = -1;
+	} else {
+		m_config = *config;
 
-	// Print weights
-	for (int i = 0; i < m_featNum; ++i) {
-		fprintf(fp, "%f\n", m_w[i]);
-	}
+		// Owned features are serverId, serverId + serverNum, ...
+		FM* shard = &m_shard;
+		shard->set_fm_degree(config->degree);
+		shard->set_factor_size(config->factSize);
+		shard->set_regular_term(config->norm);
+		shard->set_regular_factor(config->regFactor);
+		shard->set_learn_rate(config->learnRate);
+		shard->set_init_std_dev(config->initStdDev);
+		shard->m_featNum = (config->featNum > config->serverId) 
+				? (config->featNum - config->serverId - 1) / config->serverNum + 1 : 0;
 
-	// Print factors
-	for (int i = 1; i < m_degree; ++i) {
-		for (int j = 0; j < m_factSize * m_featNum; ++j) {
-			fprintf(fp, "%f\n", m_v[i][j]);
+		if (shard->build_fm_feat_index() != 0 || shard->allocate_parameters(1) != 0) {
+			status = -1;
+		} else {
+			shard->init_factors(static_cast<unsigned int>(time(0)) + config->serverId);
+
+			m_clocks = new int[config->trainerNum];
+			for (int t = 0; t < config->trainerNum; ++t) {
+				m_clocks[t] = 0;
+			}
+			m_finishNum = 0;
+			m_configFlag = 1;
+
+			printf("Server %d of %d\t\tFeature Number: %d\t\tTrainers: %d\n", config->serverId, 
+					config->serverNum, shard->m_featNum, config->trainerNum);
+			fflush(stdout);
 		}
 	}
 
-	fclose(fp);
-	return 0;
+	pthread_mutex_unlock(&m_mutex);
+	return status;
 }
 
-float FM::proximal_operator_L1(float weight)
+int ParamServer::is_owned_feat(int feat) const
 {
-	float t = m_regFactor * m_learnRate;
-	if (weight >= t) {
-		return weight - t;
-	}
-	else if (weight <= -t) {
-		return weight + t;
-	}
-	else {
-		return 0;
-	}
+	return (feat >= 0 && feat < m_config.featNum && ps_owner(feat, m_config.serverNum) == m_config.serverId) 
+			? 1 : 0;
 }
 
-int FM::calculate_gradients(const Data* ptrData)
+int ParamServer::pull(const int* featList, int featNum, float* values)
 {
-	float score = ptrData->score;
-	int y = ptrData->y;
-	float error = score - y;
-
-	m_gradW0 += 2 * error;
-	
-	// Calculate the gradients of weights
-	for (int i = 0; i < m_featNum; ++i) {
-		m_gradW[i] += ptrData->x[i] * 2 * error;
+	for (int f = 0; f < featNum; ++f) {
+		if (!is_owned_feat(featList[f])) {
+			printf("[ERROR] Feature %d is not on server %d!\n", featList[f], m_config.serverId);
+			return -1;
+		}
 	}
-		
-	// Calculate the gradients of factors
-	for (int i = 1; i < m_degree; ++i) {
-		for (int j = 0; j < m_factSize; ++j) {
-			// Pre-calculate items
-			float sum = ptrData->sumVX;
-			float sumSquare = 0.0f;
-			float squareSum = 0.0f;
-			
-			if (i == 2) {
-				for (int k = 0; k < m_featNum; ++k) {
-					if (m_partialFmFlag != 0 && m_fmFeatFlag[k] == 0) {
-						continue;
-					}
 
-					float x = ptrData->x[k];
-					if (x < 1e-6 && x > -1e-6) {
-						continue;
-					}
+	const FM* shard = &m_shard;
+	int rowSize = ps_row_size(shard->m_degree, shard->m_factSize);
 
-					float tempScore = m_v[i][j * m_featNum + k] * x;
-					squareSum += tempScore * tempScore;
-				}
-			
-				sumSquare = sum * sum;
-			}
-			
-			for (int k = 0; k < m_featNum; ++k) {
-				if (m_partialFmFlag != 0 && m_fmFeatFlag[k] == 0) {
-					continue;
-				}
-				
-				float x = ptrData->x[k];
-				if (x < 1e-6 && x > -1e-6) {
-					continue;
-				}
-				
-				int index = j * m_featNum + k;
-				
-				// Calculate item gradient, degree = i + 1
-				float gradItem = 0.0f;
-				float item = m_v[i][index] * x;
-		
-				if (i == 1) {
-					gradItem =  x * (sum - item);
-				} else if (i == 2) {
-					gradItem = x * (0.5 * sumSquare - sum * item - 0.5 * squareSum + item * item);
-				}
+	pthread_mutex_lock(&m_mutex);
+
+	values[0] = shard->m_w0;
+	for (int f = 0; f < featNum; ++f) {
+		int local = featList[f] / m_config.serverNum;
+		float* row = values + 1 + f * rowSize;
+		row[0] = shard->m_w[local];
 
-				m_gradV[i][index] += 2 * error * gradItem;
+		for (int i = 1; i < shard->m_degree; ++i) {
+			for (int j = 0; j < shard->m_factSize; ++j) {
+				row[1 + (i - 1) * shard->m_factSize + j] = shard->get_factor(i, j * shard->m_fmFeatStride + local);
 			}
 		}
 	}
-	
+
+	pthread_mutex_unlock(&m_mutex);
 	return 0;
 }
 
-int FM::test(const char* fileName, const char* modelName)
+int ParamServer::push(float gradW0, const int* featList, int featNum, const float* grads)
 {
-	if (load_model(modelName) != 0) {
-		printf("[ERROR] Load model %s failed!\n", modelName);
-		return -1;
-	}
-
-	int featNum = m_featNum;
-
-	if (read_data(fileName) != 0) {
-		printf("[ERROR] Read test data %s failed!\n", fileName);
-		return -1;
+	for (int f = 0; f < featNum; ++f) {
+		if (!is_owned_feat(featList[f])) {
+			printf("[ERROR] Feature %d is not on server %d!\n", featList[f], m_config.serverId);
+			return -1;
+		}
 	}
 
-	// Check feature size in the data with the model
-	if (m_featNum > featNum) {
-		printf("[ERROR] Invalid feature index in test_file!\n");
-		return -1;
-	}
+	// Same updates as FM::run_batch_sgd, but only for the pushed features
+	FM* shard = &m_shard;
+	int rowSize = ps_row_size(shard->m_degree, shard->m_factSize);
+	float step = shard->m_learnRate;
 
-	const int MAX_FILE_NAME_LEN = 1024;
-	char resFileName[MAX_FILE_NAME_LEN];
-	snprintf(resFileName, MAX_FILE_NAME_LEN, "%s.res", fileName);
+	pthread_mutex_lock(&m_mutex);
 
-	FILE* fp = fopen(resFileName, "w");
-	if (fp == NULL) {
-		printf("[ERROR] Cannot open %s!\n", resFileName);
-		return -1;
+	if (m_config.serverId == 0) {
+		shard->update_bias(gradW0, step);
 	}
 
-	for (int i = 0; i < m_dataNum; ++i) {
-		float score = predict(m_data + i);
-		int label = m_data[i].y;
+	++shard->m_roundStep;
+	for (int f = 0; f < featNum; ++f) {
+		int local = featList[f] / m_config.serverNum;
+		const float* row = grads + f * rowSize;
+		shard->update_weight(local, row[0], step);
 
-		fprintf(fp, "%f\t%d\t%d\n", score, m_maxLabel, label);
+		for (int i = 1; i < shard->m_degree; ++i) {
+			for (int j = 0; j < shard->m_factSize; ++j) {
+				shard->update_factor(i, j * shard->m_fmFeatStride + local, row[1 + (i - 1) * shard->m_factSize + j], step);
+			}
+		}
 	}
 
-	printf("[NOTICE] Predict results are saved in %s\n", resFileName);
-	fclose(fp);
-	
+	pthread_mutex_unlock(&m_mutex);
 	return 0;
 }
 
-float FM::predict(Data* ptrData)
+void ParamServer::wait_clock(int trainerId, int clock)
 {
-	float score = m_w0;
-
-	for (int i = 0; i < m_featNum; ++i) {
-		score += m_w[i] * ptrData->x[i];
+	if (trainerId < 0 || trainerId >= m_config.trainerNum) {
+		return;
 	}
 
-	for (int i = 1; i < m_degree; ++i) {
-		for (int j = 0; j < m_factSize; ++j) {
-			float sum = 0.0f;
-			float sumSquare = 0.0f;
-			float squareSum = 0.0f;
-			float sumCube = 0.0f;
-			float cubeSum = 0.0f;
-			
-			for (int k = 0; k < m_featNum; ++k) {
-				if (m_partialFmFlag != 0 && m_fmFeatFlag[k] == 0) {
-					continue;
-				}
-			
-				float x = ptrData->x[k];
-				if (x < 1e-6 && x > -1e-6) {
-					continue;
-				}
-				
-				float tempScore = m_v[i][j * m_featNum + k] * x;
-				sum += tempScore;
-				if (i == 1) {
-					squareSum += tempScore * tempScore;
-				} else if (i == 2) {
-					cubeSum += tempScore * tempScore * tempScore;
-				}
-			}
+	pthread_mutex_lock(&m_mutex);
 
-			ptrData->sumVX = sum;
-			sumSquare = sum * sum;
-			sumCube = sumSquare * sum;
-			
-			if (i == 1) {
-				score += 0.5 * (sumSquare - squareSum);
-			} else if (i == 2) {
-				score += 1.0f / 6 * (sumCube - 3 * squareSum * sum + 2 * cubeSum);
-			}
+	m_clocks[trainerId] = clock;
+	pthread_cond_broadcast(&m_cond);
+
+	// Block while the trainer is more than staleness clocks ahead of the slowest unfinished one
+	while (m_stopFlag == 0 && m_config.staleness >= 0) {
+		int minClock = INT_MAX;
+		for (int t = 0; t < m_config.trainerNum; ++t) {
+			minClock = MIN(minClock, m_clocks[t]);
+		}
+		if (clock - minClock <= m_config.staleness) {
+			break;
 		}
+		pthread_cond_wait(&m_cond, &m_mutex);
 	}
 
-	// Truncate
-	score = MAX(score, m_minLabel);
-	score = MIN(score, m_maxLabel);
-
-	ptrData->score = score;
-	
-	return score;	
+	pthread_mutex_unlock(&m_mutex);
 }
 
-/*
-int FM::calculate_factorial(int n)
+void ParamServer::finish_trainer(int trainerId)
 {
-	const int MAX_FACTORIAL_N = 10;
-	
-	if (n > MAX_FACTORIAL_N or n < 0) {
-		printf("[WARNING] Invalid degree for factorial!\n");
-		return 1;
-	}
-	
-	int factorial = 1;
-	for (int i = 2; i <= n; ++i) {
-		factorial *= i;
+	if (trainerId < 0 || trainerId >= m_config.trainerNum) {
+		return;
 	}
 
-	return factorial;
+	pthread_mutex_lock(&m_mutex);
+	if (m_clocks[trainerId] != INT_MAX) {
+		m_clocks[trainerId] = INT_MAX;
+		++m_finishNum;
+	}
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
 }
-*/
 
-int FM::load_model(const char* modelName)
+void ParamServer::wait_all_trainers()
 {
-	FILE* fp = fopen(modelName, "r");
-	if (fp == NULL) {
-		printf("[ERROR] Cannot open %s! Loading model failed!\n", modelName);
-		return -1;
+	pthread_mutex_lock(&m_mutex);
+	while (m_stopFlag == 0 && m_finishNum < m_config.trainerNum) {
+		pthread_cond_wait(&m_cond, &m_mutex);
 	}
+	pthread_mutex_unlock(&m_mutex);
+}
 
-	const int MAX_MODEL_LINE_LEN = 1024;
-	char buf[MAX_MODEL_LINE_LEN];
-	int lineNum = 1;
-
-	while (fgets(buf, MAX_MODEL_LINE_LEN, fp) != NULL) {
-		switch(lineNum) {
-		case 1: {
-			m_degree = static_cast<int>(strtol(buf, NULL, 10));
-			if (m_degree < 1) {
-				printf("[ERROR] Invalid factorization degree!\n");
-				fclose(fp);
-				return -1;
-			}
-			
-			break;
-		}
-		case 2: {
-			m_factSize = static_cast<int>(strtol(buf, NULL, 10));
-			if (m_factSize < 1) {
-				printf("[ERROR] Invalid factor size!\n");
-				fclose(fp);
-				return -1;
-			}
-		
-			break;
-		}
-		case 3: {
-			m_featNum = static_cast<int>(strtol(buf, NULL, 10));
-			if (m_featNum < 1) {
-				printf("[ERROR] Invalid feature number!\n");
-				fclose(fp);
-				return -1;
-			}		   
+void ParamServer::stop()
+{
+	pthread_mutex_lock(&m_mutex);
+	m_stopFlag = 1;
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
 
-			// Allocate memory for weights and factors
-			m_w = new float[m_featNum];
-			m_v = new float* [m_degree];
-			for (int i = 0; i < m_degree; ++i) {
-				m_v[i] = new float[m_factSize * m_featNum];
-			}
-			
-			break;
-		}
-		case 4: {
-			m_w0 = strtof(buf, NULL);
-			break;
-		}		   
-		default: {
-			// Read weights and factors
-			if (lineNum <= m_featNum + 4) {
-				m_w[lineNum - 5] = strtof(buf, NULL);
-			} else if (lineNum <= (m_degree - 1) * m_factSize * m_featNum + m_featNum + 4) {
-				int index = lineNum - m_featNum - 5;
-				int i = static_cast<int> (index / (m_factSize * m_featNum)) + 1;
-				int j = index % (m_factSize * m_featNum);
-				m_v[i][j] = strtof(buf, NULL);
-			} else {
-				// Do nothing
-			} 
-		}
-		}
-		
-		++lineNum;
+	// Wake up accept
+	if (m_listenFd >= 0) {
+		shutdown(m_listenFd, SHUT_RDWR);
 	}
-
-	fclose(fp);
-	return 0;
 }
 
 } // namespace fm_n_degree
-
@@ -4,16 +4,257 @@
 // @author: Li Changcheng (lichangcheng@baidu.com)
 // @date:   2014-12-21
 
+#include <stddef.h>
+#include <pthread.h>
+
 namespace fm_n_degree {
 
+// Huge page modes for the parameter arena
+enum HugePageMode {
+	HUGE_PAGE_NONE = 0,			// Regular pages
+	HUGE_PAGE_THP = 1,			// Transparent huge pages via madvise
+	HUGE_PAGE_2MB = 2,			// MAP_HUGETLB with 2MB pages
+	HUGE_PAGE_1GB = 3			// MAP_HUGETLB with 1GB pages
+};
+
 // Data struct
 struct Data {
 	int y;						// Label
 	float* x;					// Feature vector
 	float score;				// Predicted score
-	float sumVX;				// sum of vi * xi
+	int nnz;					// Number of non-zero features
+	float weight;				// Importance weight of one entry in loss and gradients, 0 - skipped this epoch
+	int count;					// Identical rows collapsed into this one, the base of weight
+	int repeat;					// Entries of the row in an epoch order, each trains count / repeat rows
+	int row;					// Index of the row in the training data, also in pipeline slots
+};
+
+// Per-feature statistics collected while parsing, zeros are not counted
+struct FeatStat {
+	int nnz;					// Number of samples with a non-zero value
+	int posNnz;					// Number of positive (y > 0) samples with a non-zero value
+	float minValue;				// Min non-zero value
+	float maxValue;				// Max non-zero value
+};
+
+// Parallel training modes, used when the thread number is > 1
+enum ParallelMode {
+	PARALLEL_HOGWILD = 0,		// Lock-free SGD on single samples
+	PARALLEL_SYNC = 1,			// Mini-batch SGD with a deterministic gradient reduction
+	PARALLEL_FEATURE = 2		// Mini-batch SGD, every thread owns a feature range and exchanges partial sums
+};
+
+// Optimizer of FM::train
+enum Solver {
+	SOLVER_SGD = 0,				// Stochastic gradient descent, see ParallelMode
+	SOLVER_ALS = 1				// Coordinate descent with closed-form updates, degree 2 only
+};
+
+// Examples that run the backward pass of SGD, every example is scored
+enum BackpropMode {
+	BACKPROP_ALL = 0,			// Every example
+	BACKPROP_THRESHOLD = 1,		// Examples with an absolute error of at least the threshold
+	BACKPROP_SAMPLED = 2		// Examples drawn with probability |error| / threshold, reweighted
+};
+
+// NUMA placement of data and model
+enum NumaMode {
+	NUMA_NONE = 0,				// No pinning, default placement
+	NUMA_INTERLEAVE = 1,		// Threads pinned per node, local data, one model interleaved over the nodes
+	NUMA_REPLICATE = 2			// Threads pinned per node, local data, Hogwild! on one model replica per node
+};
+
+// State of the xoshiro128** generator, see seed_rand and next_rand
+struct RandState {
+	unsigned int s[4];
+};
+
+// Gradient buffer of one shard for synchronous parallel SGD, only touched features are non-zero
+struct GradBuffer {
+	float gradW0;				// Gradient of w0
+	float* gradW;				// Gradients of w, size = m_featNum
+	float** gradV;				// Gradients of v, same layout as FM::m_gradV
+	int* featList;				// Touched features
+	int featNum;				// Number of touched features
+	char* featFlag;				// Touched flags, size = m_featNum
+	double loss;				// Squared errors of the shard samples
+};
+
+// Per-thread sums of squared errors and regularization norm changes
+struct LossPartial {
+	double loss;
+	double regLoss;
+	char padding[64 - 2 * sizeof(double)];	// One partial per cache line
+};
+
+// Mini-batch gathered into contiguous memory by the training pipeline
+struct BatchSlot {
+	Data* data;					// Batch samples, x points into xBuf
+	float* xBuf;				// Feature vectors, size = m_mini_batch * m_featNum
+	int* rowIndex;				// Source rows in FM::m_data
+	int num;					// Number of samples, 0 marks the end of an epoch
+};
+
+// Rows of one mini-batch, sample n is data[rows[n]]
+struct BatchRows {
+	Data* data;
+	const int* rows;
+};
+
+// Message types of parameter-server training, every message is a PsHeader followed by its payload
+enum PsMessageType {
+	PS_MSG_CONFIG = 1,			// Trainer -> server: PsConfig, reply PS_MSG_ACK
+	PS_MSG_PULL = 2,			// Trainer -> server: feature ids, reply w0 and the parameters of every feature
+	PS_MSG_PUSH = 3,			// Trainer -> server: PsPushHeader, feature ids and gradients, reply PS_MSG_ACK
+	PS_MSG_CLOCK = 4,			// Trainer -> server 0: trainer id and clock, reply once within the staleness bound
+	PS_MSG_FINISH = 5,			// Trainer -> server 0: trainer id, no reply
+	PS_MSG_WAIT_ALL = 6,		// Trainer -> server 0: reply once all trainers have finished
+	PS_MSG_SHUTDOWN = 7,		// Trainer -> server: stop serving, no reply
+	PS_MSG_ACK = 8				// Server -> trainer: status, 0 - OK
+};
+
+// Message header, fields in host byte order
+struct PsHeader {
+	int type;					// See PsMessageType
+	int len;					// Payload size in bytes
+};
+
+// Model and optimizer settings sent by every trainer, the first one configures the server
+struct PsConfig {
+	int degree;					// Degree of FM
+	int factSize;				// Factor size
+	int featNum;				// Feature number of the whole model
+	int norm;					// Regularization term: 1 - L1, 2 - L2
+	float regFactor;			// Regularization factor
+	float learnRate;			// Learning rate
+	float initStdDev;			// Initialization standard deviation
+	int serverId;				// Id of the receiving server
+	int serverNum;				// Number of servers
+	int trainerNum;				// Number of trainers
+	int staleness;				// Max clocks a trainer may run ahead of the slowest one
+};
+
+// Payload head of PS_MSG_PUSH, followed by featNum ids and featNum rows of gradients
+struct PsPushHeader {
+	int featNum;				// Number of features
+	float gradW0;				// Gradient of w0, only used by server 0
+};
+
+// One configuration of a hyperparameter sweep and its result
+struct SweepConfig {
+	int degree;					// Degree of FM
+	int factSize;				// Factor size
+	float learnRate;			// Learning rate
+	float regFactor;			// Regularization factor
+	float loss;					// Final training loss
+	int status;					// Return value of FM::train
+};
+
+// Result of one cross-validation fold
+struct FoldResult {
+	int trainNum;				// Training samples
+	int testNum;				// Held-out samples
+	float auc;					// AUC on the held-out samples
+	float rmse;					// RMSE on the held-out samples
+	int status;					// Return value of FM::train
+};
+
+// Fixed part of a training checkpoint, followed by the slabs of FM::get_checkpoint_slabs
+struct CheckpointHeader {
+	char magic[4];				// FM::S_CHECKPOINT_MAGIC
+	int degree;					// Degree of FM
+	int factSize;				// Factor size
+	int featNum;				// Feature number
+	int fmFeatNum;				// Number of features with factors
+	int precision;				// Storage precision of factors
+	int dataNum;				// Training samples
+	int miniBatch;				// Mini-batch size
+	float learnRate;			// Training options a resumed run must repeat, see FM::load_checkpoint
+	float regFactor;
+	int norm;
+	int solver;
+	int parallelMode;
+	int threadNum;
+	float negSampleRate;
+	int negResampleFlag;
+	int dedupFlag;
+	int backpropMode;
+	float backpropThreshold;
+	int shuffleBlock;
+	unsigned int randSeed;
+	int iterNum;				// Iterations done
+	int smoothNum;				// Iterations added to the smoothing sums
+	int bestFlag;				// 1 - the best model of early stopping follows the model
+	unsigned int roundStep;		// Update counter of stochastic rounding
+	unsigned int shuffleSeed;	// Seed of the epoch orders, an order depends on it and the epoch only
+	unsigned int randState;		// Random state of initialization
+	int lossStallNum;			// Early stopping counters
+	int validStallNum;
+	int bestIter;
+	float loss;					// Training loss after iterNum iterations
+	float w0;
+	float momentumW0;
+	float sumW0;
+	float bestMetric;
+	float bestW0;
+	double regNorm;				// Running regularization norm
+};
+
+// Work-stealing deque of one thread, holds the task range [head, tail).
+// The owner takes tasks from the tail, thieves from the head
+struct TaskDeque {
+	int head;					// Next task for thieves
+	int tail;					// One past the next task of the owner
+	pthread_spinlock_t lock;	// Guards head and tail
+	char padding[64 - 2 * sizeof(int) - sizeof(pthread_spinlock_t)];	// One deque per cache line
+};
+
+// Scheduler statistics of one thread
+struct TaskStat {
+	double busyTime;			// Seconds spent in tasks
+	double idleTime;			// Seconds spent looking for tasks or waiting for other threads
+	double exitTime;			// Time the thread ran out of tasks in the last run
+	long long taskNum;			// Tasks run
+	long long stealNum;			// Tasks stolen from other threads
+};
+
+// Storage precision of factors and their optimizer state
+enum Precision {
+	PRECISION_FP32 = 0,			// 32-bit floats
+	PRECISION_BF16 = 1,			// bfloat16, fp32 range with 8-bit mantissa
+	PRECISION_FP16 = 2			// IEEE half, 11-bit mantissa with limited range
+};
+
+// Memory arena, one aligned mapping carved into model and training buffers
+class Arena {
+public:
+	Arena();
+	~Arena();
+
+	int create(size_t size, int hugePageMode);
+	int bind_numa(int interleaveFlag, const int* nodeIds, int nodeNum);
+	void* alloc(size_t size);
+	void release();
+
+	static size_t align_size(size_t size);
+
+	static const size_t S_ALIGNMENT;			// Alignment of every slab
+
+private:
+	char* m_base;				// Base address of the mapping
+	size_t m_size;				// Usable size
+	size_t m_mapSize;			// Mapped size, rounded up to the page size
+	size_t m_used;				// Carved size
 };
 
+class FM;
+
+// Member function run by every worker thread of FM::run_threads
+typedef void (FM::*ThreadFunc)(int threadId, void* arg);
+
+// Member function run for every task of FM::run_tasks
+typedef void (FM::*TaskFunc)(int threadId, int task, void* arg);
+
 class FM {
 public:
 	FM();
@@ -27,24 +268,161 @@ public:
 	void set_partial_fm_flag(int flag);
 	void set_init_std_dev(float stdDev);
 	void set_regular_term(int regularTerm);
+	void set_huge_page_mode(int mode);
+	void set_precision(int precision);
+	void set_min_feat_count(int minCount);
+	void set_dedup_flag(int flag);
+	void set_rand_seed(unsigned int seed);
+	void set_shuffle_block(int blockSize);
+	void set_init_model(const char* modelName);
 
+	void set_thread_num(int threadNum);
+	void set_parallel_mode(int mode);
+	void set_solver(int solver);
+	void set_neg_sampling(float rate, int resampleFlag);
+	void set_selective_backprop(int mode, float threshold);
+	int set_param_servers(const char* servers);
+	void set_ps_trainer(int trainerId, int trainerNum);
+	void set_ps_staleness(int staleness);
     void set_mini_batch(int mini_batch);
     void set_iterations_num(int iter_num);
 
 	// Member functions for reading data
 	int read_data(const char* fileName);
-	int parse_line(char* buf, Data* ptrData);
+	int parse_line(char* buf, Data* ptrData, int* featList, int* featPos);
+	int share_data(const FM* source, const int* rowFold, int excludeFold);
+	int widen_data(int featNum);
 	
 	// Member functions for training
 	int initialize();
+	void allocate_order();
+	int load_init_model();
+	int copy_init_model();
+	int allocate_parameters(int trainFlag);
 	int train();
 	float calculate_loss();
-	int shuffle_data();
+	void loss_thread(int threadId, void* arg);
+	void set_norm_refresh_iter(int refreshIter);
+	float collect_epoch_loss(int iterNum);
+	double calculate_reg_norm();
+	double partial_reg_norm(int threadId);
+	void reg_norm_thread(int threadId, void* arg);
+	int refresh_scores();
+	int build_epoch_order(int iterNum, int* order, int* bounds);
+	void shuffle_order(int* order, int num, RandState* rng);
 	int run_mini_batch_sgd(int begin, int end);
+	int run_batch_sgd(Data* data, const int* rows, int num);
+	int run_hogwild_sgd();
+	void hogwild_sgd_thread(int threadId, void* arg);
+	int run_sample_sgd(Data* ptrData, LossPartial* partial);
+	int run_sync_sgd();
+	void sync_sgd_thread(int threadId, void* arg);
+	int run_feature_parallel_sgd();
+	void feature_parallel_sgd_thread(int threadId, void* arg);
+	void clear_grad_buffer(GradBuffer* buf);
+	void merge_grad_buffer(GradBuffer* dst, const GradBuffer* src);
+	float update_bias(float grad, float step);
+	float update_weight(int index, float grad, float step);
+	float update_factor(int degree, int index, float grad, float step);
+
+	// Member functions for negative downsampling
+	float neg_sample_weight(const Data* ptrData, int index, int iterNum) const;
+	float backprop_scale(const Data* ptrData) const;
+	int sample_negatives(int iterNum);
+
+	// Member functions for the ALS solver
+	int build_als_columns();
+	int run_als_pass();
+
+	// Member functions for multi-threading
+	int run_threads(ThreadFunc func, void* arg);
+
+	// Member functions for the work-stealing scheduler
+	int build_nnz_tasks(const Data* data, const int* rows, int num, int taskNum);
+	void reset_tasks(int taskNum);
+	void process_tasks(int threadId, TaskFunc func, void* arg);
+	int run_tasks(TaskFunc func, void* arg, int taskNum);
+	void task_thread(int threadId, void* arg);
+	void score_task(int threadId, int task, void* arg);
+	void sync_shard_task(int threadId, int task, void* arg);
+	void print_task_report();
+
+	// Member functions for NUMA placement
+	void set_numa_mode(int mode);
+	int init_numa_topology();
+	int get_thread_node(int threadId) const;
+	int setup_numa();
+	void numa_data_thread(int threadId, void* arg);
+	void numa_replica_init_thread(int threadId, void* arg);
+	int run_numa_replica_sgd();
+	void numa_replica_sgd_thread(int threadId, void* arg);
+	void numa_sync_thread(int threadId, void* arg);
+	void print_numa_report();
+
+	// Member functions for parameter-server training
+	int train_with_servers();
+	int init_ps_trainer();
+	int connect_param_servers();
+	int collect_batch_features(const Data* data, const int* rows, int num, int* pushNum);
+	int run_ps_batch_sgd(Data* data, const int* rows, int num);
+	int wait_ps_clock();
+	int pull_parameters(const int* featList, int featNum);
+	int push_gradients(const int* featList, int featNum);
+	int group_ps_features(const int* featList, int featNum);
+	int reserve_ps_cache(int colNum);
+	int map_ps_features(const int* featList, int featNum);
+	void unmap_ps_features();
+	int finish_param_servers();
+	void close_param_servers(int shutdownFlag);
+	int save_server_model(const char* modelName);
+
+	// Member functions for hyperparameter sweeps
+	int set_sweep(const char* spec, int randomNum);
+	int build_sweep_configs();
+	int run_sweep(const char* modelFile);
+	void copy_options(FM* model) const;
+	void sweep_thread(int threadId, void* arg);
+
+	// Member functions for cross-validation
+	void set_cv_fold_num(int foldNum);
+	int run_cross_validation();
+	void cv_thread(int threadId, void* arg);
+	float calculate_auc(const Data* data, int num) const;
+	float calculate_rmse(const Data* data, int num) const;
+
+	// Member functions for early stopping
+	int set_valid_file(const char* fileName);
+	void set_valid_metric(int metric);
+	void set_early_stop(int patience, float tolerance);
+	int read_valid_data(const char* fileName);
+	float evaluate_valid();
+	void valid_score_task(int threadId, int task, void* arg);
+	int update_early_stop(int iterNum, float loss, float preLoss, float validMetric);
+	void save_best_model();
+	void restore_best_model();
+
+	// Member functions for checkpoints
+	void set_checkpoint(const char* fileName, int interval);
+	void set_resume_flag(int flag);
+	int get_checkpoint_slabs(void** slabs, size_t* sizes);
+	int start_checkpoint_writer();
+	void stop_checkpoint_writer();
+	void checkpoint_thread(int threadId, void* arg);
+	int save_checkpoint(int iterNum, int smoothNum, float loss);
+	int load_checkpoint(CheckpointHeader* header);
+
+	// Member functions for the training pipeline
+	void set_pipeline_depth(int depth);
+	int start_pipeline();
+	void stop_pipeline();
+	void pipeline_thread(int threadId, void* arg);
+	BatchSlot* pop_batch();
+	void finish_batch(BatchSlot* slot);
 
 	// Member functions for calculating gradients
 	float proximal_operator_L1(float weight);
 	int calculate_gradients(const Data* ptrData);
+	int accumulate_gradients(const Data* ptrData, float* gradW0, float* gradW, float** gradV);
 	
 	// Member fucntions for testing
 	int test(const char* fileName, const char* modelName);
@@ -53,21 +431,58 @@ public:
 	
 	// Other member functions	
 	int calculate_fm_feat_flags();
-	float get_normal_rand(float stdDev);
+	int is_feat_filtered(int index) const;
+	int is_fm_feat(int index) const;
+	int save_feat_stats(const char* fileName);
+	int build_fm_feat_index();
+	int init_factors(unsigned int seed);
+	void init_factor_thread(int threadId, void* arg);
+
+	// Member functions for accessing factors in any storage precision
+	float get_factor(int degree, int index) const;
+	void set_factor(int degree, int index, float value);
+	float get_momentum(int degree, int index) const;
+	void set_momentum(int degree, int index, float value);
+	float sum_factor_row(int degree, int offset, const float* x, int colBegin, int colEnd, float* squareSum, 
+			float* cubeSum) const;
+	void add_factor_row_grads(int degree, int offset, const float* x, int colBegin, int colEnd, float sum, 
+			float squareSum, float error, float* grad) const;
+	void add_factor_table(int degree, float* sums) const;
+	unsigned short round_half(float value, int degree, int index, unsigned int salt) const;
 	int save_model(const char* modelName);
+	int export_quantized_model(const char* modelName);
 //	int calculate_factorial(int n);
 
 //private:
 public: // For debugging
 	static const int S_MAX_STOP_ITER_NUM;			// Max iteration number
 	static const int S_MINI_BATCH_SIZE;				// Mini-batch size
+	static const float S_MOMENTUM_FACTOR;			// Momentum factor of SGD
+	static const int S_GRAD_SHARD_SIZE;				// Samples per gradient shard in synchronous mode
+	static const int S_MAX_ENTRY_COUNT;				// Max collapsed rows trained by one entry of an epoch order
+	static const int S_FACTOR_ALIGN;				// Factor rows are padded to a multiple of this many columns
 	
 	// Member variables for data
 	int m_maxLabel;				// Max label
 	int m_minLabel;				// Min label
 	int m_featNum;				// Feature number
 	int m_dataNum;				// Data number
+	int m_rowNum;				// Rows counted by the feature statistics, all trainers' rows with servers
 	Data* m_data;				// Data
+	int* m_order;				// Rows of the epoch in training order, a row has up to repeat entries
+	int m_orderNum;				// Number of entries in m_order
+	int m_orderSize;			// Size of m_order, the sum of repeat over all rows
+	int* m_orderBounds;			// NUMA part t trains m_order[m_orderBounds[t], m_orderBounds[t + 1])
+	int m_posNum;				// Number of positive (y > 0) samples
+	FeatStat* m_featStat;		// Feature statistics, size = m_featNum
+	int m_minFeatCount;			// Features with fewer non-zero samples are not trained
+	int m_dedupFlag;			// 1 - read_data collapses identical rows into one with a count
+	int m_dataOwnerFlag;		// 0 - feature vectors belong to another FM, see share_data
+	unsigned int m_randSeed;	// Seed of initialization and shuffling, 0 - current time
+	unsigned int m_randState;	// Random state of factor initialization
+	int m_logFlag;				// 0 - no iteration log
+	char* m_initModelFile;		// Model to continue training from, NULL - random initialization
+	FM* m_initModel;			// Loaded m_initModelFile, until it is copied by initialize
 	
 	// Member variables for FM
 	int m_degree;				// Degree of FM
@@ -75,20 +490,152 @@ public: // For debugging
 
     int m_mini_batch;           // MINI_BATCH
     int m_iter_num;             // ITERATIONS_NUM
+	int m_threadNum;			// Number of training threads
+	int m_parallelMode;			// Multi-threaded training mode, see ParallelMode
+	GradBuffer* m_gradBuf;		// Shard gradient buffers for synchronous mode
+	int m_gradBufNum;			// Number of shard gradient buffers
+	pthread_barrier_t m_barrier;	// Phase barrier of synchronous and feature-parallel modes
+	float** m_featPartial;		// Per-thread partial sums of the batch samples in feature-parallel mode
+	float* m_featTotal;			// Completed scores and interaction sums of the batch samples
+
+	// Member variables for negative downsampling
+	float m_negSampleRate;		// Fraction of negative samples trained, 1 - no sampling
+	int m_negResampleFlag;		// 1 - draw new negatives every epoch
+
+	// Member variables for selective backprop
+	int m_backpropMode;			// See BackpropMode
+	float m_backpropThreshold;	// Error threshold of the selection
+
+	// Member variables for the ALS solver
+	int m_solver;				// Optimizer, see Solver
+	int* m_alsColStart;			// Non-zeros of feature k are [m_alsColStart[k], m_alsColStart[k + 1])
+	int* m_alsRows;				// Sample of every non-zero, by feature
+	float* m_alsValues;			// Value of every non-zero, by feature
+	double* m_alsError;			// Error of every sample, prediction - label
+	double* m_alsSum;			// Sum of v * x of every sample and factor, sample-major
+
+	// Member variables for the work-stealing scheduler
+	static const int S_TASKS_PER_THREAD;			// Scoring tasks per thread, balanced by non-zero count
+	TaskDeque* m_taskDeques;	// Deque of every thread
+	TaskStat* m_taskStats;		// Statistics of every thread
+	int* m_taskBounds;			// Task i covers samples [m_taskBounds[i], m_taskBounds[i + 1])
+	int m_taskBoundSize;		// Size of m_taskBounds
+
+	// Member variables for NUMA placement
+	int m_numaMode;				// See NumaMode
+	int m_numaNodeNum;			// Number of nodes with CPUs
+	int* m_numaNodeIds;			// Node ids
+	int** m_numaCpus;			// CPUs of every node
+	int* m_numaCpuNum;			// CPU number of every node
+	int m_numaBindNode;			// Node the arena is bound to, -1 - none
+	FM** m_numaReplicas;		// Model replica of every node in NUMA_REPLICATE mode
+	long long* m_numaSampleNum;	// Samples trained by every thread
+	double* m_numaBusyTime;		// Seconds spent training by every thread
+
+	// Member variables for hyperparameter sweeps
+	char* m_sweepSpec;			// Grid, d=2,3;k=4,8;l=0.01;c=0,0.1
+	int m_sweepRandomNum;		// Configurations drawn from the grid, 0 - all
+	SweepConfig* m_sweepConfigs;	// Configurations and results
+	int m_sweepNum;				// Number of configurations
+	int m_sweepNext;			// Next configuration to train
+	const char* m_sweepModelFile;	// Model i is saved to m_sweepModelFile.i
+
+	// Member variables for cross-validation
+	int m_cvFoldNum;			// Number of folds, 0 - no cross-validation
+	int* m_cvRowFold;			// Fold of every sample
+	FoldResult* m_cvResults;	// Result of every fold
+	int m_cvNext;				// Next fold to train
+
+	// Member variables for early stopping
+	char* m_validFile;			// Validation file, NULL - none
+	Data* m_validData;			// Validation samples, with m_featNum features each
+	int m_validNum;				// Number of validation samples
+	int m_validMetric;			// Validation metric: 0 - AUC, 1 - RMSE
+	int m_patience;				// Stop after this many epochs without improvement, 0 - never
+	float m_tolerance;			// Smallest change that counts as improvement
+	int m_lossStallNum;			// Epochs in a row the training loss fell by less than m_tolerance
+	int m_validStallNum;		// Epochs in a row the validation metric did not beat the best
+	float m_bestMetric;			// Best validation metric so far
+	int m_bestIter;				// Epoch of the best validation metric, 0 - before training
+	float m_bestW0;				// Bias of the best epoch
+	float* m_bestW;				// Weights of the best epoch
+	float* m_bestV;				// Factors of the best epoch, degree by degree
+
+	// Member variables for the training pipeline
+	int m_pipelineDepth;		// Number of prefetched batch slots, 0 - no pipeline
+	BatchSlot* m_slots;			// Ring of batch slots
+	long long m_slotHead;		// Number of batches consumed
+	long long m_slotTail;		// Number of batches produced
+	int m_pipelineStop;			// Set to stop the producer
+	BatchSlot* m_curSlot;		// Batch shared by the synchronous workers
+	int* m_slotRows;			// Rows 0 .. m_mini_batch - 1 of a slot, for the batch functions
+	unsigned int m_shuffleSeed;	// Seed of the epoch orders and negative samples
+	int m_shuffleBlock;			// Rows of a shuffle block, blocks and then rows in blocks are shuffled, 0 - rows
+	pthread_mutex_t m_slotMutex;
+	pthread_cond_t m_slotCond;
+	pthread_t m_producer;
+	int m_startIter;			// First iteration to train, earlier ones were restored from a checkpoint
+
+	// Member variables for checkpoints
+	static const char S_CHECKPOINT_MAGIC[4];
+	char* m_ckptFile;			// Checkpoint file, NULL - no checkpoints
+	int m_ckptInterval;			// Iterations between checkpoints
+	int m_resumeFlag;			// 1 - continue from m_ckptFile
+	char* m_ckptBufs[2];		// Snapshots, one is filled while the other may be written
+	size_t m_ckptSize;			// Size of a snapshot
+	int m_ckptWriting;			// Snapshot being written, -1 - none
+	int m_ckptPending;			// Snapshot waiting for the writer, -1 - none
+	int m_ckptStop;				// Set to stop the writer once nothing is pending
+	pthread_mutex_t m_ckptMutex;
+	pthread_cond_t m_ckptCond;
+	pthread_t m_ckptWriter;
+
+	// Member variables for parameter-server training
+	static const int S_MAX_PS_SERVER_NUM;			// Max number of parameter servers
+	static const int S_MAX_PS_PULL_NUM;				// Max features per pull or push message
+	int m_psServerNum;			// Number of parameter servers, 0 - local training
+	char** m_psHosts;			// Server host names
+	int* m_psPorts;				// Server ports
+	int* m_psFds;				// Connections, one per server
+	int m_psTrainerId;			// Id of this trainer, it trains the samples i with i % m_psTrainerNum == id
+	int m_psTrainerNum;			// Number of trainers
+	int m_psStaleness;			// Max clocks a trainer may run ahead of the slowest one
+	int m_psClock;				// Mini-batches finished by this trainer
+	int* m_psFeatList;			// Features of the current batch
+	char* m_psFeatFlag;			// Flags of m_psFeatList, size = m_featNum
+	int* m_psGroupList;			// Features of one message grouped by server
+	int* m_psGroupOffset;		// Group begin of every server, size = m_psServerNum + 1
+	char* m_psBuf;				// Message buffer
+	size_t m_psBufSize;			// Size of m_psBuf
+	float* m_psCache;			// Factors and factor gradients of the mapped batch features
+	int m_psCacheSize;			// Columns m_psCache holds
 
 	// Member variables for model
 	float m_w0;					// Bias w0
 	float* m_w;					// Weights, size = m_featNum
-	float** m_v;				// Factors, size = (m_degree - 1) * (m_featNum * m_factSize)
+	float** m_v;				// Factors, size = (m_degree - 1) * (m_fmFeatStride * m_factSize)
 	float m_sumW0;				// Sum of w0 for smoothing
 	float* m_sumW;				// Sum of w
 	float** m_sumV;				// Sum of v
 
+	// Member variables for 16-bit factor storage, used instead of m_v and m_momentumV
+	int m_precision;			// Storage precision, see Precision
+	unsigned short** m_halfV;
+	unsigned short** m_halfMomentumV;
+	unsigned int m_roundStep;	// Update counter seeding stochastic rounding
+
 	// Member variables for parameters
 	float m_regFactor;			// Regularization factor
 	float m_learnRate;			// Learning rate
 	float m_initStdDev;			// Initialization standard deviation
 	int m_norm;					// Regularization term: 1 - L1, 2 - L2
+	int m_hugePageMode;			// Page backing of the arena, see HugePageMode
+	Arena m_arena;				// Storage of model, gradients and optimizer state
+
+	// Member variables for the training loss
+	LossPartial* m_lossPartials;	// Errors and norm changes of the epoch, one per thread
+	double m_regNorm;			// L1 or L2 norm of the model, kept up to date by the updates
+	int m_normRefreshIter;		// Recompute m_regNorm exactly every this many epochs, 0 - never
 
 	// Member variables for gradients
 	float m_gradW0;				// Gradient of w0
@@ -107,6 +654,71 @@ public: // For debugging
 	// Member variables for partial FM
 	int m_partialFmFlag;		// For partial FM
 	int* m_fmFeatFlag;			// Sparse flags for all features
+	int m_fmFeatNum;			// Number of features with factors
+	int m_fmFeatStride;			// Distance between factor rows, m_fmFeatNum padded to S_FACTOR_ALIGN
+	int* m_fmFeatIndex;			// Feature -> factor column, -1 if the feature has no factors
+	int* m_fmFeatList;			// Factor column -> feature, size = m_fmFeatNum
+};
+
+// Int8 quantized FM for serving, scoring only
+// Weights share one scale per S_WEIGHT_BLOCK_SIZE features, factor vectors have one scale per feature
+class QuantizedFM {
+public:
+	QuantizedFM();
+	~QuantizedFM();
+
+	int quantize(const FM* fm);
+	int save_model(const char* modelName) const;
+	int load_model(const char* modelName);
+	float predict(const Data* ptrData, int minLabel, int maxLabel) const;
+	size_t get_model_size() const;
+
+	static int is_quantized_model(const char* modelName);
+
+	static const int S_WEIGHT_BLOCK_SIZE;		// Features sharing one weight scale
+	static const char S_MAGIC[4];				// File signature
+	
+	int m_degree;				// Degree of FM
+	int m_factSize;				// Factor size
+	int m_featNum;				// Feature number
+	float m_w0;					// Bias w0
+	float* m_wScale;			// Weight scales, one per block
+	signed char* m_qW;			// Quantized weights, size = m_featNum
+	float** m_vScale;			// Factor scales, one per feature and degree
+	signed char** m_qV;			// Quantized factors, feature-major, size = m_featNum * m_factSize
+
+private:
+	void release();
+};
+
+// Parameter server, holds the features k with k % serverNum == serverId at local index k / serverNum.
+// Server 0 also holds w0 and the clocks of all trainers for bounded staleness
+class ParamServer {
+public:
+	ParamServer();
+	~ParamServer();
+
+	int run(int port);
+	void serve_connection(int fd);
+	int configure(const PsConfig* config);
+	int pull(const int* featList, int featNum, float* values);
+	int push(float gradW0, const int* featList, int featNum, const float* grads);
+	int is_owned_feat(int feat) const;
+	void wait_clock(int trainerId, int clock);
+	void finish_trainer(int trainerId);
+	void wait_all_trainers();
+	void stop();
+
+	FM m_shard;					// Parameters and optimizer state of the owned features
+	PsConfig m_config;			// Settings of the first trainer
+	int m_configFlag;			// 1 - configured
+	int* m_clocks;				// Clock of every trainer, INT_MAX once finished
+	int m_finishNum;			// Number of finished trainers
+	int m_listenFd;				// Listening socket
+	int m_stopFlag;				// Set by PS_MSG_SHUTDOWN
+	int m_connNum;				// Number of open trainer connections
+	pthread_mutex_t m_mutex;	// Guards parameters and clocks
+	pthread_cond_t m_cond;		// Signaled when a clock changes
 };
 
 } // namespace fm_n_degree
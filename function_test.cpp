@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "fm_n_degree.h"
 
 const int MAX_FILE_NAME_LEN = 1024;
@@ -14,7 +15,8 @@ const int MAX_FILE_NAME_LEN = 1024;
 // Function declaration
 void print_help();
 int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFile, char* modelFile);
-void print_data(fm_n_degree::FM* fm);
+void print_data(fm_n_degree::FM* fm, const int* order);
+int check_dedup_loss(int argc, char** argv, const char* trainFile);
 
 int main(int argc, char** argv)
 {
@@ -34,16 +36,18 @@ int main(int argc, char** argv)
 	printf("Label: max[%d]\tmin[%d]\n\n", fm->m_maxLabel, fm->m_minLabel);
 
 	printf("Data:\n");
-	print_data(fm);
+	print_data(fm, NULL);
 
-	fm->shuffle_data();
-	printf("\nAfter Shuffle1:\n");
-	print_data(fm);
+	int* order = new int[fm->m_dataNum];
+	fm->build_epoch_order(0, order, NULL);
+	printf("\nEpoch Order1:\n");
+	print_data(fm, order);
 
-	fm->shuffle_data();
-	printf("\nAfter Shuffle2:\n");
-	print_data(fm);
+	fm->build_epoch_order(1, order, NULL);
+	printf("\nEpoch Order2:\n");
+	print_data(fm, order);
 	printf("\n");
+	delete[] order;
 	
 	fm->initialize();
 	fm->save_model("init_model");
@@ -71,7 +75,7 @@ int main(int argc, char** argv)
 	delete fm;
 	delete fm2;
 
-	return 0;
+	return check_dedup_loss(argc, argv, trainFile);
 }
 
 // Print help information
@@ -91,17 +95,75 @@ void print_help()
 	);
 }
 
-void print_data(fm_n_degree::FM* fm)
+void print_data(fm_n_degree::FM* fm, const int* order)
 {
 	for (int i = 0; i < fm->m_dataNum; ++i) {
-		printf("%d", fm->m_data[i].y);
+		const fm_n_degree::Data* ptrData = fm->m_data + ((order != NULL) ? order[i] : i);
+		printf("%d", ptrData->y);
 		for (int j = 0; j < fm->m_featNum; ++j) {
-			printf("\t%f", fm->m_data[i].x[j]);
+			printf("\t%f", ptrData->x[j]);
 		}
 		printf("\n");
 	}
 }
 
+// Train on every row of trainFile repeated DEDUP_COPY_NUM times, once as read and once collapsed
+// by -dd 1. Both fit the same samples, so their losses must be close and finite. A collapsed batch
+// carries several rows per entry, so the check runs at a learning rate both runs converge with
+int check_dedup_loss(int argc, char** argv, const char* trainFile)
+{
+	const int DEDUP_COPY_NUM = 10;
+	const int DEDUP_ITER_NUM = 20;
+	const float DEDUP_LEARN_RATE = 0.001f;
+	const float DEDUP_LOSS_TOLERANCE = 0.1f;	// Max relative difference of the losses
+	const char* dupFile = "dedup_check.txt";
+
+	FILE* in = fopen(trainFile, "r");
+	FILE* out = fopen(dupFile, "w");
+	if (in == NULL || out == NULL) {
+		printf("[ERROR] Writing %s failed!\n", dupFile);
+		return -1;
+	}
+
+	char buf[4096];
+	for (int n = 0; n < DEDUP_COPY_NUM; ++n) {
+		rewind(in);
+		while (fgets(buf, sizeof(buf), in) != NULL) {
+			fputs(buf, out);
+		}
+	}
+	fclose(in);
+	fclose(out);
+
+	float loss[2];
+	for (int dedupFlag = 0; dedupFlag < 2; ++dedupFlag) {
+		char unusedTrainFile[MAX_FILE_NAME_LEN];
+		char unusedModelFile[MAX_FILE_NAME_LEN];
+		fm_n_degree::FM* fm = new fm_n_degree::FM();
+		parse_command_line(fm, argc, argv, unusedTrainFile, unusedModelFile);
+		fm->set_iterations_num(DEDUP_ITER_NUM);
+		fm->set_learn_rate(DEDUP_LEARN_RATE);
+		fm->set_rand_seed(1);
+		fm->set_dedup_flag(dedupFlag);
+		fm->m_logFlag = 0;
+
+		if (fm->read_data(dupFile) != 0 || fm->train() != 0) {
+			delete fm;
+			return -1;
+		}
+		fm->refresh_scores();
+		loss[dedupFlag] = fm->calculate_loss();
+		delete fm;
+	}
+
+	int passFlag = isfinite(loss[0]) && isfinite(loss[1]) 
+			&& fabs(loss[1] - loss[0]) <= DEDUP_LOSS_TOLERANCE * loss[0];
+	printf("\nDedup Check: Loss[%f] without -dd, Loss[%f] with -dd 1 ... %s\n", loss[0], loss[1], 
+			passFlag ? "OK" : "FAILED");
+
+	return passFlag ? 0 : -1;
+}
+
 // Parse command 
 int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFile, char* modelFile)
 {
@@ -112,6 +174,8 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 	fm->set_learn_rate(0.01f);
 	fm->set_partial_fm_flag(0);
 	fm->set_init_std_dev(0.1f);
+	fm->set_mini_batch(200);
+	fm->set_iterations_num(200);
 	
 	// parse options
 	int i = 0;
@@ -125,7 +189,7 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 		}
 
 		switch (argv[i-1][1]) {
-			case 'd':
+			case 'd': {
 				int degree = atoi(argv[i]);
 				if (degree < 1 || degree > 10) {
 					printf("[ERROR] Invalid -d value, should be in [2, 10]!\n");
@@ -133,8 +197,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}
 				fm->set_fm_degree(degree);
 				break;
+			}
 
-			case 'k':
+			case 'k': {
 				int factorSize = atoi(argv[i]);
 				if (factorSize <= 0) {
 					printf("[ERROR] Invalid -k value (should be > 0)!\n");
@@ -142,8 +207,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}
 				fm->set_factor_size(factorSize);
 				break;
+			}
 
-			case 'c':
+			case 'c': {
 				float regFactor = atof(argv[i]);
 				if (regFactor < 0) {
 					printf("[ERROR] Invalid -c value (should be > 0)!\n");
@@ -151,8 +217,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}
 				fm->set_regular_factor(regFactor);
 				break;
+			}
 
-			case 'l':
+			case 'l': {
 				float learnRate = atof(argv[i]);
 				if (learnRate < 0) {
 					printf("[ERROR] Invalid -l value (should be > 0)\n");
@@ -160,8 +227,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}				
 				fm->set_learn_rate(learnRate);
 				break;
+			}
 			
-			case 'p':
+			case 'p': {
 				int partialFmFlag = atoi(argv[i]);
 				if (partialFmFlag != 0 && partialFmFlag != 1) {
 					printf("[ERROR] Invalid -p value (should be 0 or 1)\n");
@@ -169,8 +237,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}				
 				fm->set_partial_fm_flag(partialFmFlag);
 				break;
+			}
 				
-			case 'v':
+			case 'v': {
 				float initStdDev = atof(argv[i]);
 				if (initStdDev < 0) {
 					printf("[ERROR] Invalid -v value (should be > 0)\n");
@@ -178,6 +247,7 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}				
 				fm->set_init_std_dev(initStdDev);
 				break;
+			}
 				
 			default:
 				printf("[ERROR] Unknown option: -%c\n", argv[i-1][1]);
@@ -0,0 +1,44 @@
+// Copyright (c) 2014 Baidu Corporation
+// @file:   server.cpp
+// @brief:  parameter server for distributed training of n-degree FM
+// @author: Li Changcheng (lichangcheng@baidu.com)
+// @date:   2014-12-23
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fm_n_degree.h"
+
+// Function declaration
+void print_help();
+
+int main(int argc, char** argv)
+{
+	if (argc != 2) {
+		print_help();
+		return -1;
+	}
+
+	int port = atoi(argv[1]);
+	if (port <= 0 || port > 65535) {
+		printf("[ERROR] Invalid port %s!\n", argv[1]);
+		return -1;
+	}
+
+	fm_n_degree::ParamServer* server = new fm_n_degree::ParamServer();
+	int ret = server->run(port);
+	delete server;
+
+	return ret;
+}
+
+// Print help information
+void print_help()
+{
+    printf(
+            "Usage: ./server port\n"
+            "   Serves the features k with k %% server_num == server_id, where the id is the position\n"
+            "   of this server in the -ps list of the trainers. The model settings come from the\n"
+            "   trainers, the server stops when trainer 0 has collected the final model.\n"
+    );
+}
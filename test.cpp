@@ -13,7 +13,7 @@ const int MAX_FILE_NAME_LEN = 1024;
 
 // Function declaration
 void print_help();
-int parse_command_line(int argc, char** argv, char* testFile, char* modelFile);
+int parse_command_line(int argc, char** argv, char* testFile, char* modelFile, fm_n_degree::FM* fm);
 
 int main(int argc, char** argv)
 {
@@ -21,7 +21,8 @@ int main(int argc, char** argv)
 	char modelFile[MAX_FILE_NAME_LEN];
 	fm_n_degree::FM* fm = new fm_n_degree::FM(); 
 
-	if (parse_command_line(argc, argv, testFile, modelFile) != 0) {
+	if (parse_command_line(argc, argv, testFile, modelFile, fm) != 0) {
+		delete fm;
 		print_help();
 		return -1;
 	}
@@ -37,20 +38,48 @@ int main(int argc, char** argv)
 void print_help()
 {
 	printf(
-		"Usage: ./test test_file model_file\n"
+		"Usage: ./test [options] test_file model_file\n"
+		"options:\n"
+		"-t threads: set the number of scoring threads (default 1)\n"
 		"test_file format: label index1:x1 index2:x2 ...\n"
+		"model_file: model saved by train, or the int8 model exported by train -q\n"
 	);
 }
 
 // Parse command 
-int parse_command_line(int argc, char **argv, char *testFile, char *modelFile)
+int parse_command_line(int argc, char **argv, char *testFile, char *modelFile, fm_n_degree::FM* fm)
 {
-	if (argc != 3) {
+	int i = 1;
+	for (; i < argc; ++i) {
+		if (argv[i][0] != '-') {
+			break;
+		}
+		if (++i >= argc || strlen(argv[i - 1]) != 2) {
+			return -1;
+		}
+
+		switch (argv[i - 1][1]) {
+			case 't': {
+				int threadNum = atoi(argv[i]);
+				if (threadNum < 1) {
+					printf("[ERROR] Invalid -t value (should be > 0)\n");
+					return -1;
+				}
+				fm->set_thread_num(threadNum);
+				break;
+			}
+			default:
+				printf("[ERROR] Unknown option %s\n", argv[i - 1]);
+				return -1;
+		}
+	}
+
+	if (argc - i != 2) {
 		return -1;
 	}
 
-	snprintf(testFile, MAX_FILE_NAME_LEN, "%s", argv[1]);
-	snprintf(modelFile, MAX_FILE_NAME_LEN, "%s", argv[2]);
+	snprintf(testFile, MAX_FILE_NAME_LEN, "%s", argv[i]);
+	snprintf(modelFile, MAX_FILE_NAME_LEN, "%s", argv[i + 1]);
 
 	return 0;
 }
@@ -13,15 +13,18 @@ const int MAX_FILE_NAME_LEN = 1024;
 
 // Function declaration
 void print_help();
-int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFile, char* modelFile);
+int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFile, char* modelFile, 
+		char* quantizedModelFile, char* statsFile);
 
 int main(int argc, char** argv)
 {
 	char trainFile[MAX_FILE_NAME_LEN];
 	char modelFile[MAX_FILE_NAME_LEN];
+	char quantizedModelFile[MAX_FILE_NAME_LEN];
+	char statsFile[MAX_FILE_NAME_LEN];
 	fm_n_degree::FM* fm = new fm_n_degree::FM();
 
-	if (parse_command_line(fm, argc, argv, trainFile, modelFile) != 0) {
+	if (parse_command_line(fm, argc, argv, trainFile, modelFile, quantizedModelFile, statsFile) != 0) {
 		print_help();
 		return -1;
 	}
@@ -29,6 +32,19 @@ int main(int argc, char** argv)
 //	printf("%d\t%d\t%f\t%f\t%s\t%s\n", fm->m_degree, fm->m_factSize, fm->m_regFactor, fm->m_learnRate, trainFile, modelFile);
 
 	fm->read_data(trainFile);
+
+	// Cross-validation and sweeps train many models on the rows read above
+	if (fm->m_cvFoldNum > 0) {
+		int ret = fm->run_cross_validation();
+		delete fm;
+		return ret;
+	}
+
+	if (fm->m_sweepSpec != NULL) {
+		int ret = fm->run_sweep(modelFile);
+		delete fm;
+		return ret;
+	}
 	
 /*	for (int i = 0; i < fm->m_dataNum; ++i) {
 		printf("%d", fm->m_data[i].y);
@@ -39,9 +55,43 @@ int main(int argc, char** argv)
 	}
 	getchar(); */
 	
-	fm->train();
+	// A failed run, like a rejected checkpoint, must not replace the model file
+	if (fm->train() != 0) {
+		delete fm;
+		return -1;
+	}
+
+	// With parameter servers trainer 0 streams the final model from the servers into the model file
+	if (fm->m_psServerNum > 0) {
+		int ret = 0;
+		if (fm->m_psTrainerId == 0) {
+			ret = fm->save_server_model(modelFile);
+			if (ret == 0 && quantizedModelFile[0] != '\0') {
+				// The saved model is checked against the local rows
+				fm_n_degree::FM* model = new fm_n_degree::FM();
+				if (model->share_data(fm, NULL, 0) == 0 && model->load_model(modelFile) == 0) {
+					model->export_quantized_model(quantizedModelFile);
+				}
+				delete model;
+			}
+			if (ret == 0 && statsFile[0] != '\0') {
+				fm->save_feat_stats(statsFile);
+			}
+		}
+		delete fm;
+		return ret;
+	}
+
 	fm->save_model(modelFile);
 
+	if (quantizedModelFile[0] != '\0') {
+		fm->export_quantized_model(quantizedModelFile);
+	}
+
+	if (statsFile[0] != '\0') {
+		fm->save_feat_stats(statsFile);
+	}
+
 //	printf("%f\t%f\t%f\n", fm->predict(fm->m_data), fm->predict(fm->m_data + 1), fm->predict(fm->m_data + 2));
 
 	delete fm;
@@ -63,14 +113,75 @@ void print_help()
             "   -v initialization standard deviation (default 0.1)\n"
             "   -b mini_batch (default 200)\n"
             "   -i iterations num (default 200) \n"
-            "   -n regularization term (1 - L1, 2 - L2, default 2)\n\n"
+            "   -n regularization term (1 - L1, 2 - L2, default 2)\n"
+            "   -g huge pages for model memory (0 - none, 1 - transparent, 2 - 2MB, 3 - 1GB, default 0)\n"
+            "   -e factor storage precision (0 - fp32, 1 - bf16, 2 - fp16, default 0)\n"
+            "   -q also export an int8 quantized model for serving to this file\n"
+            "   -f min non-zero count of a feature, rarer features are not trained (default 0)\n"
+            "   -o save feature statistics (index nnz positive_nnz min max fm_flag) to this file\n"
+            "   -w continue training from this model, its degree and factor size are used, new features\n"
+            "      get random factors and smoothing starts at the first iteration\n"
+            "   -s random seed of initialization and shuffling, the same seed and options give the same\n"
+            "      model in the reproducible modes (default 0, the current time)\n"
+            "   -sk shuffle blocks of this many rows, then the rows inside every block, so an iteration\n"
+            "      reads nearby rows together (default 0, shuffle rows)\n"
+            "   -t training threads (default 1)\n"
+            "   -m parallel mode (0 - lock-free Hogwild! SGD on single samples when -t > 1,\n"
+            "      1 - mini-batch SGD with reproducible results for any -t,\n"
+            "      2 - mini-batch SGD where every thread owns a feature range of the model, default 0)\n"
+            "   -u mini-batches prepared ahead by a background thread, 2 - double buffer,\n"
+            "      3 - triple buffer (default 0, no pipeline)\n"
+            "   -a NUMA placement (0 - none, 1 - threads pinned per node, local data and an interleaved model,\n"
+            "      2 - as 1 but Hogwild! threads of a node share a model replica, averaged every iteration,\n"
+            "      default 0)\n"
+            "   -ps train with parameter servers host:port[,host:port...], run ./server port on each\n"
+            "   -pi trainer id of parameter-server training, it trains samples i %% trainer_num == id\n"
+            "      of the training file, trainer 0 saves the model (default 0)\n"
+            "   -pn trainer number of parameter-server training (default 1)\n"
+            "   -pb max mini-batches a trainer may run ahead of the slowest one, -1 - unbounded\n"
+            "      (default -1)\n"
+            "   -cv k-fold cross-validation, k fold models are trained on -t threads sharing the training\n"
+            "      data and the mean and stddev of held-out AUC and RMSE are reported, no model is saved\n"
+            "   -sw sweep a grid of settings on -t threads sharing the training data, like\n"
+            "      d=2,3;k=4,8;l=0.01,0.001;c=0,0.1 (missing keys use their option), model i is saved\n"
+            "      to model_file.i and the final losses to model_file.sweep\n"
+            "   -sn train a random subset of this many grid settings (default 0, all)\n"
+            "   -va validation file, scored after every iteration, the model of the best iteration\n"
+            "      is saved instead of the smoothed one\n"
+            "   -vm validation metric (0 - AUC, 1 - RMSE, default 0)\n"
+            "   -es stop after this many iterations in a row without improvement of the training loss\n"
+            "      or the validation metric (default 0, never)\n"
+            "   -et smallest improvement, relative for the training loss and absolute for the\n"
+            "      validation metric (default 0.0001)\n"
+            "   -nr the training loss sums the errors of the SGD pass and a regularization norm kept up\n"
+            "      to date by the updates, recompute the norm exactly every this many iterations\n"
+            "      (default 0, never)\n"
+            "   -so solver (0 - SGD, 1 - ALS coordinate descent for -d 2 with closed-form updates,\n"
+            "      single-threaded, needs no learning rate and few iterations, default 0)\n"
+            "   -ck save a checkpoint of the training state to this file, written by a background\n"
+            "      thread from a snapshot so training does not wait for the disk\n"
+            "   -ci iterations between checkpoints (default 1)\n"
+            "   -rs 1 - continue from the -ck checkpoint, same data and options give the same model\n"
+            "      as an uninterrupted run (default 0)\n"
+            "   -ds keep this share of the negative samples (label <= 0), kept negatives are weighted\n"
+            "      by 1 / rate in the loss and gradients so the model stays calibrated (default 1)\n"
+            "   -de 1 - draw the kept negatives again every iteration, 0 - once (default 0)\n"
+            "   -dd 1 - collapse identical rows (same label and features) into one row weighted by\n"
+            "      its count, less memory and work per iteration for data with many duplicates. A row\n"
+            "      of more than 4 copies is trained in steps of at most 4 copies each. A mini-batch\n"
+            "      then holds more copies than -b rows, so lower -l if training diverges (default 0)\n"
+            "   -sb SGD backward passes, every sample is scored (0 - all samples, 1 - samples with an\n"
+            "      absolute error of at least -st, 2 - samples drawn with probability |error| / -st and\n"
+            "      weighted by its inverse, unbiased, default 0)\n"
+            "   -st error threshold of -sb (default 0.1)\n\n"
             "training_file format: \n"
             "   label index1:x1 index2:x2 ...\n"
     );
 }
 
 // Parse command 
-int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFile, char* modelFile)
+int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFile, char* modelFile, 
+		char* quantizedModelFile, char* statsFile)
 {
 	// Set default parameters
 	fm->set_fm_degree(2);
@@ -80,11 +191,33 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 	fm->set_partial_fm_flag(0);
 	fm->set_init_std_dev(0.1f);
 	fm->set_regular_term(2);
+	fm->set_huge_page_mode(0);
+	fm->set_precision(0);
+	fm->set_min_feat_count(0);
+	fm->set_thread_num(1);
+	fm->set_parallel_mode(0);
+	fm->set_pipeline_depth(0);
+	fm->set_numa_mode(0);
+	fm->set_ps_staleness(-1);
+	quantizedModelFile[0] = '\0';
+	statsFile[0] = '\0';
     fm->set_mini_batch(200);
     fm->set_iterations_num(200);
 	
 	// parse options
 	int i = 0;
+	int trainerId = 0;
+	int trainerNum = 1;
+	int sweepRandomNum = 0;
+	const char* sweepSpec = NULL;
+	int patience = 0;
+	int ckptInterval = 1;
+	const char* ckptFile = NULL;
+	float tolerance = 0.0001f;
+	float negSampleRate = 1.0f;
+	int negResampleFlag = 0;
+	int backpropMode = 0;
+	float backpropThreshold = 0.1f;
 	for (i = 1; i < argc; ++i) {
 		if (argv[i][0] != '-') {
 			break;
@@ -94,8 +227,143 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 			return -1;
 		}
 
+		// Options with two-letter names
+		if (strcmp(argv[i-1], "-ps") == 0) {
+			if (fm->set_param_servers(argv[i]) != 0) {
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-pi") == 0) {
+			trainerId = atoi(argv[i]);
+			continue;
+		} else if (strcmp(argv[i-1], "-pn") == 0) {
+			trainerNum = atoi(argv[i]);
+			if (trainerNum < 1) {
+				printf("[ERROR] Invalid -pn value (should be > 0)\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-pb") == 0) {
+			fm->set_ps_staleness(atoi(argv[i]));
+			continue;
+		} else if (strcmp(argv[i-1], "-cv") == 0) {
+			int foldNum = atoi(argv[i]);
+			if (foldNum < 2) {
+				printf("[ERROR] Invalid -cv value (should be > 1)\n");
+				return -1;
+			}
+			fm->set_cv_fold_num(foldNum);
+			continue;
+		} else if (strcmp(argv[i-1], "-sw") == 0) {
+			sweepSpec = argv[i];
+			continue;
+		} else if (strcmp(argv[i-1], "-sn") == 0) {
+			sweepRandomNum = atoi(argv[i]);
+			if (sweepRandomNum < 0) {
+				printf("[ERROR] Invalid -sn value (should be >= 0)\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-va") == 0) {
+			fm->set_valid_file(argv[i]);
+			continue;
+		} else if (strcmp(argv[i-1], "-vm") == 0) {
+			int metric = atoi(argv[i]);
+			if (metric < 0 || metric > 1) {
+				printf("[ERROR] Invalid -vm value (should be 0 or 1)\n");
+				return -1;
+			}
+			fm->set_valid_metric(metric);
+			continue;
+		} else if (strcmp(argv[i-1], "-es") == 0) {
+			patience = atoi(argv[i]);
+			if (patience < 0) {
+				printf("[ERROR] Invalid -es value (should be >= 0)\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-et") == 0) {
+			tolerance = atof(argv[i]);
+			if (tolerance < 0) {
+				printf("[ERROR] Invalid -et value (should be >= 0)\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-nr") == 0) {
+			int refreshIter = atoi(argv[i]);
+			if (refreshIter < 0) {
+				printf("[ERROR] Invalid -nr value (should be >= 0)\n");
+				return -1;
+			}
+			fm->set_norm_refresh_iter(refreshIter);
+			continue;
+		} else if (strcmp(argv[i-1], "-so") == 0) {
+			int solver = atoi(argv[i]);
+			if (solver < 0 || solver > 1) {
+				printf("[ERROR] Invalid -so value (should be 0 or 1)\n");
+				return -1;
+			}
+			fm->set_solver(solver);
+			continue;
+		} else if (strcmp(argv[i-1], "-ck") == 0) {
+			ckptFile = argv[i];
+			continue;
+		} else if (strcmp(argv[i-1], "-ci") == 0) {
+			ckptInterval = atoi(argv[i]);
+			if (ckptInterval < 1) {
+				printf("[ERROR] Invalid -ci value (should be > 0)\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-rs") == 0) {
+			fm->set_resume_flag(atoi(argv[i]));
+			continue;
+		} else if (strcmp(argv[i-1], "-ds") == 0) {
+			negSampleRate = atof(argv[i]);
+			if (negSampleRate <= 0.0f || negSampleRate > 1.0f) {
+				printf("[ERROR] Invalid -ds value (should be in (0, 1])\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-de") == 0) {
+			negResampleFlag = atoi(argv[i]);
+			if (negResampleFlag != 0 && negResampleFlag != 1) {
+				printf("[ERROR] Invalid -de value (should be 0 or 1)\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-sb") == 0) {
+			backpropMode = atoi(argv[i]);
+			if (backpropMode < 0 || backpropMode > 2) {
+				printf("[ERROR] Invalid -sb value (should be 0, 1 or 2)\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-st") == 0) {
+			backpropThreshold = atof(argv[i]);
+			if (backpropThreshold <= 0.0f) {
+				printf("[ERROR] Invalid -st value (should be > 0)\n");
+				return -1;
+			}
+			continue;
+		} else if (strcmp(argv[i-1], "-sk") == 0) {
+			int blockSize = atoi(argv[i]);
+			if (blockSize < 0) {
+				printf("[ERROR] Invalid -sk value (should be >= 0)\n");
+				return -1;
+			}
+			fm->set_shuffle_block(blockSize);
+			continue;
+		} else if (strcmp(argv[i-1], "-dd") == 0) {
+			fm->set_dedup_flag(atoi(argv[i]));
+			continue;
+		} else if (argv[i-1][1] != '\0' && argv[i-1][2] != '\0') {
+			printf("[ERROR] Unknown option: %s\n", argv[i-1]);
+			return -1;
+		}
+
 		switch (argv[i-1][1]) {
-			case 'd':
+			case 'd': {
 				int degree = atoi(argv[i]);
 				if (degree < 1 || degree > 10) {
 					printf("[ERROR] Invalid -d value, should be in [2, 10]!\n");
@@ -103,8 +371,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}
 				fm->set_fm_degree(degree);
 				break;
+			}
 
-			case 'k':
+			case 'k': {
 				int factorSize = atoi(argv[i]);
 				if (factorSize <= 0) {
 					printf("[ERROR] Invalid -k value (should be > 0)!\n");
@@ -112,8 +381,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}
 				fm->set_factor_size(factorSize);
 				break;
+			}
 
-			case 'c':
+			case 'c': {
 				float regFactor = atof(argv[i]);
 				if (regFactor < 0) {
 					printf("[ERROR] Invalid -c value (should be > 0)!\n");
@@ -121,8 +391,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}
 				fm->set_regular_factor(regFactor);
 				break;
+			}
 
-			case 'l':
+			case 'l': {
 				float learnRate = atof(argv[i]);
 				if (learnRate < 0) {
 					printf("[ERROR] Invalid -l value (should be > 0)\n");
@@ -130,8 +401,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}				
 				fm->set_learn_rate(learnRate);
 				break;
+			}
 			
-			case 'p':
+			case 'p': {
 				int partialFmFlag = atoi(argv[i]);
 				if (partialFmFlag != 0 && partialFmFlag != 1) {
 					printf("[ERROR] Invalid -p value (should be 0 or 1)\n");
@@ -139,8 +411,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}				
 				fm->set_partial_fm_flag(partialFmFlag);
 				break;
+			}
 				
-			case 'v':
+			case 'v': {
 				float initStdDev = atof(argv[i]);
 				if (initStdDev < 0) {
 					printf("[ERROR] Invalid -v value (should be > 0)\n");
@@ -148,8 +421,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}				
 				fm->set_init_std_dev(initStdDev);
 				break;
+			}
 
-			case 'n':
+			case 'n': {
 				int regularTerm = atoi(argv[i]);
 				if (regularTerm != 1 && regularTerm != 2) {
 					printf("[ERROR] Invalid -n value (should be 1 or 2)\n");
@@ -157,8 +431,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 				}
 				fm->set_regular_term(regularTerm);
 				break;
+			}
 
-            case 'b':
+            case 'b': {
                 int mini_batch = atoi(argv[i]);
                 if (mini_batch < 0) {
                     printf("[ERROR] Invalid -b value (should be > 0)\n");
@@ -166,8 +441,9 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
                 }
                 fm->set_mini_batch(mini_batch);
                 break;
+            }
 
-            case 'i':
+            case 'i': {
                 int iter_num = atoi(argv[i]);
                 if (iter_num < 0) {
                     printf("[ERROR] Invalid -b value (should be > 0)\n");
@@ -175,6 +451,97 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
                 }
                 fm->set_iterations_num(iter_num);
                 break;
+            }
+
+			case 'g': {
+				int hugePageMode = atoi(argv[i]);
+				if (hugePageMode < 0 || hugePageMode > 3) {
+					printf("[ERROR] Invalid -g value (should be in [0, 3])\n");
+					return -1;
+				}
+				fm->set_huge_page_mode(hugePageMode);
+				break;
+			}
+
+			case 'e': {
+				int precision = atoi(argv[i]);
+				if (precision < 0 || precision > 2) {
+					printf("[ERROR] Invalid -e value (should be 0, 1 or 2)\n");
+					return -1;
+				}
+				fm->set_precision(precision);
+				break;
+			}
+
+			case 'q': {
+				snprintf(quantizedModelFile, MAX_FILE_NAME_LEN, "%s", argv[i]);
+				break;
+			}
+
+			case 'f': {
+				int minFeatCount = atoi(argv[i]);
+				if (minFeatCount < 0) {
+					printf("[ERROR] Invalid -f value (should be >= 0)\n");
+					return -1;
+				}
+				fm->set_min_feat_count(minFeatCount);
+				break;
+			}
+
+			case 'o': {
+				snprintf(statsFile, MAX_FILE_NAME_LEN, "%s", argv[i]);
+				break;
+			}
+
+			case 'w': {
+				fm->set_init_model(argv[i]);
+				break;
+			}
+
+			case 's': {
+				fm->set_rand_seed(static_cast<unsigned int>(strtoul(argv[i], NULL, 10)));
+				break;
+			}
+
+			case 't': {
+				int threadNum = atoi(argv[i]);
+				if (threadNum < 1) {
+					printf("[ERROR] Invalid -t value (should be > 0)\n");
+					return -1;
+				}
+				fm->set_thread_num(threadNum);
+				break;
+			}
+
+			case 'm': {
+				int parallelMode = atoi(argv[i]);
+				if (parallelMode < 0 || parallelMode > 2) {
+					printf("[ERROR] Invalid -m value (should be 0, 1 or 2)\n");
+					return -1;
+				}
+				fm->set_parallel_mode(parallelMode);
+				break;
+			}
+
+			case 'u': {
+				int depth = atoi(argv[i]);
+				if (depth < 0) {
+					printf("[ERROR] Invalid -u value (should be >= 0)\n");
+					return -1;
+				}
+				fm->set_pipeline_depth(depth);
+				break;
+			}
+				
+			case 'a': {
+				int numaMode = atoi(argv[i]);
+				if (numaMode < 0 || numaMode > 2) {
+					printf("[ERROR] Invalid -a value (should be 0, 1 or 2)\n");
+					return -1;
+				}
+				fm->set_numa_mode(numaMode);
+				break;
+			}
 				
 			default:
 				printf("[ERROR] Unknown option: -%c\n", argv[i-1][1]);
@@ -182,6 +549,25 @@ int parse_command_line(fm_n_degree::FM* fm, int argc, char** argv, char* trainFi
 		}
 	}
 
+	if (trainerId < 0 || trainerId >= trainerNum) {
+		printf("[ERROR] Invalid -pi value (should be in [0, %d))\n", trainerNum);
+		return -1;
+	}
+	fm->set_ps_trainer(trainerId, trainerNum);
+	fm->set_early_stop(patience, tolerance);
+	fm->set_neg_sampling(negSampleRate, negResampleFlag);
+	fm->set_selective_backprop(backpropMode, backpropThreshold);
+	if (ckptFile != NULL) {
+		fm->set_checkpoint(ckptFile, ckptInterval);
+	} else if (fm->m_resumeFlag != 0) {
+		printf("[ERROR] -rs needs the checkpoint file of -ck\n");
+		return -1;
+	}
+
+	if (sweepSpec != NULL) {
+		fm->set_sweep(sweepSpec, sweepRandomNum);
+	}
+
 	if (i >= argc) {
 		return -1;
 	}